@@ -0,0 +1,273 @@
+/*!
+ * \file bench.c
+ * \brief Single-threaded benchmark of the objmap hot paths
+ *
+ * For each engine and each map size (1K, 10K, ... up to -n), a map is filled
+ * and then the following are measured:
+ * - push:     objmap_push() into the empty map
+ * - get_seq:  objmap_get() of every handle in the order issued
+ * - get_rand: objmap_get() of every handle in random order
+ * - get_miss: objmap_get() of handles not issued, in random order
+ * - pop:      objmap_pop() of every handle in random order
+ * - flush:    objmap_flush() of a full map
+ * - reset:    objmap_reset() of a full map
+ *
+ * Each operation is run twice. The first run is timed as a whole to give the
+ * throughput; in the second, up to BENCH_LAT_SAMPLES operations spread over
+ * the run are timed individually to give latency percentiles, with the cost
+ * of reading the clock subtracted. For flush and reset, each repetition is
+ * one sample and latencies are per call rather than per object.
+ *
+ * Objects are never dereferenced by the map, so all handles refer to a small
+ * set of static objects and allocation costs are excluded. Besides the map,
+ * two keys per object are needed for the handles and the access order.
+ *
+ * Usage: objmap_bench [-n max_size] [-m min_size] [-e engine,...] [-s seed]
+ *
+ * Engines are hash, slot, gen, sharded, rm, inline, swiss
+ * and flat (default: all).
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <unistd.h>
+#include "bench_util.h"
+
+/* operations timed individually per row in the latency run */
+#define BENCH_LAT_SAMPLES 100000
+
+/* objects flushed (or reset) per map size, spread over repetitions */
+#define BENCH_FLUSH_OBJS 10000000
+#define BENCH_FLUSH_REPS_MAX 100
+
+/* objects pushed into the maps */
+#define BENCH_NOBJS 4096
+static uint64_t objs[BENCH_NOBJS];
+
+enum { OP_PUSH, OP_GET_SEQ, OP_GET_RAND, OP_GET_MISS, OP_POP, OP_FLUSH,
+       OP_RESET, NOPS };
+static const char *const op_names[NOPS] = {
+  "push", "get_seq", "get_rand", "get_miss", "pop", "flush", "reset"
+};
+
+typedef struct {
+  size_t count;        /* operations (objects for flush and reset) */
+  uint64_t ns;         /* total time of the throughput run */
+  uint64_t *lat;       /* latency samples */
+  size_t nlat;         /* number of latency samples */
+} bench_row_t;
+
+typedef struct {
+  const char *engine;  /* engine name */
+  size_t n;            /* map size */
+  int sample;          /* non-zero for the latency run */
+  size_t stride;       /* operations between latency samples */
+  bench_row_t rows[NOPS];
+} bench_t;
+
+static uint64_t timer_cost;
+static volatile uintptr_t sink; /* keeps lookups from being optimised away */
+
+static void bench_record(bench_t *b, int op, uint64_t ns) {
+  bench_row_t *row = &b->rows[op];
+  if (b->sample) return;
+  row->count += b->n;
+  row->ns += ns;
+}
+
+static void bench_sample(bench_t *b, int op, uint64_t ns) {
+  bench_row_t *row = &b->rows[op];
+  row->lat[row->nlat++] = (ns > timer_cost) ? ns - timer_cost : 0;
+}
+
+/* Run STMT for I in [0, b->n). The throughput run times the loop as a
+ * whole; the latency run times every b->stride-th iteration on its own */
+#define BENCH_LOOP(b, op, I, STMT) do { \
+    size_t next_ = (b)->sample ? 0 : (size_t)-1; \
+    uint64_t t0_ = bench_now(), t_; \
+    for (I = 0; I < (b)->n; ++I) { \
+      if (I == next_) { \
+        t_ = bench_now(); \
+        STMT; \
+        bench_sample(b, op, bench_now() - t_); \
+        next_ += (b)->stride; \
+      } else { \
+        STMT; \
+      } \
+    } \
+    bench_record(b, op, bench_now() - t0_); \
+  } while (0)
+
+/* fill the map, untimed. Returns 0 on success */
+static int bench_fill(ObjectMap *om, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    if (objmap_push(om, &objs[i % BENCH_NOBJS]) > OBJMAP_MAX_INDEX) return 1;
+  }
+  return 0;
+}
+
+/* time objmap_flush() (or objmap_reset()) of a full map, repeatedly.
+ * Returns 0 on success */
+static int bench_flush(bench_t *b, ObjectMap *om, int op) {
+  size_t r, reps = BENCH_FLUSH_OBJS / b->n;
+  uint64_t t;
+
+  if (reps < 1) reps = 1;
+  if (reps > BENCH_FLUSH_REPS_MAX) reps = BENCH_FLUSH_REPS_MAX;
+  for (r = 0; r < reps; ++r) {
+    if (bench_fill(om, b->n)) return 1;
+    t = bench_now();
+    if (op == OP_FLUSH) objmap_flush(om);
+    else objmap_reset(om);
+    t = bench_now() - t;
+    b->rows[op].count += b->n;
+    b->rows[op].ns += t;
+    bench_sample(b, op, t);
+    objmap_reset(om); /* rewind keys so slot maps do not grow */
+  }
+  return 0;
+}
+
+/* Run all operations on a map of b->n objects. Returns 0 on success */
+static int bench_run(bench_t *b, ObjectMap *om, objmap_key_t *handles,
+                     const objmap_key_t *order) {
+  objmap_key_t miss;
+  size_t i;
+
+  for (b->sample = 0; b->sample <= 1; ++b->sample) {
+    objmap_reset(om);
+    BENCH_LOOP(b, OP_PUSH, i,
+               handles[i] = objmap_push(om, &objs[i % BENCH_NOBJS]));
+    for (i = 0; i < b->n; ++i) {
+      if (handles[i] > OBJMAP_MAX_INDEX) return 1;
+    }
+    BENCH_LOOP(b, OP_GET_SEQ, i,
+               sink += (uintptr_t)objmap_get(om, handles[i]));
+    BENCH_LOOP(b, OP_GET_RAND, i,
+               sink += (uintptr_t)objmap_get(om, handles[order[i]]));
+    miss = om->top;
+    BENCH_LOOP(b, OP_GET_MISS, i,
+               sink += (uintptr_t)objmap_get(om, miss + order[i]));
+    BENCH_LOOP(b, OP_POP, i,
+               sink += (uintptr_t)objmap_pop(om, handles[order[i]]));
+  }
+
+  objmap_reset(om);
+  if (bench_flush(b, om, OP_FLUSH)) return 1;
+  return bench_flush(b, om, OP_RESET);
+}
+
+static void bench_print(bench_t *b) {
+  int op;
+
+  for (op = 0; op < NOPS; ++op) {
+    bench_row_t *row = &b->rows[op];
+    double secs = (double)row->ns / 1e9;
+
+    bench_sort(row->lat, row->nlat);
+    printf("%s,%s,%s,%lu,%lu,%.6f,%.3f,%lu,%lu,%lu,%lu,%lu\n",
+           BENCH_KEYS, b->engine, op_names[op], (unsigned long)b->n,
+           (unsigned long)row->count, secs,
+           (secs > 0) ? (double)row->count / secs / 1e6 : 0.0,
+           (unsigned long)bench_percentile(row->lat, row->nlat, 0.5),
+           (unsigned long)bench_percentile(row->lat, row->nlat, 0.9),
+           (unsigned long)bench_percentile(row->lat, row->nlat, 0.99),
+           (unsigned long)bench_percentile(row->lat, row->nlat, 0.999),
+           (unsigned long)bench_percentile(row->lat, row->nlat, 1.0));
+  }
+  fflush(stdout);
+}
+
+/* benchmark one engine at one size. Returns 0 on success */
+static int bench_size(const char *engine, size_t n, uint64_t *seed) {
+  bench_t b;
+  ObjectMap *om;
+  objmap_key_t *handles, *order;
+  int op, rc = 1;
+
+  memset(&b, 0, sizeof(b));
+  b.engine = engine;
+  b.n = n;
+  b.stride = (n + BENCH_LAT_SAMPLES - 1) / BENCH_LAT_SAMPLES;
+
+  om = bench_map_new(engine, sizeof(uint64_t));
+  handles = (objmap_key_t*)malloc(n * sizeof(objmap_key_t));
+  order = (objmap_key_t*)malloc(n * sizeof(objmap_key_t));
+  for (op = 0; op < NOPS; ++op) {
+    b.rows[op].lat = (uint64_t*)malloc((BENCH_LAT_SAMPLES +
+                                        BENCH_FLUSH_REPS_MAX) *
+                                       sizeof(uint64_t));
+    if (b.rows[op].lat == NULL) break;
+  }
+
+  if (om == NULL || handles == NULL || order == NULL || op < NOPS) {
+    fprintf(stderr, "%s/%lu: out of memory\n", engine, (unsigned long)n);
+  } else {
+    if (om->engine != OBJMAP_ENGINE_INLINE) {
+      objmap_set_deallocator(om, bench_forget);
+    }
+    bench_permutation(order, n, seed);
+    rc = bench_run(&b, om, handles, order);
+    if (rc) {
+      fprintf(stderr, "%s/%lu: map is full\n", engine, (unsigned long)n);
+    } else {
+      bench_print(&b);
+    }
+  }
+
+  for (op = 0; op < NOPS; ++op) free(b.rows[op].lat);
+  free(order);
+  free(handles);
+  objmap_delete(&om);
+  return rc;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n max_size] [-m min_size] [-e engine,...] [-s seed]\n"
+          "  -n  largest map size, up to 100000000 (default 1000000)\n"
+          "  -m  smallest map size (default 1000)\n"
+          "  -e  engines: hash,slot,gen,sharded,rm,inline,swiss,flat\n"
+          "      (default all)\n"
+          "  -s  random seed (default 1)\n", prog);
+}
+
+int main(int argc, char **argv) {
+  unsigned long max_size = 1000000, min_size = 1000;
+  uint64_t seed = 1;
+  const char *engines = NULL;
+  size_t e, n;
+  int c, rc = 0;
+
+  while ((c = getopt(argc, argv, "n:m:e:s:h")) != -1) {
+    switch (c) {
+      case 'n': max_size = strtoul(optarg, NULL, 10); break;
+      case 'm': min_size = strtoul(optarg, NULL, 10); break;
+      case 'e': engines = optarg; break;
+      case 's': seed = strtoull(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (min_size == 0 || seed == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (engines != NULL &&
+      bench_check_names(engines, "engine", bench_engine_names,
+                        BENCH_NENGINES)) {
+    return 1;
+  }
+
+  timer_cost = bench_timer_overhead();
+  printf("keys,engine,op,size,count,seconds,mops,"
+         "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+  for (e = 0; e < BENCH_NENGINES; ++e) {
+    const char *name = bench_engine_names[e];
+    if (engines != NULL && !bench_in_list(engines, name)) continue;
+    for (n = min_size; n <= max_size; n *= 10) {
+      /* keep going after a failure, but report the first */
+      int r = bench_size(name, n, &seed);
+      if (rc == 0) rc = r;
+    }
+  }
+  return rc;
+}
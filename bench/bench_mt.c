@@ -0,0 +1,428 @@
+/*!
+ * \file bench_mt.c
+ * \brief Multi-threaded contention benchmark for the thread-safe engines
+ *
+ * A map of -n objects is shared by a number of threads which run a mix of
+ * operations on it for a fixed time. Each operation picks a handle at random
+ * from a table holding one handle per object, following a Zipfian
+ * distribution so that some objects are much hotter than others, then:
+ * - read:  objmap_get() of the handle
+ * - write: objmap_push() of a replacement object, whose handle is swapped
+ *          into the table, then objmap_pop() of the handle it replaced
+ *
+ * so the number of objects stays the same. Hot ranks are scattered over the
+ * table so they are not all adjacent handles. For every engine, read
+ * percentage and thread count, a CSV row reports the throughput, the scaling
+ * relative to a single thread (if 1 is among the thread counts, which are
+ * run in the order given) and latency percentiles of reads and writes.
+ * One operation in BENCH_MT_LAT_EVERY is timed.
+ *
+ * Engines are sharded, rm, and mutex: a hashtable behind a single lock, as a
+ * baseline for the others.
+ *
+ * Usage: objmap_bench_mt [-n size] [-t threads,...] [-r read_pct,...]
+ *                        [-z theta] [-d seconds] [-e engine,...] [-s seed]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bench_util.h"
+
+/* handle indices drawn ahead of time per thread (power of 2) */
+#define BENCH_MT_SEQ ((size_t)1 << 20)
+
+/* latency samples kept per thread and operation type (power of 2) */
+#define BENCH_MT_LAT ((size_t)1 << 16)
+
+/* operations between latency samples, and between checks for the end */
+#define BENCH_MT_LAT_EVERY 64
+#define BENCH_MT_CHECK_EVERY 256
+
+#define BENCH_MT_THREADS_MAX 256
+
+static const char *const mt_engine_names[] = { "sharded", "rm", "mutex" };
+#define MT_NENGINES (sizeof(mt_engine_names) / sizeof(mt_engine_names[0]))
+
+/* objects pushed into the map. They are never dereferenced */
+#define BENCH_NOBJS 4096
+static uint64_t objs[BENCH_NOBJS];
+
+static uint64_t timer_cost;
+
+/* state shared by the threads of a run */
+typedef struct {
+  ObjectMap *om;
+  pthread_mutex_t *lock;   /* serialises map calls for "mutex", else NULL */
+  objmap_key_t *table;     /* current handle of each object */
+  unsigned int read_limit; /* operation is a read if (rand & 0xffff) < this */
+  int stop;                /* set when time is up. Accessed atomically */
+  int go;                  /* set once all threads are created */
+  pthread_mutex_t gate;    /* protects go */
+  pthread_cond_t open;     /* signalled when go is set */
+} bench_mt_t;
+
+/* per-thread state and results */
+typedef struct {
+  bench_mt_t *b;
+  uint32_t *seq;           /* handle indices to use, in order */
+  uint64_t seed;
+  size_t ops;
+  uint64_t *lat[2];        /* latency samples of reads and writes */
+  size_t nlat[2];          /* samples taken (may exceed BENCH_MT_LAT) */
+  pthread_t thread;
+} bench_worker_t;
+
+/* Zipfian distribution over [0, n), as in Gray et al., "Quickly generating
+ * billion-record synthetic databases" (SIGMOD 1994). theta is in [0, 1) */
+typedef struct {
+  double n, theta, alpha, zetan, eta, half_pow;
+} bench_zipf_t;
+
+static void zipf_init(bench_zipf_t *z, size_t n, double theta) {
+  double zeta2 = 1.0 + pow(0.5, theta);
+  size_t i;
+
+  z->n = (double)n;
+  z->theta = theta;
+  z->alpha = 1.0 / (1.0 - theta);
+  for (z->zetan = 0, i = 1; i <= n; ++i) z->zetan += pow((double)i, -theta);
+  z->eta = (1.0 - pow(2.0 / z->n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+  z->half_pow = pow(0.5, theta);
+}
+
+static size_t zipf_rank(const bench_zipf_t *z, uint64_t *seed) {
+  double u = (double)(bench_rand(seed) >> 11) / 9007199254740992.0;
+  double uz = u * z->zetan;
+  size_t r;
+
+  if (uz < 1.0) return 0;
+  if (uz < 1.0 + z->half_pow) return 1;
+  r = (size_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return (r < (size_t)z->n) ? r : (size_t)z->n - 1;
+}
+
+static void* mt_get(bench_mt_t *b, objmap_key_t h) {
+  void *obj;
+  if (b->lock == NULL) return objmap_get(b->om, h);
+  pthread_mutex_lock(b->lock);
+  obj = objmap_get(b->om, h);
+  pthread_mutex_unlock(b->lock);
+  return obj;
+}
+
+static void mt_write(bench_mt_t *b, objmap_key_t *slot, void *obj) {
+  objmap_key_t h;
+
+  if (b->lock) pthread_mutex_lock(b->lock);
+  h = objmap_push(b->om, obj);
+  if (b->lock) pthread_mutex_unlock(b->lock);
+  if (h > OBJMAP_MAX_INDEX) return; /* out of keys; keep the old object */
+
+  h = __atomic_exchange_n(slot, h, __ATOMIC_RELAXED);
+  if (b->lock) pthread_mutex_lock(b->lock);
+  objmap_pop(b->om, h);
+  if (b->lock) pthread_mutex_unlock(b->lock);
+}
+
+static void* worker_main(void *arg) {
+  bench_worker_t *w = (bench_worker_t*)arg;
+  bench_mt_t *b = w->b;
+  uintptr_t sink = 0;
+  size_t i = 0;
+
+  pthread_mutex_lock(&b->gate);
+  while (!b->go) pthread_cond_wait(&b->open, &b->gate);
+  pthread_mutex_unlock(&b->gate);
+
+  for (;;) {
+    objmap_key_t *slot = &b->table[w->seq[i & (BENCH_MT_SEQ - 1)]];
+    int read = (bench_rand(&w->seed) & 0xffff) < b->read_limit;
+
+    uint64_t t = (i % BENCH_MT_LAT_EVERY == 0) ? bench_now() : 0;
+
+    if (read) {
+      sink += (uintptr_t)mt_get(b, __atomic_load_n(slot, __ATOMIC_RELAXED));
+    } else {
+      mt_write(b, slot, &objs[i % BENCH_NOBJS]);
+    }
+    if (t != 0) { /* sampled */
+      t = bench_now() - t;
+      w->lat[!read][w->nlat[!read]++ & (BENCH_MT_LAT - 1)] =
+          (t > timer_cost) ? t - timer_cost : 0;
+    }
+
+    ++i;
+    if (i % BENCH_MT_CHECK_EVERY == 0 &&
+        __atomic_load_n(&b->stop, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  w->ops = i;
+  return (void*)sink;
+}
+
+/* merge samples of one operation type over all workers, sorted */
+static size_t merge_lat(bench_worker_t *w, unsigned int nthreads, int type,
+                        uint64_t *out) {
+  size_t i, n = 0;
+  unsigned int t;
+
+  for (t = 0; t < nthreads; ++t) {
+    size_t k = (w[t].nlat[type] < BENCH_MT_LAT) ? w[t].nlat[type]
+                                                : BENCH_MT_LAT;
+    for (i = 0; i < k; ++i) out[n++] = w[t].lat[type][i];
+  }
+  bench_sort(out, n);
+  return n;
+}
+
+typedef struct {
+  const char *engine;
+  size_t n;
+  double theta, seconds;
+  unsigned int read_pct;
+  double base_mops;        /* throughput with 1 thread, or 0 if unknown */
+  bench_worker_t *workers;
+  uint64_t *merged;        /* room for samples of all threads */
+} bench_point_t;
+
+/* create and fill the map for a run. Returns 0 on success */
+static int mt_setup(bench_mt_t *b, const char *engine, size_t n) {
+  size_t i;
+
+  memset(b, 0, sizeof(*b));
+  pthread_mutex_init(&b->gate, NULL);
+  pthread_cond_init(&b->open, NULL);
+  if (strcmp(engine, "mutex") == 0) {
+    b->om = objmap_new();
+    b->lock = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+    if (b->lock == NULL || pthread_mutex_init(b->lock, NULL) != 0) {
+      free(b->lock);
+      b->lock = NULL;
+      objmap_delete(&b->om);
+    }
+  } else {
+    b->om = bench_map_new(engine, sizeof(uint64_t));
+  }
+  b->table = (objmap_key_t*)malloc(n * sizeof(objmap_key_t));
+  if (b->om == NULL || b->table == NULL) return 1;
+
+  objmap_set_deallocator(b->om, bench_forget);
+  for (i = 0; i < n; ++i) {
+    b->table[i] = objmap_push(b->om, &objs[i % BENCH_NOBJS]);
+    if (b->table[i] > OBJMAP_MAX_INDEX) return 1;
+  }
+  return 0;
+}
+
+static void mt_teardown(bench_mt_t *b) {
+  pthread_cond_destroy(&b->open);
+  pthread_mutex_destroy(&b->gate);
+  objmap_delete(&b->om);
+  if (b->lock) {
+    pthread_mutex_destroy(b->lock);
+    free(b->lock);
+  }
+  free(b->table);
+}
+
+/* run one point with nthreads threads and print its row. Returns the
+ * throughput in Mops/s, or a negative value on error */
+static double mt_run(bench_point_t *p, unsigned int nthreads) {
+  bench_mt_t b;
+  bench_worker_t *w = p->workers;
+  struct timespec ts;
+  uint64_t t0, elapsed, pr[3], pw[3];
+  size_t nr, nw, ops = 0;
+  unsigned int t, started;
+  double secs, mops;
+  int i;
+
+  if (mt_setup(&b, p->engine, p->n)) {
+    fprintf(stderr, "%s/%lu: cannot create map\n", p->engine,
+            (unsigned long)p->n);
+    mt_teardown(&b);
+    return -1;
+  }
+  b.read_limit = p->read_pct * 0x10000u / 100;
+
+  for (started = 0; started < nthreads; ++started) {
+    w[started].b = &b;
+    w[started].ops = 0;
+    w[started].nlat[0] = w[started].nlat[1] = 0;
+    if (pthread_create(&w[started].thread, NULL, worker_main, &w[started])) {
+      break;
+    }
+  }
+  if (started < nthreads) { /* let started threads finish straight away */
+    fprintf(stderr, "cannot start %u threads\n", nthreads);
+    __atomic_store_n(&b.stop, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_lock(&b.gate);
+  b.go = 1;
+  pthread_cond_broadcast(&b.open);
+  pthread_mutex_unlock(&b.gate);
+
+  t0 = bench_now();
+  ts.tv_sec = (time_t)p->seconds;
+  ts.tv_nsec = (long)((p->seconds - (double)ts.tv_sec) * 1e9);
+  if (started == nthreads) nanosleep(&ts, NULL);
+  __atomic_store_n(&b.stop, 1, __ATOMIC_RELAXED);
+  for (t = 0; t < started; ++t) {
+    pthread_join(w[t].thread, NULL);
+    ops += w[t].ops;
+  }
+  elapsed = bench_now() - t0;
+  mt_teardown(&b);
+  if (started < nthreads) return -1;
+
+  secs = (double)elapsed / 1e9;
+  mops = (double)ops / secs / 1e6;
+  nr = merge_lat(w, nthreads, 0, p->merged);
+  for (i = 0; i < 3; ++i) {
+    pr[i] = bench_percentile(p->merged, nr, (i == 0) ? 0.5 :
+                             (i == 1) ? 0.99 : 0.999);
+  }
+  nw = merge_lat(w, nthreads, 1, p->merged);
+  for (i = 0; i < 3; ++i) {
+    pw[i] = bench_percentile(p->merged, nw, (i == 0) ? 0.5 :
+                             (i == 1) ? 0.99 : 0.999);
+  }
+
+  printf("%s,%s,%u,%u,%.2f,%lu,%.3f,%lu,%.3f,",
+         BENCH_KEYS, p->engine, nthreads, p->read_pct, p->theta,
+         (unsigned long)p->n, secs, (unsigned long)ops, mops);
+  if (p->base_mops > 0) printf("%.2f", mops / p->base_mops);
+  printf(",%lu,%lu,%lu,%lu,%lu,%lu\n",
+         (unsigned long)pr[0], (unsigned long)pr[1], (unsigned long)pr[2],
+         (unsigned long)pw[0], (unsigned long)pw[1], (unsigned long)pw[2]);
+  fflush(stdout);
+  return mops;
+}
+
+/* parse a comma-separated list of positive numbers. Returns the count, or
+ * 0 if the list is invalid */
+static size_t parse_list(const char *s, unsigned long *out, size_t max) {
+  size_t n = 0;
+  char *end;
+
+  while (*s && n < max) {
+    out[n] = strtoul(s, &end, 10);
+    if (end == s || (*end != ',' && *end != '\0')) return 0;
+    ++n;
+    s = (*end == ',') ? end + 1 : end;
+  }
+  return (*s == '\0') ? n : 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n size] [-t threads,...] [-r read_pct,...] "
+          "[-z theta]\n"
+          "          [-d seconds] [-e engine,...] [-s seed]\n"
+          "  -n  number of objects in the map (default 1000000)\n"
+          "  -t  thread counts (default 1,2,4,8)\n"
+          "  -r  percentages of reads (default 100,95,50)\n"
+          "  -z  Zipfian skew in [0, 1), 0 being uniform (default 0.99)\n"
+          "  -d  duration of each run in seconds (default 1)\n"
+          "  -e  engines: sharded,rm,mutex (default all)\n"
+          "  -s  random seed (default 1)\n", prog);
+}
+
+int main(int argc, char **argv) {
+  unsigned long threads[64] = {1, 2, 4, 8}, reads[64] = {100, 95, 50};
+  size_t nthreads = 4, nreads = 3, e, i, j, k, maxthreads = 0;
+  const char *engines = NULL;
+  bench_point_t p;
+  bench_zipf_t z;
+  uint64_t seed = 1;
+  int c, rc = 0;
+
+  memset(&p, 0, sizeof(p));
+  memset(&z, 0, sizeof(z));
+  p.n = 1000000;
+  p.theta = 0.99;
+  p.seconds = 1.0;
+  while ((c = getopt(argc, argv, "n:t:r:z:d:e:s:h")) != -1) {
+    switch (c) {
+      case 'n': p.n = strtoul(optarg, NULL, 10); break;
+      case 't': nthreads = parse_list(optarg, threads, 64); break;
+      case 'r': nreads = parse_list(optarg, reads, 64); break;
+      case 'z': p.theta = strtod(optarg, NULL); break;
+      case 'd': p.seconds = strtod(optarg, NULL); break;
+      case 'e': engines = optarg; break;
+      case 's': seed = strtoull(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  for (i = 0; i < nthreads; ++i) {
+    if (threads[i] == 0 || threads[i] > BENCH_MT_THREADS_MAX) nthreads = 0;
+    else if (threads[i] > maxthreads) maxthreads = threads[i];
+  }
+  for (i = 0; i < nreads; ++i) {
+    if (reads[i] > 100) nreads = 0;
+  }
+  if (p.n == 0 || p.n > UINT32_MAX || nthreads == 0 || nreads == 0 ||
+      p.theta < 0 || p.theta >= 1 || p.seconds <= 0 || seed == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (engines != NULL &&
+      bench_check_names(engines, "engine", mt_engine_names, MT_NENGINES)) {
+    return 1;
+  }
+
+  /* draw handle indices for each thread */
+  p.workers = (bench_worker_t*)calloc(maxthreads, sizeof(bench_worker_t));
+  p.merged = (uint64_t*)malloc(maxthreads * BENCH_MT_LAT * sizeof(uint64_t));
+  if (p.workers == NULL || p.merged == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  if (p.theta > 0) zipf_init(&z, p.n, p.theta);
+  for (i = 0; i < maxthreads; ++i) {
+    bench_worker_t *w = &p.workers[i];
+    w->seq = (uint32_t*)malloc(BENCH_MT_SEQ * sizeof(uint32_t));
+    w->lat[0] = (uint64_t*)malloc(BENCH_MT_LAT * sizeof(uint64_t));
+    w->lat[1] = (uint64_t*)malloc(BENCH_MT_LAT * sizeof(uint64_t));
+    if (w->seq == NULL || w->lat[0] == NULL || w->lat[1] == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    for (j = 0; j < BENCH_MT_SEQ; ++j) {
+      /* scatter ranks so hot objects are not adjacent */
+      uint64_t r = (p.theta > 0) ? zipf_rank(&z, &seed)
+                                 : bench_rand_below(&seed, p.n);
+      w->seq[j] = (uint32_t)((r * 0x9E3779B97F4A7C15ULL) % p.n);
+    }
+    w->seed = bench_rand(&seed) | 1;
+  }
+
+  timer_cost = bench_timer_overhead();
+  printf("keys,engine,threads,read_pct,theta,size,seconds,ops,mops,scaling,"
+         "read_p50_ns,read_p99_ns,read_p999_ns,"
+         "write_p50_ns,write_p99_ns,write_p999_ns\n");
+  for (e = 0; e < MT_NENGINES; ++e) {
+    p.engine = mt_engine_names[e];
+    if (engines != NULL && !bench_in_list(engines, p.engine)) continue;
+    for (j = 0; j < nreads; ++j) {
+      p.read_pct = (unsigned int)reads[j];
+      p.base_mops = 0;
+      for (k = 0; k < nthreads; ++k) {
+        double mops = mt_run(&p, (unsigned int)threads[k]);
+        if (mops < 0) rc = 1;
+        else if (threads[k] == 1) p.base_mops = mops;
+      }
+    }
+  }
+
+  for (i = 0; i < maxthreads; ++i) {
+    free(p.workers[i].seq);
+    free(p.workers[i].lat[0]);
+    free(p.workers[i].lat[1]);
+  }
+  free(p.workers);
+  free(p.merged);
+  return rc;
+}
@@ -0,0 +1,198 @@
+/*!
+ * \file bench_probe.c
+ * \brief Probe lengths of the hashtable engine for structured handles
+ *
+ * The hashtable engine (::OBJMAP_ENGINE_HASH) is filled with handles of a
+ * given pattern, then probe length histograms are read with om_hash_stats()
+ * and lookups of stored and absent handles of the same pattern are timed.
+ * Patterns are:
+ * - seq:    consecutive handles, as issued by objmap_push()
+ * - sparse: one handle in every 10, as left by heavy churn
+ * - high:   consecutive values shifted into the high bits of the key, so the
+ *           low bits of every handle are 0. Handles encoding a shard or
+ *           generation in their high bits vary in much the same way
+ *
+ * Handles are stored with om_hash_put(), the routine behind objmap_push(),
+ * since objmap_push() only issues consecutive handles. The hash function is
+ * chosen when the library is built (see ::OBJMAP_HASH), so the benchmark is
+ * built once for each.
+ *
+ * One CSV row is printed per pattern, size and kind of lookup (hit or miss),
+ * holding the load factor, the mean and 99th percentile probe length (in
+ * buckets, with lengths of 16 or more counted as 16), the mean time per
+ * lookup and the histogram of probe lengths 1 to 16.
+ *
+ * Usage: objmap_bench_probe [-n max_size] [-m min_size] [-p pattern,...]
+ *                           [-s seed]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <unistd.h>
+#include "bench_util.h"
+#include "objmap/objmap_internal.h"
+
+#if OBJMAP_HASH == OBJMAP_HASH_FIBONACCI
+#define BENCH_HASH "fibonacci"
+#else
+#define BENCH_HASH "khash"
+#endif
+
+#define BENCH_KEY_BITS (sizeof(objmap_key_t) * 8)
+
+enum { PAT_SEQ, PAT_SPARSE, PAT_HIGH, NPATTERNS };
+static const char *const pattern_names[NPATTERNS] = {
+  "seq", "sparse", "high"
+};
+
+static volatile uintptr_t sink; /* keeps lookups from being optimised away */
+static uint64_t obj;
+
+/* i-th handle (from 0) of a pattern. shift is used by PAT_HIGH */
+static objmap_key_t bench_key(int pattern, size_t i, unsigned int shift) {
+  switch (pattern) {
+    case PAT_SPARSE: return (objmap_key_t)(i * 10 + 1);
+    case PAT_HIGH: return (objmap_key_t)(i + 1) << shift;
+    default: return (objmap_key_t)(i + 1);
+  }
+}
+
+/* histogram value below which a fraction p of lookups fall */
+static size_t bench_hist_percentile(const size_t *hist, double p) {
+  size_t i, total = 0, seen = 0;
+  for (i = 0; i < OBJMAP_PROBE_HIST; ++i) total += hist[i];
+  for (i = 0; i < OBJMAP_PROBE_HIST; ++i) {
+    seen += hist[i];
+    if ((double)seen >= p * (double)total) return i + 1;
+  }
+  return OBJMAP_PROBE_HIST;
+}
+
+static void bench_print(const char *pattern, size_t n, const char *lookup,
+                        const objmap_stats_t *st, const size_t *hist,
+                        double ns) {
+  size_t i, total = 0, sum = 0;
+
+  for (i = 0; i < OBJMAP_PROBE_HIST; ++i) {
+    total += hist[i];
+    sum += hist[i] * (i + 1);
+  }
+  printf("%s,%s,%s,%lu,%s,%.3f,%.3f,%lu,%.1f", BENCH_KEYS, BENCH_HASH,
+         pattern, (unsigned long)n, lookup, st->load,
+         total ? (double)sum / (double)total : 0.0,
+         (unsigned long)bench_hist_percentile(hist, 0.99), ns);
+  for (i = 0; i < OBJMAP_PROBE_HIST; ++i) {
+    printf(",%lu", (unsigned long)hist[i]);
+  }
+  printf("\n");
+}
+
+/* benchmark one pattern at one size. Returns 0 on success */
+static int bench_size(int pattern, size_t n, uint64_t *seed) {
+  ObjectMap *om = objmap_new();
+  objmap_key_t *order = (objmap_key_t*)malloc(n * sizeof(objmap_key_t));
+  objmap_stats_t st;
+  unsigned int shift = 0;
+  uint64_t t, hit_ns, miss_ns;
+  size_t i;
+  int rc = 1;
+
+  /* PAT_HIGH: leave room for 2n handles (hits and misses) below
+   * OBJMAP_MAX_INDEX, with as many low zero bits as possible */
+  while (((uint64_t)2 * n + 1) >> (BENCH_KEY_BITS - 2 - shift) == 0) ++shift;
+
+  if (om == NULL || order == NULL) {
+    fprintf(stderr, "%s/%lu: out of memory\n", pattern_names[pattern],
+            (unsigned long)n);
+    goto done;
+  }
+  objmap_set_deallocator(om, objmap_no_dealloc);
+  for (i = 0; i < n; ++i) {
+    if (om_hash_put(om, bench_key(pattern, i, shift), &obj) >
+        OBJMAP_MAX_INDEX) {
+      fprintf(stderr, "%s/%lu: map is full\n", pattern_names[pattern],
+              (unsigned long)n);
+      goto done;
+    }
+  }
+  bench_permutation(order, n, seed);
+
+  t = bench_now();
+  for (i = 0; i < n; ++i) {
+    sink += (uintptr_t)objmap_get(om, bench_key(pattern, order[i], shift));
+  }
+  hit_ns = bench_now() - t;
+  t = bench_now();
+  for (i = 0; i < n; ++i) {
+    sink += (uintptr_t)objmap_get(om,
+                                  bench_key(pattern, n + order[i], shift));
+  }
+  miss_ns = bench_now() - t;
+
+  /* om_hash_put() leaves om->top alone, so misses are sampled from the
+   * handle after the largest stored, which for "sparse" and "high" is not
+   * itself a handle of the pattern. The load is worked out as by
+   * objmap_stats() */
+  memset(&st, 0, sizeof(st));
+  om_hash_stats(om, bench_key(pattern, n - 1, shift) + 1, &st);
+  st.load = (double)(st.live + st.tombstones) / (double)st.buckets;
+  bench_print(pattern_names[pattern], n, "hit", &st, st.probe_hit,
+              (double)hit_ns / (double)n);
+  bench_print(pattern_names[pattern], n, "miss", &st, st.probe_miss,
+              (double)miss_ns / (double)n);
+  fflush(stdout);
+  rc = 0;
+
+done:
+  free(order);
+  objmap_delete(&om);
+  return rc;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n max_size] [-m min_size] [-p pattern,...] [-s seed]\n"
+          "  -n  largest map size (default 1000000)\n"
+          "  -m  smallest map size (default 1000)\n"
+          "  -p  patterns: seq,sparse,high (default all)\n"
+          "  -s  random seed (default 1)\n", prog);
+}
+
+int main(int argc, char **argv) {
+  unsigned long max_size = 1000000, min_size = 1000;
+  uint64_t seed = 1;
+  const char *patterns = NULL;
+  size_t n;
+  int c, p, rc = 0;
+
+  while ((c = getopt(argc, argv, "n:m:p:s:h")) != -1) {
+    switch (c) {
+      case 'n': max_size = strtoul(optarg, NULL, 10); break;
+      case 'm': min_size = strtoul(optarg, NULL, 10); break;
+      case 'p': patterns = optarg; break;
+      case 's': seed = strtoull(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (min_size == 0 || seed == 0 || max_size > OBJMAP_MAX_INDEX / 20) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (patterns != NULL &&
+      bench_check_names(patterns, "pattern", pattern_names, NPATTERNS)) {
+    return 1;
+  }
+
+  printf("keys,hash,pattern,size,lookup,load,mean,p99,ns");
+  for (p = 1; p <= OBJMAP_PROBE_HIST; ++p) printf(",n%d", p);
+  printf("\n");
+  for (p = 0; p < NPATTERNS; ++p) {
+    if (patterns != NULL && !bench_in_list(patterns, pattern_names[p])) {
+      continue;
+    }
+    for (n = min_size; n <= max_size; n *= 10) {
+      /* keep going after a failure, but report the first */
+      int r = bench_size(p, n, &seed);
+      if (rc == 0) rc = r;
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,146 @@
+/*!
+ * \file bench_util.h
+ * \brief Timing, random numbers and engine selection shared by the benchmarks
+ *
+ * Results are printed as CSV on stdout so they can be compared between runs
+ * and builds. Progress and errors go to stderr.
+ */
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "objmap/objmap.h"
+
+/*! \brief Name of the key width the benchmark was built with */
+#ifdef OBJMAP_USE_64BIT_KEYS
+#define BENCH_KEYS "64"
+#else
+#define BENCH_KEYS "32"
+#endif
+
+/*! \brief Engine names accepted on the command line, indexed by engine */
+static const char *const bench_engine_names[] = {
+  "hash", "slot", "gen", "sharded", "rm", "inline", "swiss", "flat"
+};
+#define BENCH_NENGINES \
+  (sizeof(bench_engine_names) / sizeof(bench_engine_names[0]))
+
+/*! \brief Monotonic time in nanoseconds */
+static inline uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*! \brief Cost of a call to bench_now(), subtracted from timed operations */
+static inline uint64_t bench_timer_overhead(void) {
+  uint64_t best = (uint64_t)-1;
+  int i;
+  for (i = 0; i < 1000; ++i) {
+    uint64_t t0 = bench_now(), t1 = bench_now();
+    if (t1 - t0 < best) best = t1 - t0;
+  }
+  return best;
+}
+
+/*! \brief xorshift64* generator. State must not be 0 */
+static inline uint64_t bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*! \brief Random number in [0, n) */
+static inline uint64_t bench_rand_below(uint64_t *state, uint64_t n) {
+  return (uint64_t)(((double)(bench_rand(state) >> 11) / 9007199254740992.0)
+                    * (double)n);
+}
+
+/*! \brief Random permutation of 0 .. n-1 */
+static inline void bench_permutation(objmap_key_t *a, size_t n,
+                                     uint64_t *state) {
+  size_t i;
+  for (i = 0; i < n; ++i) a[i] = (objmap_key_t)i;
+  for (i = n; i > 1; --i) {
+    size_t j = (size_t)bench_rand_below(state, i);
+    objmap_key_t t = a[i - 1];
+    a[i - 1] = a[j];
+    a[j] = t;
+  }
+}
+
+static inline int bench_cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*! \brief Sort latency samples so percentiles can be read off */
+static inline void bench_sort(uint64_t *ns, size_t n) {
+  qsort(ns, n, sizeof(uint64_t), bench_cmp_u64);
+}
+
+/*! \brief Percentile p (0 to 1) of n sorted samples, or 0 if none */
+static inline uint64_t bench_percentile(const uint64_t *ns, size_t n,
+                                        double p) {
+  size_t i;
+  if (n == 0) return 0;
+  i = (size_t)(p * (double)n);
+  return ns[(i < n) ? i : n - 1];
+}
+
+/*! \brief Create a map for the named engine, or NULL if the name is unknown.
+ * Inline maps store objects of \c object_size bytes */
+static inline ObjectMap* bench_map_new(const char *name, size_t object_size) {
+  size_t e;
+  for (e = 0; e < BENCH_NENGINES; ++e) {
+    if (strcmp(name, bench_engine_names[e]) != 0) continue;
+    if (e == OBJMAP_ENGINE_INLINE) return objmap_new_inline(object_size, 0);
+    return objmap_new_engine((objmap_engine_t)e);
+  }
+  return NULL;
+}
+
+/*! \brief Whether \c name appears in a comma-separated \c list */
+static inline int bench_in_list(const char *list, const char *name) {
+  size_t len = strlen(name);
+  while (*list) {
+    size_t tok = strcspn(list, ",");
+    if (tok == len && strncmp(list, name, len) == 0) return 1;
+    list += tok;
+    if (*list == ',') ++list;
+  }
+  return 0;
+}
+
+/*! \brief Check a comma-separated list of names against the \c n known
+ * \c names, reporting the first unknown one as an unknown \c what. Returns 0
+ * if all are known */
+static inline int bench_check_names(const char *list, const char *what,
+                                    const char *const *names, size_t n) {
+  while (*list) {
+    size_t e, tok = strcspn(list, ",");
+    for (e = 0; e < n; ++e) {
+      if (strlen(names[e]) == tok && strncmp(list, names[e], tok) == 0) break;
+    }
+    if (e == n) {
+      fprintf(stderr, "unknown %s: %.*s\n", what, (int)tok, list);
+      return 1;
+    }
+    list += tok;
+    if (*list == ',') ++list;
+  }
+  return 0;
+}
+
+/*! \brief Deallocator for benchmark objects, which are not heap allocated */
+static inline void bench_forget(void *obj) {
+  (void)obj;
+}
+
+#endif  /* BENCH_UTIL_H_ */
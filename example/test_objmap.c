@@ -0,0 +1,1316 @@
+/*!
+ * \file test_objmap.c
+ * \brief Behaviour tests for the object mapper and its storage engines
+ *
+ * Each storage engine is put through the same basic checks, followed by
+ * checks specific to each engine and feature. Failures are reported with
+ * assert(), so this must not be built with NDEBUG.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "objmap/objmap.h"
+
+/* number of objects used by most checks. More than one page of the paged
+ * engines, so page boundaries are crossed */
+#define N 10000
+
+/* engines created with objmap_new_engine() */
+static const objmap_engine_t engines[] = {
+  OBJMAP_ENGINE_HASH, OBJMAP_ENGINE_SLOT, OBJMAP_ENGINE_GENERATIONAL,
+  OBJMAP_ENGINE_SHARDED, OBJMAP_ENGINE_READ_MOSTLY, OBJMAP_ENGINE_SWISS,
+  OBJMAP_ENGINE_FLAT
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/* number of objects passed to count_free() */
+static size_t nfreed;
+
+static void count_free(void *obj) {
+  ++nfreed;
+  free(obj);
+}
+
+/* new object holding i */
+static size_t* new_obj(size_t i) {
+  size_t *obj = (size_t*)malloc(sizeof(size_t));
+  assert(obj != NULL);
+  *obj = i;
+  return obj;
+}
+
+/* push n new objects holding 0 to n-1, storing their handles */
+static void push_objs(ObjectMap *om, objmap_key_t *handles, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    handles[i] = objmap_push(om, new_obj(i));
+    assert(handles[i] != OBJMAP_NULL && handles[i] <= OBJMAP_MAX_INDEX);
+  }
+}
+
+/* sum of the values 0 to n-1 that are not multiples of k */
+static size_t sum_live(size_t n, size_t k) {
+  size_t i, sum = 0;
+  for (i = 0; i < n; ++i) {
+    if (i % k != 0) sum += i;
+  }
+  return sum;
+}
+
+/* ------------------------------------------------------------------------
+ * Iteration
+ * ------------------------------------------------------------------------ */
+typedef struct {
+  size_t count; /* objects visited */
+  size_t sum;   /* sum of their values */
+  size_t stop;  /* number of objects after which to stop, or 0 */
+} visit_t;
+
+static int visit(objmap_key_t handle, void *obj, void *ctx) {
+  visit_t *v = (visit_t*)ctx;
+  assert(handle != OBJMAP_NULL && handle <= OBJMAP_MAX_INDEX);
+  ++v->count;
+  v->sum += *(size_t*)obj;
+  return (v->count == v->stop) ? 42 : 0;
+}
+
+/* as visit(), but called from several threads at once */
+static pthread_mutex_t visit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int visit_locked(objmap_key_t handle, void *obj, void *ctx) {
+  int rc;
+  pthread_mutex_lock(&visit_lock);
+  rc = visit(handle, obj, ctx);
+  pthread_mutex_unlock(&visit_lock);
+  return rc;
+}
+
+/* pop and free each object visited */
+static int pop_visit(objmap_key_t handle, void *obj, void *ctx) {
+  assert(objmap_pop((ObjectMap*)ctx, handle) == obj);
+  free(obj);
+  return 0;
+}
+
+/* iterating over the map visits count objects whose values add up to sum,
+ * each under its own handle */
+static void check_iterate(ObjectMap *om, size_t count, size_t sum) {
+  visit_t v = {0, 0, 0};
+  objmap_iter_t it;
+  objmap_key_t handle;
+  void *obj;
+
+  assert(objmap_foreach(om, visit, &v) == 0);
+  assert(v.count == count && v.sum == sum);
+
+  v.count = v.sum = 0;
+  objmap_iter_init(&it, om);
+  while (objmap_iter_next(&it, &handle, &obj)) {
+    assert(objmap_get(om, handle) == obj);
+    visit(handle, obj, &v);
+  }
+  assert(v.count == count && v.sum == sum);
+  assert(objmap_iter_next(&it, &handle, &obj) == 0);
+
+  v.count = v.sum = 0;
+  assert(objmap_parallel_foreach(om, visit_locked, &v, 4) == 0);
+  assert(v.count == count && v.sum == sum);
+  v.count = v.sum = 0;
+  assert(objmap_parallel_foreach(om, visit_locked, &v, 0) == 0);
+  assert(v.count == count && v.sum == sum);
+
+  /* stopping early */
+  if (count > 1) {
+    v.count = v.sum = 0;
+    v.stop = count / 2;
+    assert(objmap_foreach(om, visit, &v) == 42 && v.count == count / 2);
+    v.count = v.sum = 0;
+    assert(objmap_parallel_foreach(om, visit_locked, &v, 4) == 42);
+    assert(v.count >= count / 2 && v.count <= count);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Checks common to all engines
+ * ------------------------------------------------------------------------ */
+static void check_basic(ObjectMap *om) {
+  static objmap_key_t h[N];
+  size_t i, npopped = 0;
+  size_t *obj;
+
+  /* empty map */
+  assert(objmap_get(om, OBJMAP_NULL) == NULL);
+  assert(objmap_get(om, 1) == NULL);
+  assert(objmap_pop(om, 12345) == NULL);
+  check_iterate(om, 0, 0);
+  objmap_flush(om);
+
+  /* every object is found under its own handle */
+  push_objs(om, h, N);
+  for (i = 0; i < N; ++i) {
+    obj = (size_t*)objmap_get(om, h[i]);
+    assert(obj != NULL && *obj == i);
+  }
+
+  /* popped objects are handed back once and no longer found */
+  for (i = 0; i < N; i += 3) {
+    obj = (size_t*)objmap_pop(om, h[i]);
+    assert(obj != NULL && *obj == i);
+    free(obj);
+    ++npopped;
+    assert(objmap_pop(om, h[i]) == NULL);
+  }
+  for (i = 0; i < N; ++i) {
+    obj = (size_t*)objmap_get(om, h[i]);
+    if (i % 3 == 0) {
+      assert(obj == NULL);
+    } else {
+      assert(obj != NULL && *obj == i);
+    }
+  }
+  check_iterate(om, N - npopped, sum_live(N, 3));
+
+  /* flushing deallocates remaining objects only */
+  objmap_set_deallocator(om, count_free);
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == N - npopped);
+  for (i = 0; i < N; ++i) assert(objmap_get(om, h[i]) == NULL);
+  check_iterate(om, 0, 0);
+
+  /* the map is still usable, and objects may be popped while visited
+   * (except in sharded maps, which are locked while visited) */
+  push_objs(om, h, N);
+  if (om->engine != OBJMAP_ENGINE_SHARDED) {
+    assert(objmap_foreach(om, pop_visit, om) == 0);
+    check_iterate(om, 0, 0);
+    push_objs(om, h, N);
+  }
+
+  /* deleting the map deallocates what is left */
+  objmap_reset(om);
+  push_objs(om, h, 100);
+  nfreed = 0;
+  objmap_delete(&om);
+  assert(om == NULL);
+  assert(nfreed == 100);
+}
+
+/* ------------------------------------------------------------------------
+ * OBJMAP_ENGINE_SLOT
+ * ------------------------------------------------------------------------ */
+static void check_slot(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_SLOT);
+  size_t i;
+
+  assert(om != NULL && om->engine == OBJMAP_ENGINE_SLOT);
+
+  /* handles are issued incrementally and never reused */
+  push_objs(om, h, N);
+  for (i = 1; i < N; ++i) assert(h[i] == h[i - 1] + 1);
+  free(objmap_pop(om, h[N - 1]));
+  assert(objmap_push(om, new_obj(N)) == h[N - 1] + 1);
+
+  /* compacting releases emptied pages but keeps remaining objects */
+  for (i = 0; i < N / 2; ++i) free(objmap_pop(om, h[i]));
+  objmap_compact(om);
+  for (i = 0; i < N - 1; ++i) {
+    size_t *obj = (size_t*)objmap_get(om, h[i]);
+    assert((i < N / 2) ? obj == NULL : (obj != NULL && *obj == i));
+  }
+  assert(objmap_push(om, new_obj(N)) == h[N - 1] + 2);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * OBJMAP_ENGINE_GENERATIONAL
+ * ------------------------------------------------------------------------ */
+#define GEN_INDEX_MASK \
+  (((objmap_key_t)1 << (sizeof(objmap_key_t) * 8 - OBJMAP_GEN_BITS)) - 1)
+
+static void check_gen(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_GENERATIONAL);
+  objmap_key_t first, stale;
+  size_t i, *obj;
+  unsigned long reuses;
+
+  assert(om != NULL && om->engine == OBJMAP_ENGINE_GENERATIONAL);
+  objmap_set_deallocator(om, count_free);
+
+  /* a popped slot is reused under a new handle, and the stale handle is
+   * rejected */
+  first = objmap_push(om, new_obj(0));
+  free(objmap_pop(om, first));
+  h[0] = objmap_push(om, new_obj(1));
+  assert(h[0] != first);
+  assert((h[0] & GEN_INDEX_MASK) == (first & GEN_INDEX_MASK));
+  assert(objmap_get(om, first) == NULL);
+  assert(objmap_pop(om, first) == NULL);
+  obj = (size_t*)objmap_get(om, h[0]);
+  assert(obj != NULL && *obj == 1);
+
+  /* heavy churn reuses slots rather than issuing new keys */
+  for (i = 0; i < 10 * N; ++i) {
+    objmap_key_t k = objmap_push(om, new_obj(i));
+    assert(k <= OBJMAP_MAX_INDEX && (k & GEN_INDEX_MASK) <= 2);
+    free(objmap_pop(om, k));
+  }
+
+  /* a stale handle is only reissued once its slot has been reused through
+   * every generation but the last */
+  objmap_flush(om);
+  stale = objmap_push(om, new_obj(0));
+  free(objmap_pop(om, stale));
+  objmap_flush(om);
+  for (reuses = 1; ; ++reuses) {
+    objmap_key_t k;
+    push_objs(om, h, 2); /* both slots, so stale's slot is reused once */
+    k = ((h[0] & GEN_INDEX_MASK) == (stale & GEN_INDEX_MASK)) ? h[0] : h[1];
+    objmap_flush(om);
+    if (k == stale) break;
+    assert(reuses < ((unsigned long)1 << OBJMAP_GEN_BITS));
+  }
+  assert(reuses == ((unsigned long)1 << OBJMAP_GEN_BITS) - 1);
+
+  /* resetting keeps generations, so stale handles stay invalid */
+  push_objs(om, h, N);
+  objmap_reset(om);
+  for (i = 0; i < N; ++i) assert(objmap_get(om, h[i]) == NULL);
+  first = objmap_push(om, new_obj(0));
+  for (i = 0; i < N; ++i) assert(h[i] != first);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Flushing OBJMAP_ENGINE_HASH by visiting logged keys
+ * ------------------------------------------------------------------------ */
+static void check_hash_flush(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new();
+  size_t i;
+
+  assert(om != NULL);
+  objmap_set_deallocator(om, count_free);
+
+  /* few objects in a large table are flushed through the log, skipping
+   * popped objects */
+  assert(objmap_reserve(om, (size_t)1 << 20) == 0);
+  push_objs(om, h, 100);
+  for (i = 0; i < 100; i += 2) free(objmap_pop(om, h[i]));
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == 50);
+  for (i = 0; i < 100; ++i) assert(objmap_get(om, h[i]) == NULL);
+
+  /* the table is left usable, and flushed again correctly */
+  push_objs(om, h, 100);
+  for (i = 0; i < 100; ++i) assert(*(size_t*)objmap_get(om, h[i]) == i);
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == 100);
+
+  /* churn fills the log with popped keys, which must not be deallocated */
+  push_objs(om, h, 5);
+  for (i = 0; i < 10 * N; ++i) {
+    free(objmap_pop(om, objmap_push(om, new_obj(i))));
+  }
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == 5);
+
+  /* after a reset the same handles are issued and logged again */
+  push_objs(om, h, 3);
+  objmap_reset(om);
+  push_objs(om, h, 3);
+  assert(h[0] == 1);
+  free(objmap_pop(om, h[0]));
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == 2);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Shrinking OBJMAP_ENGINE_HASH
+ * ------------------------------------------------------------------------ */
+/* number of buckets of a map */
+static size_t nbuckets(ObjectMap *om) {
+  objmap_stats_t st;
+  objmap_stats(om, &st);
+  return st.buckets;
+}
+
+/* pop and free all but every 1000th of n objects */
+static void pop_most(ObjectMap *om, const objmap_key_t *handles, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    if (i % 1000 != 0) free(objmap_pop(om, handles[i]));
+  }
+}
+
+/* objects left by pop_most() are still found */
+static void check_left(ObjectMap *om, const objmap_key_t *handles, size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    size_t *obj = (size_t*)objmap_get(om, handles[i]);
+    assert((i % 1000 != 0) ? obj == NULL : (obj != NULL && *obj == i));
+  }
+}
+
+static void check_shrink(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new();
+  objmap_stats_t st;
+  size_t full;
+
+  /* tables do not shrink by default, but can be compacted */
+  push_objs(om, h, N);
+  full = nbuckets(om);
+  pop_most(om, h, N);
+  assert(nbuckets(om) == full);
+  objmap_compact(om);
+  objmap_stats(om, &st);
+  assert(st.buckets < full / 100 && st.tombstones == 0);
+  check_left(om, h, N);
+  objmap_delete(&om);
+
+  /* with a threshold, tables shrink as objects are popped and grow again */
+  om = objmap_new();
+  objmap_set_shrink_threshold(om, 0.1);
+  push_objs(om, h, N);
+  pop_most(om, h, N);
+  assert(nbuckets(om) < full / 10);
+  check_left(om, h, N);
+  push_objs(om, h, N);
+  assert(nbuckets(om) >= full);
+  objmap_flush(om);
+  assert(nbuckets(om) < full / 10);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Hashtables leaving tombstones
+ * ------------------------------------------------------------------------ */
+#define CHURN_LIVE 1000
+
+/* churn with a steady number of live objects reuses the buckets of popped
+ * objects, so the table stops growing */
+static void check_churn(objmap_engine_t engine) {
+  static objmap_key_t h[2 * CHURN_LIVE];
+  ObjectMap *om = objmap_new_engine(engine);
+  objmap_stats_t st;
+  size_t round, i, buckets = 0;
+
+  assert(om != NULL);
+  for (round = 0; round < 50; ++round) {
+    objmap_key_t *fresh = h + (round % 2) * CHURN_LIVE;
+    objmap_key_t *old = h + (1 - round % 2) * CHURN_LIVE;
+
+    push_objs(om, fresh, CHURN_LIVE);
+    for (i = 0; round > 0 && i < CHURN_LIVE; ++i) {
+      size_t *obj = (size_t*)objmap_pop(om, old[i]);
+      assert(obj != NULL && *obj == i);
+      free(obj);
+      assert(objmap_get(om, old[i]) == NULL);
+    }
+    for (i = 0; i < CHURN_LIVE; ++i) {
+      assert(*(size_t*)objmap_get(om, fresh[i]) == i);
+    }
+    objmap_stats(om, &st);
+    assert(st.live == CHURN_LIVE);
+    assert(st.live + st.tombstones <= st.buckets);
+    if (round == 1) buckets = st.buckets;
+    if (round > 1) assert(st.buckets == buckets);
+  }
+  objmap_delete(&om);
+}
+
+static void check_swiss(void) {
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_SWISS);
+  objmap_stats_t st;
+  objmap_key_t h;
+
+  /* a bucket in a group with empty buckets is freed without a tombstone */
+  assert(om != NULL);
+  h = objmap_push(om, new_obj(0));
+  free(objmap_pop(om, h));
+  objmap_stats(om, &st);
+  assert(st.live == 0 && st.tombstones == 0 && st.buckets > 0);
+  assert(objmap_get(om, h) == NULL && objmap_pop(om, h) == NULL);
+  objmap_delete(&om);
+
+  check_churn(OBJMAP_ENGINE_SWISS);
+}
+
+/* keys marking empty and deleted buckets are never found, even in a table
+ * holding tombstones, and deleted buckets are reused by later pushes */
+static void check_flat_reserved(void) {
+  static objmap_key_t h[N];
+  static const objmap_key_t reserved[] = {
+    OBJMAP_NULL, OBJMAP_ERR_INTERNAL, OBJMAP_ERR_OVERFLOW, OBJMAP_MAX_INDEX
+  };
+  size_t nreserved = sizeof(reserved) / sizeof(reserved[0]);
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_FLAT);
+  objmap_stats_t before, after;
+  void *out[4];
+  size_t i, n, r;
+
+  /* popping from tables of every size, newest first, leaves tombstones in
+   * many places, some of them where reserved keys are looked up */
+  assert(om != NULL);
+  for (n = 16; n <= N; n *= 2) {
+    push_objs(om, h, n);
+    for (i = n; i > 0; --i) {
+      free(objmap_pop(om, h[i - 1]));
+      for (r = 0; r < nreserved; ++r) {
+        assert(objmap_get(om, reserved[r]) == NULL);
+        assert(objmap_pop(om, reserved[r]) == NULL);
+      }
+    }
+  }
+  push_objs(om, h, N);
+  for (i = 0; i < N; i += 2) free(objmap_pop(om, h[i]));
+  objmap_stats(om, &before);
+  assert(before.tombstones > 0);
+  for (i = 0; i < nreserved; ++i) {
+    assert(objmap_get(om, reserved[i]) == NULL);
+    assert(objmap_pop(om, reserved[i]) == NULL);
+  }
+  assert(objmap_get_n(om, reserved, nreserved, out) == 0);
+  for (i = 0; i < nreserved; ++i) assert(out[i] == NULL);
+  objmap_stats(om, &after);
+  assert(after.live == before.live && after.tombstones == before.tombstones);
+
+  /* new objects take over deleted buckets before the table grows */
+  push_objs(om, h, N / 2);
+  objmap_stats(om, &after);
+  assert(after.live == N && after.buckets == before.buckets);
+  assert(after.tombstones < before.tombstones);
+  for (i = 0; i < N / 2; ++i) assert(*(size_t*)objmap_get(om, h[i]) == i);
+  objmap_delete(&om);
+}
+
+static void check_flat(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_FLAT);
+  objmap_stats_t st;
+  size_t full, i;
+
+  /* a tombstone followed by an empty bucket is emptied straight away */
+  assert(om != NULL);
+  h[0] = objmap_push(om, new_obj(0));
+  free(objmap_pop(om, h[0]));
+  objmap_stats(om, &st);
+  assert(st.live == 0 && st.tombstones == 0 && st.buckets > 0);
+  assert(objmap_get(om, h[0]) == NULL && objmap_pop(om, h[0]) == NULL);
+
+  /* compaction drops tombstones and shrinks the table */
+  push_objs(om, h, N);
+  full = nbuckets(om);
+  pop_most(om, h, N);
+  objmap_stats(om, &st);
+  assert(st.buckets == full && st.live == N / 1000);
+  objmap_compact(om);
+  objmap_stats(om, &st);
+  assert(st.buckets < full / 100 && st.tombstones == 0);
+  check_left(om, h, N);
+  for (i = 0; i < N; i += 1000) free(objmap_pop(om, h[i]));
+  objmap_compact(om);
+  objmap_stats(om, &st);
+  assert(st.live == 0 && st.buckets == 0);
+  objmap_delete(&om);
+
+  check_churn(OBJMAP_ENGINE_FLAT);
+  check_flat_reserved();
+}
+
+/* ------------------------------------------------------------------------
+ * Thread-safe engines
+ * ------------------------------------------------------------------------ */
+#define NTHREADS 8
+#define PER_THREAD 2000
+
+typedef struct {
+  ObjectMap *om;
+  objmap_key_t handles[PER_THREAD];
+} worker_t;
+
+/* push, look up and pop half of PER_THREAD objects */
+static void* worker_churn(void *arg) {
+  worker_t *w = (worker_t*)arg;
+  size_t i;
+
+  for (i = 0; i < PER_THREAD; ++i) {
+    w->handles[i] = objmap_push(w->om, new_obj(i));
+    assert(w->handles[i] != OBJMAP_NULL && w->handles[i] <= OBJMAP_MAX_INDEX);
+  }
+  for (i = 0; i < PER_THREAD; ++i) {
+    size_t *obj = (size_t*)objmap_get(w->om, w->handles[i]);
+    assert(obj != NULL && *obj == i);
+    if (i % 2) free(objmap_pop(w->om, w->handles[i]));
+  }
+  return NULL;
+}
+
+/* run worker_churn() on NTHREADS threads at once, then check that every
+ * object is found under its handle and only there */
+static void check_threads(ObjectMap *om) {
+  static worker_t w[NTHREADS];
+  pthread_t threads[NTHREADS];
+  size_t t, u, i;
+
+  for (t = 0; t < NTHREADS; ++t) {
+    w[t].om = om;
+    assert(pthread_create(&threads[t], NULL, worker_churn, &w[t]) == 0);
+  }
+  for (t = 0; t < NTHREADS; ++t) pthread_join(threads[t], NULL);
+
+  for (t = 0; t < NTHREADS; ++t) {
+    for (i = 0; i < PER_THREAD; ++i) {
+      size_t *obj = (size_t*)objmap_get(om, w[t].handles[i]);
+      assert((i % 2) ? obj == NULL : (obj != NULL && *obj == i));
+      for (u = 0; u < t && i % 2 == 0; ++u) {
+        assert(w[u].handles[i] != w[t].handles[i]);
+      }
+    }
+  }
+  objmap_set_deallocator(om, count_free);
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == NTHREADS * PER_THREAD / 2);
+  objmap_delete(&om);
+}
+
+static void check_sharded(void) {
+  ObjectMap *om = objmap_new_concurrent(3); /* rounded up to 4 shards */
+
+  assert(om != NULL && om->engine == OBJMAP_ENGINE_SHARDED);
+  check_threads(om);
+  check_threads(objmap_new_concurrent(0));
+}
+
+/* keys claimed in blocks are not wasted by a thread alternating between
+ * more maps than it caches blocks for, and the blocks of deleted and reset
+ * maps make way for new ones */
+static void check_key_blocks(void) {
+  ObjectMap *maps[6];
+  size_t i, m, nmaps = sizeof(maps) / sizeof(maps[0]);
+
+  for (m = 0; m < nmaps; ++m) {
+    maps[m] = objmap_new_concurrent(0);
+    assert(maps[m] != NULL);
+  }
+  for (i = 0; i < N; ++i) {
+    for (m = 0; m < nmaps; ++m) {
+      assert(objmap_push(maps[m], new_obj(i)) <= OBJMAP_MAX_INDEX);
+    }
+  }
+  /* om->top counts keys claimed, which may only run one block ahead */
+  for (m = 0; m < nmaps; ++m) {
+    assert(maps[m]->top - 1 <= N + 127);
+    objmap_delete(&maps[m]);
+  }
+
+  /* deleting a map frees its block, so short-lived maps all get blocks
+   * (om->top runs ahead) rather than claiming keys one at a time */
+  for (m = 0; m < 2 * nmaps; ++m) {
+    maps[0] = objmap_new_concurrent(0);
+    for (i = 0; i < 10; ++i) objmap_push(maps[0], new_obj(i));
+    assert(maps[0]->top - 1 > 10);
+    objmap_delete(&maps[0]);
+  }
+
+  /* a reset map gets a new block in place of its old one, even when the
+   * thread holds blocks for as many maps as it can (4) */
+  for (m = 0; m < 4; ++m) {
+    maps[m] = objmap_new_concurrent(0);
+    for (i = 0; i < 10; ++i) objmap_push(maps[m], new_obj(i));
+    assert(maps[m]->top - 1 > 10);
+  }
+  objmap_reset(maps[0]);
+  assert(objmap_push(maps[0], new_obj(0)) == 1);
+  for (i = 1; i < 10; ++i) objmap_push(maps[0], new_obj(i));
+  assert(maps[0]->top - 1 > 10);
+  for (m = 0; m < 4; ++m) objmap_delete(&maps[m]);
+}
+
+/* objects pushed by rm_writer(), enough to grow the page directory */
+#define RM_OBJS (64 * 4096)
+
+/* push RM_OBJS objects, each holding its handle */
+static void* rm_writer(void *arg) {
+  ObjectMap *om = (ObjectMap*)arg;
+  size_t i;
+
+  for (i = 1; i <= RM_OBJS; ++i) assert(objmap_push(om, new_obj(i)) == i);
+  return NULL;
+}
+
+/* look up handles while rm_writer() runs. Objects found must be complete */
+static void* rm_reader(void *arg) {
+  ObjectMap *om = (ObjectMap*)arg;
+  size_t pass, i;
+
+  for (pass = 0; pass < 4; ++pass) {
+    for (i = 1; i <= RM_OBJS; ++i) {
+      size_t *obj = (size_t*)objmap_get(om, (objmap_key_t)i);
+      assert(obj == NULL || *obj == i);
+    }
+  }
+  return NULL;
+}
+
+static void check_read_mostly(void) {
+  ObjectMap *om = objmap_new_engine(OBJMAP_ENGINE_READ_MOSTLY);
+  pthread_t threads[NTHREADS];
+  size_t t;
+
+  assert(om != NULL && om->engine == OBJMAP_ENGINE_READ_MOSTLY);
+  check_threads(om);
+
+  /* lock-free lookups during pushes that replace the directory */
+  om = objmap_new_engine(OBJMAP_ENGINE_READ_MOSTLY);
+  assert(pthread_create(&threads[0], NULL, rm_writer, om) == 0);
+  for (t = 1; t < NTHREADS; ++t) {
+    assert(pthread_create(&threads[t], NULL, rm_reader, om) == 0);
+  }
+  for (t = 0; t < NTHREADS; ++t) pthread_join(threads[t], NULL);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Batched pushes and lookups
+ * ------------------------------------------------------------------------ */
+static void check_push_n(objmap_engine_t engine) {
+  static objmap_key_t h[N];
+  static void *objs[N];
+  ObjectMap *om = objmap_new_engine(engine);
+  objmap_key_t first;
+  size_t i;
+
+  assert(om != NULL);
+  assert(objmap_push_n(om, objs, 0, h) == OBJMAP_NULL);
+
+  /* a batch after a single push, so it does not start at the first key */
+  free(objmap_pop(om, objmap_push(om, new_obj(0))));
+  for (i = 0; i < N; ++i) objs[i] = new_obj(i);
+  first = objmap_push_n(om, objs, N, h);
+  assert(first != OBJMAP_NULL && first <= OBJMAP_MAX_INDEX && first == h[0]);
+  for (i = 0; i < N; ++i) {
+    size_t *obj = (size_t*)objmap_get(om, h[i]);
+    assert(obj == objs[i] && *obj == i);
+    if (engine != OBJMAP_ENGINE_GENERATIONAL) {
+      assert(h[i] == first + (objmap_key_t)i);
+    }
+  }
+
+  /* generational batches fill recycled slots, then fresh ones */
+  if (engine == OBJMAP_ENGINE_GENERATIONAL) {
+    for (i = 0; i < N; i += 2) free(objmap_pop(om, h[i]));
+    for (i = 0; i < N; ++i) objs[i] = new_obj(i);
+    first = objmap_push_n(om, objs, N, h);
+    assert(first == h[0] && first <= OBJMAP_MAX_INDEX);
+    for (i = 0; i < N; ++i) {
+      size_t *obj = (size_t*)objmap_get(om, h[i]);
+      assert(obj == objs[i] && *obj == i);
+    }
+    for (i = 0; i < N / 2; ++i) {
+      assert((h[i] & GEN_INDEX_MASK) < (h[N - 1] & GEN_INDEX_MASK));
+    }
+  }
+
+  /* handles need not be returned if they are consecutive */
+  if (engine != OBJMAP_ENGINE_GENERATIONAL) {
+    for (i = 0; i < N; ++i) objs[i] = new_obj(i);
+    first = objmap_push_n(om, objs, N, NULL);
+    assert(first <= OBJMAP_MAX_INDEX);
+    for (i = 0; i < N; ++i) {
+      assert(objmap_get(om, first + (objmap_key_t)i) == objs[i]);
+    }
+  }
+  objmap_delete(&om);
+}
+
+static void check_get_n(objmap_engine_t engine) {
+  static objmap_key_t h[N], query[2 * N];
+  static void *ptrs[2 * N];
+  ObjectMap *om = objmap_new_engine(engine);
+  size_t i, found = 0;
+
+  assert(om != NULL);
+  assert(objmap_get_n(om, h, 0, ptrs) == 0);
+  push_objs(om, h, N);
+  for (i = 0; i < N; i += 4) free(objmap_pop(om, h[i]));
+
+  /* live, popped and never issued handles, interleaved and in reverse */
+  for (i = 0; i < N; ++i) {
+    query[2 * i] = h[N - 1 - i];
+    query[2 * i + 1] = (i % 2) ? OBJMAP_NULL : h[N - 1] + 1 + (objmap_key_t)i;
+  }
+  for (i = 0; i < 2 * N; ++i) ptrs[i] = &ptrs; /* must be overwritten */
+  for (i = 0; i < 2 * N; ++i) {
+    if (objmap_get(om, query[i]) != NULL) ++found;
+  }
+  assert(found == N - N / 4);
+  assert(objmap_get_n(om, query, 2 * N, ptrs) == found);
+  for (i = 0; i < 2 * N; ++i) assert(ptrs[i] == objmap_get(om, query[i]));
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Reserving room
+ * ------------------------------------------------------------------------ */
+/* pushing as many objects as were reserved does not resize the map */
+static void check_reserved(ObjectMap *om, size_t n) {
+  static objmap_key_t h[N];
+  size_t buckets = nbuckets(om);
+
+  assert(buckets > 0);
+  push_objs(om, h, n);
+  assert(nbuckets(om) == buckets);
+  objmap_delete(&om);
+}
+
+static void check_reserve(objmap_engine_t engine) {
+  ObjectMap *om = objmap_new_engine(engine);
+
+  assert(om != NULL);
+  assert(objmap_reserve(om, 0) == 0);
+  assert(objmap_reserve(om, (size_t)-1) != 0);
+  assert(objmap_reserve(om, N) == 0);
+  check_reserved(om, N);
+
+  /* room is made on top of the objects already stored */
+  om = objmap_new_engine(engine);
+  free(objmap_pop(om, objmap_push(om, new_obj(0))));
+  assert(objmap_push(om, new_obj(0)) <= OBJMAP_MAX_INDEX);
+  assert(objmap_reserve(om, N - 1) == 0);
+  check_reserved(om, N - 1);
+
+  if (engine == OBJMAP_ENGINE_HASH) {
+    om = objmap_new_with_capacity(N);
+    assert(om != NULL);
+    check_reserved(om, N);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * OBJMAP_ENGINE_INLINE
+ * ------------------------------------------------------------------------ */
+typedef struct {
+  double x;
+  size_t id;
+  char tag[13];
+} rec_t;
+
+/* number of objects passed to count_finalize() */
+static size_t nfinalized;
+
+static void count_finalize(void *obj) {
+  ++nfinalized;
+  ((rec_t*)obj)->id = (size_t)-1; /* memory must stay valid */
+}
+
+/* as count_finalize(), for objects of any type */
+static void count_finalize_any(void *obj) {
+  (void)obj;
+  ++nfinalized;
+}
+
+static void count_finalize_locked(void *obj) {
+  pthread_mutex_lock(&visit_lock);
+  ++nfinalized;
+  pthread_mutex_unlock(&visit_lock);
+  ((rec_t*)obj)->id = (size_t)-1;
+}
+
+static void check_inline(void) {
+  static objmap_key_t h[N];
+  static void *ptrs[N];
+  ObjectMap *om;
+  rec_t r, *obj, *popped;
+  size_t i;
+
+  assert(objmap_new_inline(0, 0) == NULL);
+  assert(objmap_new_inline(sizeof(rec_t), 3) == NULL);
+
+  om = objmap_new_inline(sizeof(rec_t), 64);
+  assert(om != NULL && om->engine == OBJMAP_ENGINE_INLINE);
+  check_iterate(om, 0, 0);
+  assert(objmap_alloc(om, 16) == NULL);
+
+  /* objects are copied in, at the requested alignment */
+  memset(&r, 0, sizeof(r));
+  for (i = 0; i < N; ++i) {
+    r.id = i;
+    r.x = (double)i / 2;
+    h[i] = objmap_push(om, &r);
+    assert(h[i] <= OBJMAP_MAX_INDEX);
+  }
+  r.id = N;
+  for (i = 0; i < N; ++i) {
+    obj = (rec_t*)objmap_get(om, h[i]);
+    assert(obj != NULL && obj->id == i && obj->x == (double)i / 2);
+    assert((size_t)obj % 64 == 0);
+  }
+
+  /* emplaced objects start zeroed */
+  h[0] = objmap_emplace(om, (void**)&obj);
+  assert(h[0] <= OBJMAP_MAX_INDEX && objmap_get(om, h[0]) == obj);
+  assert(obj->id == 0 && obj->x == 0.0 && obj->tag[12] == 0);
+
+  /* popped objects stay readable until compaction, and are not finalized */
+  objmap_set_deallocator(om, count_finalize);
+  popped = (rec_t*)objmap_pop(om, h[1]);
+  assert(popped != NULL && popped->id == 1 && objmap_get(om, h[1]) == NULL);
+  nfinalized = 0;
+  objmap_flush(om);
+  assert(nfinalized == N && popped->id == 1);
+
+  /* batches, and compaction of emptied pages */
+  for (i = 0; i < N; ++i) {
+    ptrs[i] = malloc(sizeof(rec_t));
+    memset(ptrs[i], 0, sizeof(rec_t));
+    ((rec_t*)ptrs[i])->id = i;
+  }
+  assert(objmap_reserve(om, N) == 0);
+  assert(objmap_push_n(om, ptrs, N, h) == h[0]);
+  for (i = 0; i < N; ++i) free(ptrs[i]);
+  for (i = 0; i < N / 2; ++i) objmap_pop(om, h[i]);
+  obj = (rec_t*)objmap_get(om, h[N - 1]);
+  objmap_compact(om);
+  assert(objmap_get(om, h[N - 1]) == obj && obj->id == N - 1);
+  assert(objmap_get_n(om, h, N, ptrs) == N - N / 2);
+  for (i = 0; i < N; ++i) {
+    assert((i < N / 2) ? ptrs[i] == NULL : ((rec_t*)ptrs[i])->id == i);
+  }
+  nfinalized = 0;
+  objmap_delete(&om);
+  assert(nfinalized == N - N / 2);
+
+  /* released objects are finalized at once, even with a reclamation
+   * thread */
+  om = objmap_new_inline(sizeof(rec_t), 0);
+  assert(objmap_set_async_reclaim(om, 1) == 0);
+  objmap_set_deallocator(om, count_finalize);
+  h[0] = objmap_push(om, &r);
+  nfinalized = 0;
+  objmap_release(om, h[0]);
+  assert(nfinalized == 1 && objmap_get(om, h[0]) == NULL);
+  objmap_delete(&om);
+  assert(nfinalized == 1);
+
+  /* without a deallocator, objects are left alone */
+  om = objmap_new_inline(sizeof(rec_t), 0);
+  assert(objmap_push(om, &r) <= OBJMAP_MAX_INDEX);
+  objmap_flush(om);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Pool allocation
+ * ------------------------------------------------------------------------ */
+static void check_pool(objmap_engine_t engine) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(engine);
+  size_t i, *popped = NULL;
+
+  assert(om != NULL);
+  if (engine == OBJMAP_ENGINE_SHARDED || engine == OBJMAP_ENGINE_READ_MOSTLY) {
+    assert(objmap_alloc(om, sizeof(size_t)) == NULL); /* not thread-safe */
+    objmap_delete(&om);
+    return;
+  }
+
+  /* pooled objects are aligned and released with the pool, not freed */
+  for (i = 0; i < N; ++i) {
+    size_t *obj = (size_t*)objmap_alloc(om, 1 + i % 40);
+    assert(obj != NULL && (size_t)obj % sizeof(double) == 0);
+    *obj = i;
+    h[i] = objmap_push(om, obj);
+  }
+  for (i = 0; i < N; ++i) assert(*(size_t*)objmap_get(om, h[i]) == i);
+  popped = (size_t*)objmap_pop(om, h[N / 2]);
+  assert(popped != NULL && *popped == N / 2);
+  objmap_flush(om);
+  for (i = 0; i < N; ++i) assert(objmap_get(om, h[i]) == NULL);
+
+  /* a deallocator is still called on each object, as a finalizer */
+  for (i = 0; i < 100; ++i) {
+    h[i] = objmap_push(om, objmap_alloc(om, sizeof(size_t)));
+  }
+  objmap_set_deallocator(om, count_finalize_any);
+  nfinalized = 0;
+  objmap_reset(om);
+  assert(nfinalized == 100);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Parallel flushing
+ * ------------------------------------------------------------------------ */
+/* as count_free(), but called from several threads at once */
+static void count_free_locked(void *obj) {
+  pthread_mutex_lock(&visit_lock);
+  ++nfreed;
+  pthread_mutex_unlock(&visit_lock);
+  free(obj);
+}
+
+static void check_flush_threads(objmap_engine_t engine) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(engine);
+  size_t i;
+
+  assert(om != NULL);
+  objmap_set_flush_threads(om, 4);
+  objmap_flush(om);
+
+  /* each remaining object is deallocated once */
+  push_objs(om, h, N);
+  for (i = 0; i < N; i += 3) free(objmap_pop(om, h[i]));
+  objmap_set_deallocator(om, count_free_locked);
+  nfreed = 0;
+  objmap_flush(om);
+  assert(nfreed == N - (N + 2) / 3);
+  check_iterate(om, 0, 0);
+
+  /* also when resetting and deleting, and with the default free() */
+  push_objs(om, h, N);
+  nfreed = 0;
+  objmap_reset(om);
+  assert(nfreed == N);
+  objmap_set_deallocator(om, NULL);
+  push_objs(om, h, N);
+  objmap_delete(&om);
+}
+
+/* objects of inline maps belong to the map and are only finalized */
+static void check_flush_threads_inline(void) {
+  ObjectMap *om = objmap_new_inline(sizeof(rec_t), 0);
+  rec_t r;
+  size_t i;
+
+  memset(&r, 0, sizeof(r));
+  objmap_set_flush_threads(om, 4);
+  for (i = 0; i < N; ++i) objmap_push(om, &r);
+  objmap_flush(om); /* no deallocator, so nothing is freed */
+  check_iterate(om, 0, 0);
+
+  for (i = 0; i < N; ++i) objmap_push(om, &r);
+  objmap_set_deallocator(om, count_finalize_locked);
+  nfinalized = 0;
+  objmap_flush(om);
+  assert(nfinalized == N);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Asynchronous reclamation
+ * ------------------------------------------------------------------------ */
+static void check_reclaim(objmap_engine_t engine) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(engine);
+  size_t i;
+
+  assert(om != NULL);
+  objmap_reclaim_wait(om); /* not enabled: returns at once */
+  assert(objmap_set_async_reclaim(om, 1) == 0);
+  objmap_set_deallocator(om, count_free_locked);
+  nfreed = 0;
+
+  /* released objects are deallocated in the background */
+  push_objs(om, h, N);
+  for (i = 0; i < N; i += 2) objmap_release(om, h[i]);
+  objmap_release(om, h[0]); /* already released: ignored */
+  objmap_reclaim_wait(om);
+  assert(nfreed == N / 2);
+  for (i = 0; i < N; ++i) {
+    assert((objmap_get(om, h[i]) == NULL) == (i % 2 == 0));
+  }
+
+  /* flushed objects too, while the map carries on */
+  objmap_flush(om);
+  for (i = 0; i < N; ++i) assert(objmap_get(om, h[i]) == NULL);
+  push_objs(om, h, 100);
+  objmap_reclaim_wait(om);
+  assert(nfreed == N);
+  for (i = 0; i < 100; ++i) assert(*(size_t*)objmap_get(om, h[i]) == i);
+
+  /* stopping the thread and deleting the map wait for pending objects */
+  objmap_reset(om);
+  assert(objmap_set_async_reclaim(om, 0) == 0);
+  assert(nfreed == N + 100);
+  assert(objmap_set_async_reclaim(om, 1) == 0);
+  push_objs(om, h, 100);
+  objmap_flush(om);
+  objmap_delete(&om);
+  assert(nfreed == N + 200);
+}
+
+/* ------------------------------------------------------------------------
+ * Statistics
+ * ------------------------------------------------------------------------ */
+static size_t hist_sum(const size_t *hist) {
+  size_t i, sum = 0;
+  for (i = 0; i < OBJMAP_PROBE_HIST; ++i) sum += hist[i];
+  return sum;
+}
+
+/* whether probe lengths are sampled, i.e. the engine is a hashtable */
+static int is_hashed(objmap_engine_t engine) {
+  return engine == OBJMAP_ENGINE_HASH || engine == OBJMAP_ENGINE_SHARDED ||
+         engine == OBJMAP_ENGINE_SWISS || engine == OBJMAP_ENGINE_FLAT;
+}
+
+static void check_stats(objmap_engine_t engine) {
+  static objmap_key_t h[N];
+  ObjectMap *om = objmap_new_engine(engine);
+  objmap_stats_t st;
+  size_t i;
+
+  assert(om != NULL);
+  objmap_stats(om, &st);
+  assert(st.live == 0 && st.tombstones == 0 && st.memory > 0);
+  assert(hist_sum(st.probe_hit) == 0);
+
+  push_objs(om, h, N);
+  objmap_stats(om, &st);
+  assert(st.live == N && st.tombstones == 0 && st.buckets >= N);
+  assert(st.load > 0.0 && st.load <= 1.0);
+  assert(st.load == (double)st.live / (double)st.buckets);
+  if (is_hashed(engine)) {
+    /* at most 1024 lookups of each kind are sampled (per shard) */
+    assert(hist_sum(st.probe_hit) > 0 && hist_sum(st.probe_miss) > 0);
+    if (engine != OBJMAP_ENGINE_SHARDED) {
+      assert(hist_sum(st.probe_hit) == 1024);
+      assert(hist_sum(st.probe_miss) == 1024);
+    }
+  } else {
+    assert(hist_sum(st.probe_hit) == 0 && hist_sum(st.probe_miss) == 0);
+  }
+
+  /* popped objects leave tombstones in hashtables until compacted. Swiss
+   * tables only leave them in full groups, which may be none */
+  for (i = 0; i < N; i += 2) free(objmap_pop(om, h[i]));
+  objmap_stats(om, &st);
+  assert(st.live == N / 2);
+  if (!is_hashed(engine)) {
+    assert(st.tombstones == 0);
+  } else if (engine != OBJMAP_ENGINE_SWISS) {
+    assert(st.tombstones > 0);
+  }
+  objmap_compact(om);
+  objmap_stats(om, &st);
+  assert(st.live == N / 2 && st.tombstones == 0);
+  if (engine == OBJMAP_ENGINE_HASH) {
+    assert(hist_sum(st.probe_hit) == 1024); /* sampled at random */
+  }
+  objmap_delete(&om);
+
+  /* small maps have all their objects sampled */
+  om = objmap_new_engine(engine);
+  push_objs(om, h, 100);
+  objmap_stats(om, &st);
+  assert(st.live == 100);
+  if (is_hashed(engine)) assert(hist_sum(st.probe_hit) == 100);
+  objmap_delete(&om);
+}
+
+/* ------------------------------------------------------------------------
+ * Snapshots of OBJMAP_ENGINE_INLINE
+ * ------------------------------------------------------------------------ */
+/* written to the current directory and removed afterwards */
+#define SNAP_PATH "objmap_test.snap"
+
+/* check the objects of a map saved after popping every third of h[],
+ * with every other third popped too if popped_more */
+static void check_snapshot_objs(ObjectMap *om, const objmap_key_t *h,
+                                int popped_more) {
+  size_t i;
+  for (i = 0; i < N; ++i) {
+    rec_t *obj = (rec_t*)objmap_get(om, h[i]);
+    if (i % 3 == 0 || (popped_more && i % 3 == 1)) {
+      assert(obj == NULL);
+    } else {
+      assert(obj != NULL && obj->id == i && (size_t)obj % 64 == 0);
+      assert(obj->x == (i == 2 && popped_more ? -1.0 : (double)i / 2));
+      assert(strcmp(obj->tag, "snapshot") == 0);
+    }
+  }
+}
+
+/* replace the snapshot file with its first n bytes, or with junk if n is 0 */
+static void damage_snapshot(size_t n) {
+  static char buf[8192];
+  FILE *f = fopen(SNAP_PATH, "rb");
+  size_t len;
+
+  assert(f != NULL);
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  assert(len > n);
+  f = fopen(SNAP_PATH, "wb");
+  assert(f != NULL);
+  if (n == 0) {
+    fputs("not an objmap snapshot", f);
+  } else {
+    assert(fwrite(buf, 1, n, f) == n);
+  }
+  fclose(f);
+}
+
+/* offsets of 64-bit fields of a snapshot file: the next key and number of
+ * objects in its header, and the live count of the header of its first
+ * page, which is 4096 bytes in */
+#define SNAP_TOP 64
+#define SNAP_SIZE 72
+#define SNAP_PAGE0_LIVE (4096 + sizeof(void*))
+
+/* set a 64-bit field of the snapshot file, returning its old value */
+static uint64_t patch_snapshot(long offset, uint64_t value) {
+  FILE *f = fopen(SNAP_PATH, "r+b");
+  uint64_t old;
+
+  assert(f != NULL);
+  assert(fseek(f, offset, SEEK_SET) == 0);
+  assert(fread(&old, sizeof(old), 1, f) == 1);
+  assert(fseek(f, offset, SEEK_SET) == 0);
+  assert(fwrite(&value, sizeof(value), 1, f) == 1);
+  fclose(f);
+  return old;
+}
+
+/* a file whose header disagrees with its pages is rejected, rather than
+ * crashing later pushes or flushes */
+static void check_snapshot_header(long offset, uint64_t value) {
+  uint64_t old = patch_snapshot(offset, value);
+  assert(objmap_open_mapped(SNAP_PATH) == NULL);
+  patch_snapshot(offset, old);
+}
+
+static void check_snapshot(void) {
+  static objmap_key_t h[N];
+  ObjectMap *om, *mapped;
+  objmap_stats_t st;
+  objmap_key_t next;
+  rec_t r, *obj;
+  size_t i;
+
+  /* only inline maps can be saved */
+  om = objmap_new();
+  assert(om != NULL);
+  push_objs(om, h, 10);
+  assert(objmap_save(om, SNAP_PATH) != 0);
+  objmap_delete(&om);
+
+  /* objects, their handles and the next handle survive a round trip */
+  om = objmap_new_inline(sizeof(rec_t), 64);
+  assert(om != NULL);
+  memset(&r, 0, sizeof(r));
+  strcpy(r.tag, "snapshot");
+  for (i = 0; i < N; ++i) {
+    r.id = i;
+    r.x = (double)i / 2;
+    h[i] = objmap_push(om, &r);
+    assert(h[i] <= OBJMAP_MAX_INDEX);
+  }
+  for (i = 0; i < N; i += 3) assert(objmap_pop(om, h[i]) != NULL);
+  assert(objmap_save(om, SNAP_PATH) == 0);
+  mapped = objmap_open_mapped(SNAP_PATH);
+  assert(mapped != NULL && mapped->engine == OBJMAP_ENGINE_INLINE);
+  check_snapshot_objs(mapped, h, 0);
+  objmap_stats(mapped, &st);
+  assert(st.live == N - (N + 2) / 3);
+  r.id = N;
+  next = objmap_push(om, &r);
+  assert(objmap_push(mapped, &r) == next);
+  objmap_delete(&om);
+
+  /* a mapped map can be modified, compacted and saved over its own file,
+   * and is unaffected by the file being replaced */
+  for (i = 1; i < N; i += 3) assert(objmap_pop(mapped, h[i]) != NULL);
+  ((rec_t*)objmap_get(mapped, h[2]))->x = -1.0;
+  objmap_compact(mapped);
+  check_snapshot_objs(mapped, h, 1);
+  assert(objmap_save(mapped, SNAP_PATH) == 0);
+  om = objmap_open_mapped(SNAP_PATH);
+  assert(om != NULL);
+  check_snapshot_objs(om, h, 1);
+  check_snapshot_objs(mapped, h, 1);
+  obj = (rec_t*)objmap_get(om, next);
+  assert(obj != NULL && obj->id == N);
+
+  /* flushing a mapped map leaves it usable */
+  nfinalized = 0;
+  objmap_set_deallocator(mapped, count_finalize);
+  objmap_flush(mapped);
+  assert(nfinalized == N / 3 + 1);
+  assert(objmap_get(mapped, next) == NULL);
+  r.id = 0;
+  obj = (rec_t*)objmap_get(mapped, objmap_push(mapped, &r));
+  assert(obj != NULL && obj->id == 0);
+  objmap_delete(&mapped);
+  check_snapshot_objs(om, h, 1);
+  objmap_delete(&om);
+
+  /* next key far beyond the pages of the file, object counts not adding
+   * up, and a page whose live count disagrees with its bitmap */
+  check_snapshot_header(SNAP_TOP, (uint64_t)N * 16);
+  check_snapshot_header(SNAP_SIZE, N / 3);
+  check_snapshot_header(SNAP_PAGE0_LIVE, 1);
+  om = objmap_open_mapped(SNAP_PATH);
+  assert(om != NULL);
+  check_snapshot_objs(om, h, 1);
+  objmap_delete(&om);
+
+  /* missing, foreign and truncated files are rejected */
+  damage_snapshot(4096);
+  assert(objmap_open_mapped(SNAP_PATH) == NULL);
+  damage_snapshot(16);
+  assert(objmap_open_mapped(SNAP_PATH) == NULL);
+  damage_snapshot(0);
+  assert(objmap_open_mapped(SNAP_PATH) == NULL);
+  assert(remove(SNAP_PATH) == 0);
+  assert(objmap_open_mapped(SNAP_PATH) == NULL);
+}
+
+int main(void) {
+  size_t e;
+
+  printf("Running objmap tests ... ");
+  fflush(stdout);
+
+  for (e = 0; e < NENGINES; ++e) {
+    ObjectMap *om = objmap_new_engine(engines[e]);
+    assert(om != NULL);
+    check_basic(om);
+    check_push_n(engines[e]);
+    check_get_n(engines[e]);
+    check_reserve(engines[e]);
+    check_pool(engines[e]);
+    check_flush_threads(engines[e]);
+    check_reclaim(engines[e]);
+    check_stats(engines[e]);
+  }
+  check_slot();
+  check_gen();
+  check_inline();
+  check_flush_threads_inline();
+  check_hash_flush();
+  check_shrink();
+  check_swiss();
+  check_flat();
+  check_sharded();
+  check_key_blocks();
+  check_read_mostly();
+  check_snapshot();
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,248 @@
+/*!
+ * \file test_objmap_cpp.cpp
+ * \brief Behaviour tests for the typed C++ interface, objmap.hpp
+ *
+ * Each engine usable by objmap::map is checked, including destroying empty
+ * maps, and inline maps are checked through the C interface from C++.
+ * Failures are reported with assert(), so this must not be built with
+ * NDEBUG.
+ */
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "objmap/objmap.hpp"
+
+/* number of objects used by most checks */
+#define N 10000
+
+/* engines usable by objmap::map */
+static const objmap_engine_t engines[] = {
+  OBJMAP_ENGINE_HASH, OBJMAP_ENGINE_SLOT, OBJMAP_ENGINE_GENERATIONAL,
+  OBJMAP_ENGINE_SHARDED, OBJMAP_ENGINE_READ_MOSTLY, OBJMAP_ENGINE_SWISS,
+  OBJMAP_ENGINE_FLAT
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/* object counting how many instances are alive */
+struct counted {
+  static size_t alive;
+
+  explicit counted(size_t v) : value(v) { ++alive; }
+  ~counted() { --alive; }
+
+  size_t value;
+};
+
+size_t counted::alive = 0;
+
+/* deleter counting the objects it destroys */
+struct counting_delete {
+  counting_delete() : ndeleted(0) {}
+
+  void operator()(counted *obj) {
+    ++ndeleted;
+    delete obj;
+  }
+
+  size_t ndeleted;
+};
+
+typedef objmap::map<counted> counted_map;
+typedef objmap::handle<counted> counted_handle;
+
+/* push N objects holding their index, returning their handles */
+static std::vector<counted_handle> push_all(counted_map &m) {
+  std::vector<counted_handle> handles;
+  for (size_t i = 0; i < N; ++i) {
+    counted_handle h = m.emplace(i);
+    assert(h);
+    handles.push_back(h);
+  }
+  return handles;
+}
+
+/* number and sum of the values of the objects visited by for_each() */
+static void check_for_each(counted_map &m, size_t count, size_t sum) {
+  size_t n = 0, s = 0;
+  m.for_each([&](counted_handle h, counted &obj) {
+    assert(m.get(h) == &obj);
+    ++n;
+    s += obj.value;
+  });
+  assert(n == count);
+  assert(s == sum);
+}
+
+static void check_empty(objmap_engine_t engine) {
+  {
+    counted_map m(engine);
+  }
+  {
+    counted_map m(engine);
+    assert(m.get(counted_handle()) == nullptr);
+    assert(m.get(counted_handle(1)) == nullptr);
+    assert(!m.pop(counted_handle(1)));
+    m.erase(counted_handle(1));
+    check_for_each(m, 0, 0);
+    m.clear();
+    m.reset();
+    m.compact();
+    assert(m.stats().live == 0);
+  }
+  /* moved-from maps are destroyed without touching the objects */
+  counted_map a(engine);
+  counted_map b(std::move(a));
+  counted_map c(engine);
+  c = std::move(b);
+  assert(counted::alive == 0);
+}
+
+static void check_engine(objmap_engine_t engine) {
+  size_t sum = 0, i;
+
+  {
+    counted_map m(engine);
+    std::vector<counted_handle> handles = push_all(m);
+    assert(counted::alive == N);
+    for (i = 0; i < N; ++i) {
+      counted *obj = m.get(handles[i]);
+      assert(obj != nullptr && obj->value == i);
+    }
+    assert(m.stats().live == N);
+
+    /* pop hands back ownership, so popped objects die here. Erase destroys */
+    for (i = 0; i < N; i += 2) {
+      counted_map::pointer obj = m.pop(handles[i]);
+      assert(obj && obj->value == i);
+      assert(m.get(handles[i]) == nullptr);
+      assert(!m.pop(handles[i]));
+    }
+    assert(counted::alive == N / 2);
+    for (i = 1; i < N; i += 4) {
+      m.erase(handles[i]);
+      assert(m.get(handles[i]) == nullptr);
+    }
+    for (i = 3; i < N; i += 4) sum += i;
+    assert(counted::alive == N / 4);
+    check_for_each(m, N / 4, sum);
+    m.compact();
+    check_for_each(m, N / 4, sum);
+
+    /* a successful push takes ownership */
+    counted_map::pointer obj(new counted(N));
+    counted_handle h = m.push(std::move(obj));
+    assert(h && !obj && m.get(h)->value == N);
+
+    m.clear();
+    assert(counted::alive == 0);
+    assert(m.get(h) == nullptr);
+    check_for_each(m, 0, 0);
+
+    assert(m.reserve(N));
+    push_all(m);
+    m.reset();
+    assert(counted::alive == 0);
+
+    /* moving a map takes over its objects */
+    push_all(m);
+    counted_map other(std::move(m));
+    assert(counted::alive == N);
+    check_for_each(other, N, (size_t)N * (N - 1) / 2);
+    counted_map third(engine);
+    third.emplace(0);
+    third = std::move(other);
+    assert(counted::alive == N);
+  }
+  assert(counted::alive == 0);
+}
+
+static void check_deleter(objmap_engine_t engine) {
+  objmap::map<counted, counting_delete> m(engine);
+  objmap::handle<counted> h;
+  size_t i;
+
+  for (i = 0; i < 100; ++i) {
+    h = m.push(std::unique_ptr<counted, counting_delete>(new counted(i)));
+    assert(h);
+  }
+  m.erase(h);
+  assert(m.get_deleter().ndeleted == 1);
+  m.clear();
+  assert(m.get_deleter().ndeleted == 100);
+  assert(counted::alive == 0);
+  m.push(std::unique_ptr<counted, counting_delete>(new counted(0)));
+  assert(counted::alive == 1);
+}
+
+static void check_concurrent(void) {
+  {
+    counted_map m = counted_map::concurrent(3);
+    push_all(m);
+    assert(m.stats().live == N);
+  }
+  {
+    counted_map m = counted_map::concurrent(0);
+  }
+  assert(counted::alive == 0);
+}
+
+/* objmap::map rejects inline storage, which the C interface still offers */
+struct rec {
+  double x;
+  size_t id;
+};
+
+static void check_inline(void) {
+  bool thrown = false;
+  try {
+    counted_map m(OBJMAP_ENGINE_INLINE);
+  } catch (const std::invalid_argument&) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(counted::alive == 0);
+
+  ObjectMap *om = objmap_new_inline(sizeof(rec), alignof(rec));
+  assert(om != nullptr);
+  objmap_delete(&om);
+  assert(om == nullptr);
+
+  om = objmap_new_inline(sizeof(rec), alignof(rec));
+  assert(om != nullptr);
+  std::vector<objmap_key_t> keys;
+  for (size_t i = 0; i < N; ++i) {
+    rec r = {0.5, i};
+    objmap_key_t key = objmap_push(om, &r);
+    assert(key <= OBJMAP_MAX_INDEX);
+    keys.push_back(key);
+  }
+  for (size_t i = 0; i < N; ++i) {
+    rec *r = static_cast<rec*>(objmap_get(om, keys[i]));
+    assert(r != nullptr && r->id == i && r->x == 0.5);
+  }
+  void *slot = nullptr;
+  objmap_key_t key = objmap_emplace(om, &slot);
+  assert(key <= OBJMAP_MAX_INDEX && objmap_get(om, key) == slot);
+  objmap_flush(om);
+  assert(objmap_get(om, keys[0]) == nullptr);
+  objmap_delete(&om);
+}
+
+int main(void) {
+  size_t e;
+
+  printf("Running objmap C++ tests ... ");
+  fflush(stdout);
+  for (e = 0; e < NENGINES; ++e) {
+    check_empty(engines[e]);
+    check_engine(engines[e]);
+    check_deleter(engines[e]);
+  }
+  check_concurrent();
+  check_inline();
+  printf("PASS\n");
+  return 0;
+}
@@ -10,22 +10,251 @@
 /* splint directive needed due to khash implementation */
 /*@+matchanyintegral -fcnuse@*/
 #include <assert.h>
+#include <string.h>
 #include "khash.h"
-#include "objmap.h"
+#include "objmap_internal.h"
+
+#if OBJMAP_HASH == OBJMAP_HASH_FIBONACCI
+/* khash uses the low bits of the hash to pick a bucket, and the high 32 bits
+ * of the product depend on all bits of the (folded) key */
+#ifdef OBJMAP_USE_64BIT_KEYS
+#define OM_HASH_FUNC(key) \
+  (khint32_t)((((khint64_t)(key) >> 32 ^ (khint64_t)(key)) * \
+               0x9E3779B97F4A7C15ULL) >> 32)
+#else
+#define OM_HASH_FUNC(key) \
+  (khint32_t)(((khint64_t)(key) * 0x9E3779B97F4A7C15ULL) >> 32)
+#endif
+#elif defined(OBJMAP_USE_64BIT_KEYS)
+#define OM_HASH_FUNC kh_int64_hash_func
+#else
+#define OM_HASH_FUNC kh_int_hash_func
+#endif
 
 #ifdef OBJMAP_USE_64BIT_KEYS
 /* initialise khash of type "objmap" with "uint64_t" key and "void*" value */
-KHASH_MAP_INIT_INT64(objmap, void*)
+KHASH_INIT(objmap, khint64_t, void*, 1, OM_HASH_FUNC, kh_int64_hash_equal)
 #else
 /* initialise khash of type "objmap" with "uint32_t" key and "void*" value */
-KHASH_MAP_INIT_INT(objmap, void*)
+KHASH_INIT(objmap, khint32_t, void*, 1, OM_HASH_FUNC, kh_int_hash_equal)
 #endif
 
 
+/* flush visits logged keys instead of scanning all buckets when the table has
+ * more than this many buckets per logged key */
+#define OM_LOG_SCAN_RATIO 32
+
+/* tables are never shrunk below this number of buckets */
+#define OM_HASH_MIN_BUCKETS 16
+
+/* mark bucket as empty (rather than deleted) */
+#define __om_set_isempty_true(flag, i) \
+  (flag[i>>4] = (flag[i>>4] & ~(3ul<<((i&0xfU)<<1))) | (2ul<<((i&0xfU)<<1)))
+
+/* State for the hashtable engine.
+ *
+ * Keys pushed since the last flush are logged so that flushing a sparse table
+ * costs O(objects) rather than O(buckets). Popped keys are not removed from
+ * the log but are filtered out whenever the log needs to grow, so the log is
+ * at most twice the number of objects stored (plus slack).
+ *
+ * The hashtable is embedded as the first member so it can be reached with
+ * the same indirection as before; use MAP(om) to access it.
+ */
+typedef struct {
+  khash_t(objmap) table;    /* hashtable. Must be first member */
+  objmap_key_t *log;        /* keys pushed since last flush */
+  size_t nlog;              /* number of logged keys */
+  size_t log_capacity;      /* number of keys that fit in log */
+} om_hash_t;
+
 /* shortcut for accessing internal hashtable with correct type */
 #define MAP(om) ((khash_t(objmap)*)om->map)
+#define HASH(om) ((om_hash_t*)om->map)
+
+static om_hash_t* hash_new(void) {
+  return (om_hash_t*)calloc(1, sizeof(om_hash_t));
+}
+
+/* kh_destroy() cannot be used since the hashtable is embedded */
+static void hash_destroy(om_hash_t *hs) {
+  if (hs == NULL) return;
+  free(hs->table.keys);
+  free(hs->table.flags);
+  free(hs->table.vals);
+  free(hs->log);
+  free(hs);
+}
+
+/* remove keys of popped objects from the log */
+static void hash_log_filter(om_hash_t *hs) {
+  size_t i, n;
+  khash_t(objmap) *_m = &hs->table;
+
+  for (i = n = 0; i < hs->nlog; ++i) {
+    if (kh_get(objmap, _m, hs->log[i]) != kh_end(_m)) {
+      hs->log[n++] = hs->log[i];
+    }
+  }
+  hs->nlog = n;
+}
+
+/* make room for one more key in the log. Returns 0 on success */
+static int hash_log_reserve(om_hash_t *hs) {
+  objmap_key_t *log;
+  size_t capacity;
+
+  if (hs->nlog < hs->log_capacity) return 0;
+
+  /* drop popped keys if they make up at least half the log */
+  if (hs->nlog >= 2 * (size_t)kh_size(&hs->table)) {
+    hash_log_filter(hs);
+    if (hs->nlog < hs->log_capacity) return 0;
+  }
+
+  capacity = (hs->log_capacity) ? hs->log_capacity * 2 : 16;
+  log = (objmap_key_t*)realloc(hs->log, capacity * sizeof(objmap_key_t));
+  if (log == NULL) return 1;
+  hs->log = log;
+  hs->log_capacity = capacity;
+  return 0;
+}
+
+/* number of buckets to use when shrinking a table holding \c size objects.
+ * The load factor is kept below half the growth threshold so the table is not
+ * grown again soon after */
+static khint_t hash_target_buckets(khint_t size) {
+  khint_t n = (khint_t)(size / (__ac_HASH_UPPER / 2)) + 1;
+  kroundup32(n);
+  return (n < OM_HASH_MIN_BUCKETS) ? OM_HASH_MIN_BUCKETS : n;
+}
+
+/* shrink the table if the load factor has dropped below the threshold */
+static void hash_maybe_shrink(ObjectMap *om) {
+  khash_t(objmap) *_m = MAP(om);
+  khint_t n;
+
+  if (om->shrink_load <= 0.0) return; /* policy disabled */
+  if (kh_size(_m) >= om->shrink_load * kh_n_buckets(_m)) return;
+  n = hash_target_buckets(kh_size(_m));
+  if (n < kh_n_buckets(_m)) kh_resize(objmap, _m, n);
+}
+
+static void hash_compact(ObjectMap *om) {
+  om_hash_t *hs = HASH(om);
+  khash_t(objmap) *_m = MAP(om);
+  khint_t n = hash_target_buckets(kh_size(_m));
+
+  /* rehash if the table can shrink or holds tombstones */
+  if (n < kh_n_buckets(_m) || _m->n_occupied > kh_size(_m)) {
+    kh_resize(objmap, _m, (n < kh_n_buckets(_m)) ? n : kh_n_buckets(_m));
+  }
+
+  /* release log memory no longer needed */
+  hash_log_filter(hs);
+  if (hs->nlog == 0) {
+    free(hs->log);
+    hs->log = NULL;
+    hs->log_capacity = 0;
+  } else if (hs->nlog < hs->log_capacity) {
+    objmap_key_t *log;
+    log = (objmap_key_t*)realloc(hs->log, hs->nlog * sizeof(objmap_key_t));
+    if (log != NULL) {
+      hs->log = log;
+      hs->log_capacity = hs->nlog;
+    }
+  }
+}
+
+int om_hash_reserve(ObjectMap *om, size_t n) {
+  om_hash_t *hs = HASH(om);
+  khash_t(objmap) *_m = MAP(om);
+  size_t want, limit = (size_t)((khint_t)1 << 31) * __ac_HASH_UPPER;
+
+  /* khash cannot hold more than 2^31 buckets */
+  if (n >= limit - (size_t)kh_size(_m)) return 1;
+  want = (size_t)kh_size(_m) + n;
+
+  /* log */
+  if (hs->nlog + n > hs->log_capacity) {
+    objmap_key_t *log;
+    size_t capacity = hs->log_capacity * 2;
+    if (capacity < hs->nlog + n) capacity = hs->nlog + n;
+    log = (objmap_key_t*)realloc(hs->log, capacity * sizeof(objmap_key_t));
+    if (log == NULL) return 1;
+    hs->log = log;
+    hs->log_capacity = capacity;
+  }
+
+  /* table. kh_put() rehashes once n_occupied reaches upper_bound, so size
+   * the table such that the new objects fit below it */
+  if ((size_t)_m->n_occupied + n >= _m->upper_bound) {
+    khint_t buckets = (khint_t)(want / __ac_HASH_UPPER) + 2;
+    if (buckets < kh_n_buckets(_m)) buckets = kh_n_buckets(_m);
+    kh_resize(objmap, _m, buckets);
+  }
+  return 0;
+}
+
+static objmap_key_t hash_push_n(ObjectMap *om, void **objs, size_t n,
+                                objmap_key_t *out_handles) {
+  size_t i;
+  objmap_key_t first = om->top;
+
+  if (om_hash_reserve(om, n)) return OBJMAP_ERR_INTERNAL;
+  for (i = 0; i < n; ++i) {
+    /* cannot fail since there is room in both the table and log */
+    om_hash_put(om, first + (objmap_key_t)i, objs[i]);
+    if (out_handles) out_handles[i] = first + (objmap_key_t)i;
+  }
+  om->top += (objmap_key_t)n;
+  return first;
+}
+
+static void hash_flush(ObjectMap *om) {
+  size_t i;
+  khiter_t k;
+  om_hash_t *hs = HASH(om);
+  khash_t(objmap) *_m = MAP(om);
+
+  if (kh_size(_m) > 0 && hs->nlog < kh_n_buckets(_m) / OM_LOG_SCAN_RATIO) {
+    /* few objects in a large table: deallocate logged objects only. Entries
+     * are marked deleted in the first pass so probe sequences stay intact,
+     * then marked empty once all have been found so no tombstones remain */
+    for (i = 0; i < hs->nlog; ++i) {
+      k = kh_get(objmap, _m, hs->log[i]);
+      hs->log[i] = k; /* reuse log to remember bucket */
+      if (k == kh_end(_m)) continue; /* already popped */
+      OM_DEALLOC(om, kh_value(_m, k));
+      kh_del(objmap, _m, k);
+    }
+    for (i = 0; i < hs->nlog; ++i) {
+      k = (khiter_t)hs->log[i];
+      if (k == kh_end(_m)) continue;
+      __om_set_isempty_true(_m->flags, k);
+      --_m->n_occupied;
+    }
+  } else if (kh_size(_m) > 0) {
+    /* deallocate all objects stored within the hashtable (unless they are
+     * released with the pool), then wipe all flags (including tombstones)
+     * in one pass */
+    for (k = kh_begin(_m); OM_NEEDS_DEALLOC(om) && k != kh_end(_m); ++k) {
+      if (kh_exist(_m, k)) OM_DEALLOC(om, kh_value(_m, k));
+    }
+    kh_clear(objmap, _m);
+  }
+  hs->nlog = 0;
+  hash_maybe_shrink(om);
+}
 
 ObjectMap* objmap_new(void) {
+  return objmap_new_engine(OBJMAP_ENGINE_HASH);
+}
+
+/* create map using given engine. nshards only applies to sharded maps and
+ * storage is passed in for inline maps */
+static ObjectMap* map_create(objmap_engine_t engine, unsigned int nshards,
+                             void *storage) {
   ObjectMap *om = NULL;
   
   /* allocate mem for obj. Return NULL ptr if allocation fails */
@@ -36,76 +265,318 @@ ObjectMap* objmap_new(void) {
   /* initialise counter */
   om->top = 1; /* 0 is reserved for NULL index */
   
-  /* init khash of type "objmap". Stored as void* since khash_t(objmap) wouldn't
-   * be defined in objmap.h. To access with correct type, use MAP(om). */
-  om->map = (void*)kh_init(objmap); 
+  /* init storage for the chosen engine */
+  om->engine = engine;
+  switch (engine) {
+    case OBJMAP_ENGINE_SLOT:
+      om->map = (void*)om_slot_new();
+      break;
+    case OBJMAP_ENGINE_GENERATIONAL:
+      om->map = (void*)om_gen_new();
+      break;
+    case OBJMAP_ENGINE_SHARDED:
+      om->map = (void*)om_sharded_new(nshards);
+      break;
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      om->map = (void*)om_rm_new();
+      break;
+    case OBJMAP_ENGINE_INLINE:
+      om->map = storage;
+      break;
+    case OBJMAP_ENGINE_SWISS:
+      om->map = (void*)om_swiss_new();
+      break;
+    case OBJMAP_ENGINE_FLAT:
+      om->map = (void*)om_flat_new();
+      break;
+    default:
+      /* init khash of type "objmap". Stored as void* since khash_t(objmap)
+       * wouldn't be defined in objmap.h. To access with correct type, use
+       * MAP(om). */
+      om->engine = OBJMAP_ENGINE_HASH;
+      om->map = (void*)hash_new();
+  }
   assert(om->map != NULL);
+  if (om->map == NULL) {
+    free(om);
+    return NULL;
+  }
   
   om->deallocator = NULL;
+  om->shrink_load = 0.0;
+  om->pool = NULL;
+  om->flush_threads = 0;
+  om->reclaim = NULL;
   return om;
 }
 
+ObjectMap* objmap_new_engine(objmap_engine_t engine) {
+  /* inline maps need an object size */
+  if (engine == OBJMAP_ENGINE_INLINE) return NULL;
+  return map_create(engine, 0, NULL);
+}
+
+ObjectMap* objmap_new_concurrent(unsigned int nshards) {
+  return map_create(OBJMAP_ENGINE_SHARDED, nshards, NULL);
+}
+
+ObjectMap* objmap_new_inline(size_t object_size, size_t alignment) {
+  ObjectMap *om;
+  om_inline_t *in = om_inline_new(object_size, alignment);
+
+  if (in == NULL) return NULL; /* invalid size or alignment */
+  om = map_create(OBJMAP_ENGINE_INLINE, 0, in);
+  if (om == NULL) om_inline_destroy(in);
+  return om;
+}
+
+ObjectMap* objmap_open_mapped(const char *path) {
+  ObjectMap *om;
+  objmap_key_t top;
+  om_inline_t *in;
+
+  assert(path != NULL);
+  in = om_inline_open_mapped(path, &top);
+  if (in == NULL) return NULL; /* unreadable or invalid file */
+  om = map_create(OBJMAP_ENGINE_INLINE, 0, in);
+  if (om == NULL) {
+    om_inline_destroy(in);
+    return NULL;
+  }
+  om->top = top;
+  return om;
+}
+
+int objmap_save(ObjectMap *om, const char *path) {
+  assert(om != NULL && path != NULL);
+  if (om->engine != OBJMAP_ENGINE_INLINE) return 1;
+  return om_inline_save(om, path);
+}
+
+ObjectMap* objmap_new_with_capacity(size_t n) {
+  ObjectMap *om = objmap_new();
+  if (om != NULL && objmap_reserve(om, n) != 0) objmap_delete(&om);
+  return om;
+}
+
+int objmap_reserve(ObjectMap *om, size_t n) {
+  assert(om != NULL);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: return om_slot_reserve(om, n);
+    case OBJMAP_ENGINE_GENERATIONAL: return om_gen_reserve(om, n);
+    case OBJMAP_ENGINE_SHARDED: return om_sharded_reserve(om, n);
+    case OBJMAP_ENGINE_READ_MOSTLY: return om_rm_reserve(om, n);
+    case OBJMAP_ENGINE_INLINE: return om_inline_reserve(om, n);
+    case OBJMAP_ENGINE_SWISS: return om_swiss_reserve(om, n);
+    case OBJMAP_ENGINE_FLAT: return om_flat_reserve(om, n);
+    default: return om_hash_reserve(om, n);
+  }
+}
+
 void objmap_set_deallocator(ObjectMap *om, void(*deallocator)(void*)) {
-  if (!om) om->deallocator = deallocator;
+  if (!om) return;
+  om->deallocator = deallocator;
+  if (om->engine == OBJMAP_ENGINE_SHARDED) om_sharded_configure(om);
 }
 
-void objmap_flush(ObjectMap* om) {
-  khiter_t k;
-  khash_t(objmap) *_m;
+void objmap_set_shrink_threshold(ObjectMap *om, double load) {
+  if (!om) return;
+  om->shrink_load = (load > 0.0) ? load : 0.0;
+  if (om->engine == OBJMAP_ENGINE_SHARDED) om_sharded_configure(om);
+}
+
+void* objmap_alloc(ObjectMap *om, size_t size) {
+  assert(om != NULL);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SHARDED:
+    case OBJMAP_ENGINE_READ_MOSTLY:
+    case OBJMAP_ENGINE_INLINE:
+      return NULL;
+    default:
+      return om_pool_alloc(om, size);
+  }
+}
 
+void objmap_set_flush_threads(ObjectMap *om, unsigned int nthreads) {
   if (!om) return;
-  _m = MAP(om);
-  
-  /* deallocate all objects stored within the hashtable */
-  for (k = kh_begin(_m); k != kh_end(_m); ++k) {
-    if (kh_exist(_m, k)) {
-      (om->deallocator) ? om->deallocator(kh_value(_m, k))
-                        : free(kh_value(_m, k));
-      kh_del(objmap, _m, k);
-    }
+  om->flush_threads = nthreads;
+}
+
+static int flush_visit(objmap_key_t handle, void *obj, void *ctx) {
+  (void)handle;
+  OM_DEALLOC((ObjectMap*)ctx, obj);
+  return 0;
+}
+
+/* recognised by OM_NEEDS_DEALLOC(), so objects are never visited */
+void objmap_no_dealloc(void *obj) {
+  (void)obj;
+}
+
+/* empty the map, deallocating objects on the calling thread */
+static void map_flush(ObjectMap *om) {
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: om_slot_flush(om); break;
+    case OBJMAP_ENGINE_GENERATIONAL: om_gen_flush(om); break;
+    case OBJMAP_ENGINE_SHARDED: om_sharded_flush(om); break;
+    case OBJMAP_ENGINE_READ_MOSTLY: om_rm_flush(om); break;
+    case OBJMAP_ENGINE_INLINE: om_inline_flush(om); break;
+    case OBJMAP_ENGINE_SWISS: om_swiss_flush(om); break;
+    case OBJMAP_ENGINE_FLAT: om_flat_flush(om); break;
+    default: hash_flush(om);
+  }
+}
+
+/* deallocate objects using multiple threads, then empty the map without
+ * visiting them again. Returns 0 if not supported for the map's engine */
+static int map_flush_parallel(ObjectMap *om) {
+  void (*deallocator)(void*) = om->deallocator;
+
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SHARDED:
+      om_sharded_flush_parallel(om, om->flush_threads);
+      return 1;
+    case OBJMAP_ENGINE_READ_MOSTLY: /* objects may be popped meanwhile */
+      return 0;
+    default:
+      om_parallel_foreach(om, flush_visit, om, om->flush_threads);
+      om->deallocator = objmap_no_dealloc; /* already deallocated */
+      map_flush(om);
+      om->deallocator = deallocator;
+      return 1;
   }
 }
 
+/* free the engine storage of a map (which must be empty) */
+static void map_destroy_storage(ObjectMap *om) {
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT:
+      om_slot_destroy((om_slot_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_GENERATIONAL:
+      om_gen_destroy((om_gen_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_SHARDED:
+      om_sharded_destroy((om_sharded_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      om_rm_destroy((om_readmostly_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_INLINE:
+      om_inline_destroy((om_inline_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_SWISS:
+      om_swiss_destroy((om_swiss_t*)om->map);
+      break;
+    case OBJMAP_ENGINE_FLAT:
+      om_flat_destroy((om_flat_t*)om->map);
+      break;
+    default:
+      hash_destroy(HASH(om));
+  }
+}
+
+/* replace the storage of the map with empty storage and hand the old one
+ * to the reclamation thread. Returns 0 if not possible */
+static int map_detach(ObjectMap *om) {
+  ObjectMap *old;
+  void *fresh;
+
+  if (om->pool) return 0; /* objects go with the pool */
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: fresh = (void*)om_slot_new_at(om->top); break;
+    case OBJMAP_ENGINE_HASH: fresh = (void*)hash_new(); break;
+    case OBJMAP_ENGINE_SWISS: fresh = (void*)om_swiss_new(); break;
+    case OBJMAP_ENGINE_FLAT: fresh = (void*)om_flat_new(); break;
+    default: return 0; /* storage must be kept */
+  }
+  if (fresh == NULL) return 0;
+
+  old = (ObjectMap*)malloc(sizeof(ObjectMap));
+  if (old == NULL) {
+    ObjectMap tmp = *om;
+    tmp.map = fresh;
+    map_destroy_storage(&tmp);
+    return 0;
+  }
+  *old = *om;
+  old->reclaim = NULL;
+  om->map = fresh;
+
+  /* if the queue cannot grow, delete the old storage here */
+  if (om_reclaim_map((om_reclaim_t*)om->reclaim, old)) objmap_delete(&old);
+  return 1;
+}
+
+void objmap_flush(ObjectMap* om) {
+  if (!om) return;
+  if (om->reclaim && map_detach(om)) return;
+  if (om->flush_threads <= 1 || !OM_NEEDS_DEALLOC(om) ||
+      !map_flush_parallel(om)) {
+    map_flush(om);
+  }
+  om_pool_release((om_pool_t*)om->pool);
+}
+
+int objmap_set_async_reclaim(ObjectMap *om, int enable) {
+  assert(om != NULL);
+  if (enable && om->reclaim == NULL) {
+    om->reclaim = om_reclaim_start();
+    if (om->reclaim == NULL) return 1;
+  } else if (!enable && om->reclaim != NULL) {
+    om_reclaim_stop((om_reclaim_t*)om->reclaim);
+    om->reclaim = NULL;
+  }
+  return 0;
+}
+
+void objmap_reclaim_wait(ObjectMap *om) {
+  assert(om != NULL);
+  if (om->reclaim) om_reclaim_wait((om_reclaim_t*)om->reclaim);
+}
+
 void objmap_reset(ObjectMap* om) {
   if (!om) return;
-  om->top = 1;
+  switch (om->engine) {
+    /* generational handles never run out, and rewinding would cause stale
+     * handles to be reissued */
+    case OBJMAP_ENGINE_GENERATIONAL: break;
+    /* threads may hold blocks of keys which need to be invalidated */
+    case OBJMAP_ENGINE_SHARDED: om_sharded_reset(om); return;
+    default: om->top = 1;
+  }
   objmap_flush(om);
 }
 
 void objmap_delete(ObjectMap **om_ptr) {
   ObjectMap *om;
-  khash_t(objmap) *_m;
   
-  if (om_ptr == NULL) return;
+  if (om_ptr == NULL || *om_ptr == NULL) return;
   om = *om_ptr;   /* get ptr to actual object */
-  _m = MAP(om);
   *om_ptr = NULL; /* overwrite user's ptr with NULL */
   
-  /* deallocate all objects stored within the hashtable */
+  /* finish deallocating objects already handed to the background thread */
+  om_reclaim_stop((om_reclaim_t*)om->reclaim);
+  om->reclaim = NULL;
+
+  /* deallocate all objects stored within the map */
   objmap_flush(om);
+  om_pool_destroy((om_pool_t*)om->pool);
   
-  /* delete hashtable */
-  kh_destroy(objmap, _m);
+  /* delete storage */
+  map_destroy_storage(om);
   
   /* free map object */
   free(om);
 }
 
-objmap_key_t objmap_push(ObjectMap *om, void *obj) {
+objmap_key_t om_hash_put(ObjectMap *om, objmap_key_t key, void *obj) {
   int rc;
   khiter_t k;
-  objmap_key_t key;
-  khash_t(objmap) *_m;
+  khash_t(objmap) *_m = MAP(om);
 
-  assert(om != NULL);
-  assert(obj != NULL);
-  
-  /* check if the we've run out of keys */
-  if (om->top > OBJMAP_MAX_INDEX) return OBJMAP_ERR_OVERFLOW;
-  
-  /* create entry in hashtable */
-  _m = MAP(om);
-  key = om->top++;
+  /* make room to log key, then create entry in hashtable */
+  if (hash_log_reserve(HASH(om))) return OBJMAP_ERR_INTERNAL;
   k = kh_put(objmap, _m, key, &rc);
   assert(rc);
   if (!rc) { /* on error, remove entry and return err code */
@@ -113,16 +584,102 @@ objmap_key_t objmap_push(ObjectMap *om, void *obj) {
     return OBJMAP_ERR_INTERNAL;
   }
   kh_value(_m, k) = obj; /* store value in given position */
+  HASH(om)->log[HASH(om)->nlog++] = key;
   
   /* return object handle */
   return key;
 }
 
+objmap_key_t objmap_push(ObjectMap *om, void *obj) {
+  assert(om != NULL);
+  assert(obj != NULL);
+  
+  switch (om->engine) {
+    /* these engines manage their own keys */
+    case OBJMAP_ENGINE_GENERATIONAL: return om_gen_push(om, obj);
+    case OBJMAP_ENGINE_SHARDED: return om_sharded_push(om, obj);
+    case OBJMAP_ENGINE_READ_MOSTLY: return om_rm_push(om, obj);
+    default: break;
+  }
+
+  /* check if the we've run out of keys */
+  if (om->top > OBJMAP_MAX_INDEX) return OBJMAP_ERR_OVERFLOW;
+  if (om->engine == OBJMAP_ENGINE_SLOT) return om_slot_push(om, obj);
+  if (om->engine == OBJMAP_ENGINE_INLINE) return om_inline_push(om, obj);
+  if (om->engine == OBJMAP_ENGINE_SWISS) return om_swiss_push(om, obj);
+  if (om->engine == OBJMAP_ENGINE_FLAT) return om_flat_push(om, obj);
+  return om_hash_put(om, om->top++, obj);
+}
+
+objmap_key_t objmap_emplace(ObjectMap *om, void **out_obj) {
+  assert(om != NULL);
+  assert(out_obj != NULL);
+  assert(om->engine == OBJMAP_ENGINE_INLINE);
+  if (om->engine != OBJMAP_ENGINE_INLINE) return OBJMAP_ERR_INTERNAL;
+  return om_inline_emplace(om, out_obj);
+}
+
+objmap_key_t objmap_push_n(ObjectMap *om, void **objs, size_t n,
+                           objmap_key_t *out_handles) {
+  assert(om != NULL);
+  assert(objs != NULL || n == 0);
+  if (n == 0) return OBJMAP_NULL;
+  
+  switch (om->engine) {
+    /* these engines manage their own keys */
+    case OBJMAP_ENGINE_GENERATIONAL:
+      assert(out_handles != NULL); /* handles are not contiguous */
+      return om_gen_push_n(om, objs, n, out_handles);
+    case OBJMAP_ENGINE_SHARDED:
+      return om_sharded_push_n(om, objs, n, out_handles);
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      return om_rm_push_n(om, objs, n, out_handles);
+    default:
+      break;
+  }
+
+  /* check that there are enough keys for all objects */
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    return OBJMAP_ERR_OVERFLOW;
+  }
+  if (om->engine == OBJMAP_ENGINE_SLOT) {
+    return om_slot_push_n(om, objs, n, out_handles);
+  }
+  if (om->engine == OBJMAP_ENGINE_INLINE) {
+    return om_inline_push_n(om, objs, n, out_handles);
+  }
+  if (om->engine == OBJMAP_ENGINE_SWISS) {
+    return om_swiss_push_n(om, objs, n, out_handles);
+  }
+  if (om->engine == OBJMAP_ENGINE_FLAT) {
+    return om_flat_push_n(om, objs, n, out_handles);
+  }
+  return hash_push_n(om, objs, n, out_handles);
+}
+
 void* objmap_get(ObjectMap *om, objmap_key_t handle) {
   khash_t(objmap) *_m;
   khiter_t k;
   
   assert(om != NULL);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT:
+      return om_slot_get((const om_slot_t*)om->map, handle);
+    case OBJMAP_ENGINE_GENERATIONAL:
+      return om_gen_get((const om_gen_t*)om->map, handle);
+    case OBJMAP_ENGINE_SHARDED:
+      return om_sharded_get(om, handle);
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      return om_rm_get(om, handle);
+    case OBJMAP_ENGINE_INLINE:
+      return om_inline_get((const om_inline_t*)om->map, handle);
+    case OBJMAP_ENGINE_SWISS:
+      return om_swiss_get(om, handle);
+    case OBJMAP_ENGINE_FLAT:
+      return om_flat_get(om, handle);
+    default:
+      break;
+  }
   _m = MAP(om);
   
   k = kh_get(objmap, _m, handle);   /* lookup */
@@ -130,12 +687,287 @@ void* objmap_get(ObjectMap *om, objmap_key_t handle) {
   else return kh_value(_m, k);      /* else, return obj ptr */
 }
 
+/* same as kh_get() but with the hash of the key already computed */
+static khint_t hash_probe(const khash_t(objmap) *h, objmap_key_t key,
+                          khint_t k) {
+  khint_t inc, i, last, mask;
+
+  if (h->n_buckets == 0) return 0;
+  mask = h->n_buckets - 1;
+  i = k & mask;
+  inc = __ac_inc(k, mask); last = i;
+  while (!__ac_isempty(h->flags, i) &&
+         (__ac_isdel(h->flags, i) || h->keys[i] != key)) {
+    i = (i + inc) & mask;
+    if (i == last) return h->n_buckets;
+  }
+  return __ac_iseither(h->flags, i) ? h->n_buckets : i;
+}
+
+/* Lookups are done in batches. The flags and keys for the home bucket of
+ * every handle in a batch are prefetched first, then probes are resolved and
+ * the values of found entries prefetched, then the values are read. This
+ * overlaps the cache misses of the whole batch instead of taking them one
+ * lookup at a time */
+static size_t hash_get_n(ObjectMap *om, const objmap_key_t *handles,
+                         size_t n, void **out_ptrs) {
+  khash_t(objmap) *_m = MAP(om);
+  khint_t hashes[OM_GET_BATCH], mask;
+  size_t i, j, batch, found = 0;
+
+  if (kh_n_buckets(_m) == 0) { /* empty table */
+    for (i = 0; i < n; ++i) out_ptrs[i] = NULL;
+    return 0;
+  }
+  mask = kh_n_buckets(_m) - 1;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch; ++j) {
+      khint_t b;
+      hashes[j] = OM_HASH_FUNC(handles[i + j]);
+      b = hashes[j] & mask;
+      OM_PREFETCH(&_m->flags[b >> 4]);
+      OM_PREFETCH(&_m->keys[b]);
+    }
+    for (j = 0; j < batch; ++j) {
+      hashes[j] = hash_probe(_m, handles[i + j], hashes[j]);
+      if (hashes[j] != kh_end(_m)) OM_PREFETCH(&kh_value(_m, hashes[j]));
+    }
+    for (j = 0; j < batch; ++j) {
+      if (hashes[j] == kh_end(_m)) {
+        out_ptrs[i + j] = NULL;
+      } else {
+        out_ptrs[i + j] = kh_value(_m, hashes[j]);
+        ++found;
+      }
+    }
+  }
+  return found;
+}
+
+size_t objmap_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                    void **out_ptrs) {
+  size_t i, found = 0;
+
+  assert(om != NULL);
+  assert((handles != NULL && out_ptrs != NULL) || n == 0);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT:
+      return om_slot_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_GENERATIONAL:
+      return om_gen_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      return om_rm_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_INLINE:
+      return om_inline_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_SWISS:
+      return om_swiss_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_FLAT:
+      return om_flat_get_n(om, handles, n, out_ptrs);
+    case OBJMAP_ENGINE_SHARDED: /* locking dominates; look up one by one */
+      for (i = 0; i < n; ++i) {
+        out_ptrs[i] = objmap_get(om, handles[i]);
+        if (out_ptrs[i] != NULL) ++found;
+      }
+      return found;
+    default:
+      return hash_get_n(om, handles, n, out_ptrs);
+  }
+}
+
+/* Each flag word holds 2 bits (isdel, isempty) for 16 buckets, and a bucket
+ * is live if both are clear. Words are tested for live buckets as a whole */
+static int hash_next(ObjectMap *om, size_t *pos, size_t end,
+                     objmap_key_t *handle, void **obj) {
+  khash_t(objmap) *_m = MAP(om);
+  size_t i = *pos;
+
+  if (end > kh_end(_m)) end = kh_end(_m);
+  while (i < end) {
+    unsigned int shift = (unsigned int)(i & 0xfU) << 1;
+    khint32_t w = _m->flags[i >> 4] >> shift;
+    khint32_t live = ~(w | (w >> 1)) & (0x55555555U >> shift);
+
+    if (live == 0) { /* no live bucket in rest of word */
+      i = (i | 0xfU) + 1;
+      continue;
+    }
+    i += OM_CTZL(live) >> 1;
+    if (i >= end) break;
+    *handle = kh_key(_m, i);
+    *obj = kh_value(_m, i);
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+/* number of buckets examined by kh_get() when looking up key */
+static size_t hash_probe_length(ObjectMap *om, objmap_key_t key) {
+  const khash_t(objmap) *h = MAP(om);
+  khint_t k = OM_HASH_FUNC(key), mask = h->n_buckets - 1;
+  khint_t i = k & mask, inc = __ac_inc(k, mask), last = i;
+  size_t n = 1;
+
+  while (!__ac_isempty(h->flags, i) &&
+         (__ac_isdel(h->flags, i) || h->keys[i] != key)) {
+    i = (i + inc) & mask;
+    if (i == last) break;
+    ++n;
+  }
+  return n;
+}
+
+/* Positions are picked at random until OM_STATS_SAMPLES live objects are
+ * found, so every object is equally likely to be sampled. Taking, say, the
+ * first live object after evenly spaced positions would favour objects
+ * stored after empty buckets, which have short probes. Very sparse tables
+ * may give fewer samples as picking is abandoned after OM_STATS_PICKS */
+#define OM_STATS_PICKS (64 * OM_STATS_SAMPLES)
+
+void om_stats_sample_hits(ObjectMap *om, om_next_func_t next, size_t extent,
+                          size_t live, om_probe_func_t probe, size_t *hist) {
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  size_t i, pos, found = 0;
+  objmap_key_t key;
+  void *obj;
+
+  if (live <= OM_STATS_SAMPLES) { /* sample them all */
+    for (pos = 0; next(om, &pos, extent, &key, &obj);) {
+      om_stats_probe(hist, probe(om, key));
+    }
+    return;
+  }
+  for (i = 0; i < OM_STATS_PICKS && found < OM_STATS_SAMPLES; ++i) {
+    rng ^= rng << 13; /* xorshift64 */
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    pos = (size_t)(rng % extent);
+    if (next(om, &pos, pos + 1, &key, &obj)) {
+      om_stats_probe(hist, probe(om, key));
+      ++found;
+    }
+  }
+}
+
+/* Misses are sampled with consecutive keys from absent onwards */
+void om_hash_stats(ObjectMap *om, objmap_key_t absent, objmap_stats_t *stats) {
+  om_hash_t *hs = HASH(om);
+  khash_t(objmap) *_m = MAP(om);
+  size_t i, n_buckets = kh_n_buckets(_m);
+  objmap_key_t key;
+
+  stats->live = kh_size(_m);
+  stats->tombstones = _m->n_occupied - kh_size(_m);
+  stats->buckets = n_buckets;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_hash_t) +
+                  hs->log_capacity * sizeof(objmap_key_t);
+  if (n_buckets == 0) return;
+  stats->memory += n_buckets * (sizeof(objmap_key_t) + sizeof(void*)) +
+                   __ac_fsize(n_buckets) * sizeof(khint32_t);
+
+  om_stats_sample_hits(om, hash_next, n_buckets, kh_size(_m),
+                       hash_probe_length, stats->probe_hit);
+  for (i = 0, key = absent; i < OM_STATS_SAMPLES; ++i, ++key) {
+    if (key < absent) break; /* out of keys */
+    om_stats_probe(stats->probe_miss, hash_probe_length(om, key));
+  }
+}
+
+om_next_func_t om_engine_next(const ObjectMap *om) {
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: return om_slot_next;
+    case OBJMAP_ENGINE_GENERATIONAL: return om_gen_next;
+    case OBJMAP_ENGINE_READ_MOSTLY: return om_rm_next;
+    case OBJMAP_ENGINE_INLINE: return om_inline_next;
+    case OBJMAP_ENGINE_SWISS: return om_swiss_next;
+    case OBJMAP_ENGINE_FLAT: return om_flat_next;
+    default: return hash_next;
+  }
+}
+
+size_t om_engine_extent(const ObjectMap *om) {
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT:
+      return ((const om_slot_t*)om->map)->dir.npages << OM_PAGE_BITS;
+    case OBJMAP_ENGINE_GENERATIONAL:
+      return (size_t)om->top;
+    case OBJMAP_ENGINE_READ_MOSTLY:
+      return om_rm_extent(om);
+    case OBJMAP_ENGINE_INLINE:
+      return ((const om_inline_t*)om->map)->dir.npages << OM_PAGE_BITS;
+    case OBJMAP_ENGINE_SWISS:
+      return om_swiss_extent(om);
+    case OBJMAP_ENGINE_FLAT:
+      return om_flat_extent(om);
+    default:
+      return kh_end(MAP(om));
+  }
+}
+
+void objmap_iter_init(objmap_iter_t *it, ObjectMap *om) {
+  assert(it != NULL);
+  assert(om != NULL);
+  it->om = om;
+  it->pos = 0;
+  it->shard = 0;
+}
+
+int objmap_iter_next(objmap_iter_t *it, objmap_key_t *handle, void **obj) {
+  assert(it != NULL && it->om != NULL);
+  assert(handle != NULL && obj != NULL);
+  if (it->om->engine == OBJMAP_ENGINE_SHARDED) {
+    return om_sharded_next(it->om, &it->shard, &it->pos, handle, obj);
+  }
+  return om_engine_next(it->om)(it->om, &it->pos, (size_t)-1, handle, obj);
+}
+
+int objmap_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx) {
+  om_next_func_t next;
+  objmap_key_t handle;
+  void *obj;
+  size_t pos = 0;
+  int rc;
+
+  assert(om != NULL);
+  assert(fn != NULL);
+  if (om->engine == OBJMAP_ENGINE_SHARDED) {
+    return om_sharded_foreach(om, fn, ctx);
+  }
+
+  next = om_engine_next(om);
+  while (next(om, &pos, (size_t)-1, &handle, &obj)) {
+    rc = fn(handle, obj, ctx);
+    if (rc != 0) return rc;
+  }
+  return 0;
+}
+
+int objmap_parallel_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx,
+                            unsigned int nthreads) {
+  assert(om != NULL);
+  assert(fn != NULL);
+  return om_parallel_foreach(om, fn, ctx, nthreads);
+}
+
 void* objmap_pop(ObjectMap *om, objmap_key_t handle) {
   khash_t(objmap) *_m;
   khiter_t k;
   void *obj;
   
   assert(om != NULL);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: return om_slot_pop(om, handle);
+    case OBJMAP_ENGINE_GENERATIONAL: return om_gen_pop(om, handle);
+    case OBJMAP_ENGINE_SHARDED: return om_sharded_pop(om, handle);
+    case OBJMAP_ENGINE_READ_MOSTLY: return om_rm_pop(om, handle);
+    case OBJMAP_ENGINE_INLINE: return om_inline_pop(om, handle);
+    case OBJMAP_ENGINE_SWISS: return om_swiss_pop(om, handle);
+    case OBJMAP_ENGINE_FLAT: return om_flat_pop(om, handle);
+    default: break;
+  }
   _m = MAP(om);
   
   k = kh_get(objmap, _m, handle);   /* lookup */
@@ -143,6 +975,54 @@ void* objmap_pop(ObjectMap *om, objmap_key_t handle) {
   
   obj = kh_value(_m, k);  /* retrieve obj ptr store as value */
   kh_del(objmap, _m, k);  /* delete entry */
+  hash_maybe_shrink(om);
   
   return obj;
 }
+
+void objmap_release(ObjectMap *om, objmap_key_t handle) {
+  void *obj = objmap_pop(om, handle);
+
+  if (obj == NULL) return;
+  if (om->engine == OBJMAP_ENGINE_INLINE) { /* object stays in the map */
+    if (om->deallocator) om->deallocator(obj);
+  } else if (om->reclaim == NULL || om->pool != NULL ||
+             om_reclaim_object((om_reclaim_t*)om->reclaim, obj,
+                               om->deallocator)) {
+    OM_DEALLOC(om, obj);
+  }
+}
+
+void objmap_compact(ObjectMap *om) {
+  assert(om != NULL);
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: om_slot_compact(om); break;
+    case OBJMAP_ENGINE_GENERATIONAL: break; /* slots hold generations */
+    case OBJMAP_ENGINE_SHARDED: om_sharded_compact(om); break;
+    case OBJMAP_ENGINE_READ_MOSTLY: break; /* readers may hold any page */
+    case OBJMAP_ENGINE_INLINE: om_inline_compact(om); break;
+    case OBJMAP_ENGINE_SWISS: om_swiss_compact(om); break;
+    case OBJMAP_ENGINE_FLAT: om_flat_compact(om); break;
+    default: hash_compact(om);
+  }
+}
+
+void objmap_stats(ObjectMap *om, objmap_stats_t *stats) {
+  assert(om != NULL);
+  assert(stats != NULL);
+  memset(stats, 0, sizeof(objmap_stats_t));
+  switch (om->engine) {
+    case OBJMAP_ENGINE_SLOT: om_slot_stats(om, stats); break;
+    case OBJMAP_ENGINE_GENERATIONAL: om_gen_stats(om, stats); break;
+    case OBJMAP_ENGINE_SHARDED: om_sharded_stats(om, stats); break;
+    case OBJMAP_ENGINE_READ_MOSTLY: om_rm_stats(om, stats); break;
+    case OBJMAP_ENGINE_INLINE: om_inline_stats(om, stats); break;
+    case OBJMAP_ENGINE_SWISS: om_swiss_stats(om, stats); break;
+    case OBJMAP_ENGINE_FLAT: om_flat_stats(om, stats); break;
+    default: om_hash_stats(om, om->top, stats);
+  }
+  if (stats->buckets > 0) {
+    stats->load = (double)(stats->live + stats->tombstones) /
+                  (double)stats->buckets;
+  }
+}
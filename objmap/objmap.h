@@ -6,8 +6,13 @@
  */
 #ifndef OBJMAP_H_
 #define OBJMAP_H_
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*! \defgroup OBJMAP Utility: Object Mapper 
  * 
  * The Object Mapper allows a library to store internal objects within a hash 
@@ -27,12 +32,14 @@
  * - Slower than using opaque pointers due to the hashtable lookup
  * - Can potentially run out of keys (generated incrementally). The limit 
  *   depends on the datatype used for keys. See ::objmap_key_t.
- *   - To keep the code simple, we do not reuse keys from deleted items
+ *   - To keep the code simple, we do not reuse keys from deleted items unless
+ *     ::OBJMAP_ENGINE_GENERATIONAL is used
  *   - By default, we use 32-bit unsigned integers for keys (uint32_t). Compile
  *     with OBJMAP_USE_64BIT_KEYS to switch to 64-bit unsigned ints (uint64_t)
  * 
  * \note This is a stripped down version and is essentially a wrapper around
- * the internal hashtable implementation (see khash.h).
+ * the internal hashtable implementation (see khash.h). Alternative storage
+ * engines can be selected when the map is created. See ::objmap_engine_t.
  * 
  * @{*/
 
@@ -52,6 +59,46 @@ typedef uint32_t objmap_key_t;
 /* #define OBJMAP_KEY_LIMIT UINT_MAX */
 
 
+/*! \brief Number of high bits of a handle used as a generation counter
+ *
+ * Only applies to maps using ::OBJMAP_ENGINE_GENERATIONAL. The remaining low
+ * bits index the slot holding the object, which limits the number of objects
+ * that can be stored at any one time. Can be overridden at compile time.
+ */
+#ifndef OBJMAP_GEN_BITS
+#ifdef OBJMAP_USE_64BIT_KEYS
+#define OBJMAP_GEN_BITS 16
+#else
+#define OBJMAP_GEN_BITS 8
+#endif
+#endif
+
+/*! \brief Values for ::OBJMAP_HASH */
+#define OBJMAP_HASH_KHASH 0
+#define OBJMAP_HASH_FIBONACCI 1
+
+/*! \brief Hash function used by ::OBJMAP_ENGINE_HASH and
+ * ::OBJMAP_ENGINE_SHARDED
+ *
+ * - ::OBJMAP_HASH_KHASH (default): khash's integer hashes. 32-bit handles are
+ *   their own hash, which keeps consecutive handles in consecutive buckets.
+ *   64-bit handles are hashed with a few shifts and xors and truncated to
+ *   32 bits, so handles that differ only in their high bits may collide.
+ * - ::OBJMAP_HASH_FIBONACCI: the handle, with its high half folded into its
+ *   low half for 64-bit keys, is multiplied by 2^64 divided by the golden
+ *   ratio, and the high 32 bits of the product are used. Every bit of the
+ *   handle affects the bucket chosen, so handles with structure in their
+ *   high bits (as made by ::OBJMAP_ENGINE_SHARDED and
+ *   ::OBJMAP_ENGINE_GENERATIONAL) are spread evenly, at the cost of an
+ *   extra multiplication and of locality for consecutive handles.
+ *
+ * ::OBJMAP_ENGINE_SWISS and ::OBJMAP_ENGINE_FLAT always use a Fibonacci hash.
+ * Can be overridden at compile time.
+ */
+#ifndef OBJMAP_HASH
+#define OBJMAP_HASH OBJMAP_HASH_KHASH
+#endif
+
 /* return values */
 /*! \brief NULL handle */
 #define OBJMAP_NULL ((objmap_key_t)0)
@@ -59,16 +106,105 @@ typedef uint32_t objmap_key_t;
 #define OBJMAP_ERR_INTERNAL ((objmap_key_t)(OBJMAP_KEY_LIMIT - 1))
 #define OBJMAP_MAX_INDEX    ((objmap_key_t)(OBJMAP_KEY_LIMIT - 2))
 
+/*! \brief Storage engines that can be used by an object map
+ *
+ * The engine is chosen when the map is created (see objmap_new_engine()) and
+ * does not affect the semantics of the API, only its performance profile.
+ */
+typedef enum {
+  /*! Hashtable keyed by handle (default). Memory usage is proportional to the
+   * number of objects stored. */
+  OBJMAP_ENGINE_HASH = 0,
+  /*! Paged array indexed directly by handle. Lookups require no hashing but
+   * memory usage is proportional to the largest handle issued, so this is
+   * best suited to maps where most handles remain live. */
+  OBJMAP_ENGINE_SLOT,
+  /*! Paged array of recycled slots. Handles encode the slot index and a
+   * generation counter (see ::OBJMAP_GEN_BITS) so keys of deleted items can
+   * be reused without running out, while stale handles are still detected.
+   * A stale handle is only mistaken for a live one after its slot has been
+   * reused 2^::OBJMAP_GEN_BITS - 1 times. */
+  OBJMAP_ENGINE_GENERATIONAL,
+  /*! Thread-safe map made up of independently locked hashtables. The low
+   * bits of a handle select the shard holding the object. See
+   * objmap_new_concurrent(). */
+  OBJMAP_ENGINE_SHARDED,
+  /*! Thread-safe paged array indexed directly by handle, for workloads
+   * dominated by lookups. objmap_get() takes no lock and writes no shared
+   * memory, so lookups scale with the number of threads. objmap_push(),
+   * objmap_pop() and objmap_flush() may also be called concurrently but are
+   * serialised. The caveats on object lifetime described for
+   * objmap_new_concurrent() apply. Memory usage is as for
+   * ::OBJMAP_ENGINE_SLOT. */
+  OBJMAP_ENGINE_READ_MOSTLY,
+  /*! Paged array of fixed-size objects stored by value rather than by
+   * pointer, so a lookup does not need to follow a pointer to reach the
+   * object and objects are not allocated individually. See
+   * objmap_new_inline(). Memory usage is as for ::OBJMAP_ENGINE_SLOT. */
+  OBJMAP_ENGINE_INLINE,
+  /*! Hashtable probed 16 buckets at a time using a byte of metadata per
+   * bucket (a "Swiss table"). Lookups, particularly of handles not in the
+   * map, examine fewer buckets than with ::OBJMAP_ENGINE_HASH and use SSE2
+   * where available. Memory usage is proportional to the number of objects
+   * stored. */
+  OBJMAP_ENGINE_SWISS,
+  /*! Hashtable whose buckets hold the handle and object pointer together,
+   * so a lookup in a large map usually takes one cache miss where
+   * ::OBJMAP_ENGINE_HASH takes three. Empty and deleted buckets are marked
+   * with key values never issued as handles rather than with separate
+   * flags. Collisions are resolved by linear probing. Memory usage is
+   * proportional to the number of objects stored. */
+  OBJMAP_ENGINE_FLAT
+} objmap_engine_t;
+
 /*! \brief Pointer type for functions that can be used in place of free() */
 typedef void (*objmap_free_func_t)(void*);
 
 /*! \brief Data Structure representing an object map */
 typedef struct {
   objmap_key_t top; /*!< Next key value to assign */
-  void* map;        /*!< Pointer to hash table used to storage */
+  void* map;        /*!< Pointer to engine-specific storage */
   void (*deallocator)(void*); /*!< Custom deallocator function for members */
+  objmap_engine_t engine; /*!< Storage engine used for \c map */
+  double shrink_load; /*!< Load factor below which the table is shrunk */
+  void* pool;         /*!< Memory pool used by objmap_alloc(), or NULL */
+  unsigned int flush_threads; /*!< Threads used to deallocate objects */
+  void* reclaim;      /*!< Background reclamation thread, or NULL */
 } ObjectMap;
 
+/*! \brief Function called for each object by objmap_foreach()
+ *
+ * Receives the handle and address of an object, and the context pointer
+ * given to objmap_foreach(). Returning non-zero stops the iteration.
+ */
+typedef int (*objmap_visit_func_t)(objmap_key_t handle, void *obj, void *ctx);
+
+/*! \brief Number of entries in the probe length histograms of
+ * ::objmap_stats_t */
+#define OBJMAP_PROBE_HIST 16
+
+/*! \brief Statistics describing the state of a map. See objmap_stats() */
+typedef struct {
+  size_t live;       /*!< Number of objects stored */
+  size_t tombstones; /*!< Buckets still occupied by popped objects */
+  size_t buckets;    /*!< Number of buckets (or slots) allocated */
+  size_t memory;     /*!< Bytes allocated by the map itself */
+  double load;       /*!< Fraction of buckets that are live or tombstones */
+  /*! Sampled lookups of stored objects, by number of buckets examined.
+   * Entry \c i counts lookups taking \c i+1 probes; the last entry counts
+   * all lookups taking ::OBJMAP_PROBE_HIST probes or more */
+  size_t probe_hit[OBJMAP_PROBE_HIST];
+  /*! Sampled lookups of handles not in the map, as for \c probe_hit */
+  size_t probe_miss[OBJMAP_PROBE_HIST];
+} objmap_stats_t;
+
+/*! \brief Iterator over the objects in a map. See objmap_iter_init() */
+typedef struct {
+  ObjectMap *om; /*!< Map being iterated */
+  size_t pos;    /*!< Engine-specific position of the next entry to examine */
+  size_t shard;  /*!< Shard being iterated (::OBJMAP_ENGINE_SHARDED only) */
+} objmap_iter_t;
+
 /*! 
  * \brief Creates a new object map
  * \return Pointer to the newly created map
@@ -77,6 +213,155 @@ typedef struct {
  */
 ObjectMap* objmap_new(void);
 
+/*! 
+ * \brief Creates a new object map using a specific storage engine
+ * \param[in] engine Storage engine to use. See ::objmap_engine_t
+ * \return Pointer to the newly created map
+ *
+ * objmap_new() is equivalent to calling this with ::OBJMAP_ENGINE_HASH.
+ * Unknown engine values fall back to ::OBJMAP_ENGINE_HASH.
+ * ::OBJMAP_ENGINE_SHARDED uses the default number of shards.
+ * ::OBJMAP_ENGINE_INLINE cannot be used; see objmap_new_inline().
+ *
+ * If an error occurs (e.g. insufficient memory), \c NULL is returned.
+ */
+ObjectMap* objmap_new_engine(objmap_engine_t engine);
+
+/*! 
+ * \brief Creates a new thread-safe object map
+ * \param[in] nshards Number of independently locked shards
+ * \return Pointer to the newly created map
+ *
+ * The map uses ::OBJMAP_ENGINE_SHARDED. \c nshards is rounded up to a power
+ * of 2 (at most 1024). If \c 0, a default of 16 shards is used. Handles are
+ * still assigned incrementally; consecutive handles are held in different
+ * shards so threads operating on different objects rarely contend.
+ *
+ * To avoid contention on the key counter, each thread claims keys in blocks
+ * of 128 and hands them out locally, so handles are only increasing within a
+ * thread and \c om->top may run ahead of the keys actually issued. Keys
+ * claimed by a thread that are never used are lost until the map is reset.
+ * A thread holds blocks for up to 4 maps at once, and frees the block of a
+ * map it deletes. Beyond that, it claims keys one at a time for the other
+ * maps, and only gives up a block with keys left once it has made 65536
+ * pushes without using it. In the worst case, 127 keys are therefore lost
+ * per thread pushing to the map, plus 127 keys for every 65536 pushes a
+ * thread makes to concurrent maps.
+ *
+ * objmap_push(), objmap_get(), objmap_pop(), objmap_flush() and
+ * objmap_compact() may be called concurrently from multiple threads. Other
+ * routines (including objmap_reset() and objmap_delete()) must not be called
+ * while the map is in use by other threads. Flushing locks one shard at a
+ * time so objects pushed concurrently may survive the flush.
+ *
+ * Objects returned by objmap_get() are not protected by the map. Users must
+ * ensure objects are not popped and freed while other threads still use them.
+ *
+ * If an error occurs (e.g. insufficient memory), \c NULL is returned.
+ */
+ObjectMap* objmap_new_concurrent(unsigned int nshards);
+
+/*!
+ * \brief Creates a new object map storing objects by value
+ * \param[in] object_size Size of each object in bytes
+ * \param[in] alignment Alignment of objects in bytes (power of 2), or \c 0 to
+ *            use the natural alignment of \c object_size (at most 16)
+ * \return Pointer to the newly created map
+ *
+ * The map uses ::OBJMAP_ENGINE_INLINE. Objects live in contiguous pages owned
+ * by the map: objmap_push() copies \c object_size bytes from the given
+ * address into the map, or objmap_emplace() can be used to construct an
+ * object in place. objmap_get() returns the address of the object within the
+ * map, which remains valid until the object is popped.
+ *
+ * Since the map owns the memory, objects are never freed individually. If a
+ * deallocator is set (see objmap_set_deallocator()), it is called on each
+ * object removed by objmap_flush(), objmap_reset() or objmap_delete() as a
+ * finalizer, and must not free the object itself.
+ *
+ * objmap_pop() returns the address of the object within the map. The object
+ * is no longer tracked but its memory remains valid until the map is
+ * compacted, reset or deleted.
+ *
+ * If an error occurs (e.g. insufficient memory, \c object_size is \c 0 or
+ * \c alignment is not a power of 2), \c NULL is returned.
+ */
+ObjectMap* objmap_new_inline(size_t object_size, size_t alignment);
+
+/*!
+ * \brief Saves an inline map to a file
+ * \param[in] om Reference to map created with objmap_new_inline() or
+ *            objmap_open_mapped()
+ * \param[in] path File to write. An existing file is replaced
+ * \return 0 if successful, non-zero otherwise
+ *
+ * The file holds the pages of the map as they are laid out in memory, with
+ * file offsets in place of pointers, so objmap_open_mapped() can use it
+ * without copying or parsing the objects. Handles are preserved, including
+ * the next one to be issued. Objects are written byte for byte and so must
+ * not hold pointers or other process-specific state.
+ *
+ * The file is written under a temporary name (\c path with \c .tmp
+ * appended) and renamed once complete, so an error leaves any previous file
+ * untouched and maps opened from it are unaffected.
+ *
+ * Files can only be opened by builds of the library with the same key width,
+ * byte order and word size. Objects aligned to more than 4096 bytes are not
+ * supported. Non-zero is also returned if the map does not use
+ * ::OBJMAP_ENGINE_INLINE.
+ */
+int objmap_save(ObjectMap *om, const char *path);
+
+/*!
+ * \brief Opens a map saved with objmap_save() by mapping the file into memory
+ * \param[in] path File written by objmap_save()
+ * \return Pointer to the inline map, or \c NULL if the file cannot be
+ *         mapped, was not written by objmap_save() in a compatible build or
+ *         is inconsistent
+ *
+ * Opening takes constant time per page of the map, as objects are neither
+ * read nor copied: the pages of the file become the pages of the map, and
+ * the operating system reads each from the file when it is first accessed.
+ * Only the occupancy bitmap of each page is read, to check it against the
+ * rest of the file.
+ *
+ * The map can be used and modified like one created with objmap_new_inline()
+ * with the same object size and alignment. The file is mapped copy-on-write,
+ * so changes are private to the map and never written back; use
+ * objmap_save() to keep them. The file is unmapped when the map is deleted.
+ * It must not be modified or truncated by other means while mapped.
+ */
+ObjectMap* objmap_open_mapped(const char *path);
+
+/*!
+ * \brief Creates a new object map with room for a number of objects
+ * \param[in] n Number of objects to make room for
+ * \return Pointer to the newly created map
+ *
+ * Same as objmap_new() followed by objmap_reserve().
+ *
+ * If an error occurs (e.g. insufficient memory), \c NULL is returned.
+ */
+ObjectMap* objmap_new_with_capacity(size_t n);
+
+/*!
+ * \brief Make room for more objects
+ * \param[in] om Reference to map
+ * \param[in] n Number of objects to make room for
+ * \return \c 0 on success, non-zero if memory could not be allocated or there
+ *         are not enough handles left
+ *
+ * Allocates up front the memory needed to push \c n more objects, so the
+ * map is not resized while they are pushed. When the final size of a map is
+ * known, this avoids rehashing the table repeatedly as it grows and the
+ * memory spikes that come with it.
+ *
+ * For ::OBJMAP_ENGINE_SHARDED, room is made in every shard for its share of
+ * \c n objects. Memory reserved may be released again by objmap_compact() or
+ * by automatic shrinking (see objmap_set_shrink_threshold()).
+ */
+int objmap_reserve(ObjectMap *om, size_t n);
+
 /*!
  * \brief Specify a deallocation function to use when freeing objects
  * \param[in] om Reference to map
@@ -90,6 +375,115 @@ ObjectMap* objmap_new(void);
  */
 void objmap_set_deallocator(ObjectMap *om, void(*deallocator)(void*));
 
+/*!
+ * \brief Deallocator that leaves objects alone
+ * \param[in] obj Object (ignored)
+ *
+ * For use with objmap_set_deallocator() when objects are owned and destroyed
+ * by the caller, e.g. by visiting them with objmap_foreach() before the map
+ * is flushed. The map recognises it, so objmap_flush(), objmap_reset() and
+ * objmap_delete() do not visit objects at all, as with objmap_alloc().
+ */
+void objmap_no_dealloc(void *obj);
+
+/*!
+ * \brief Enable automatic shrinking of the hashtable
+ * \param[in] om Reference to map
+ * \param[in] load Load factor below which the table is shrunk
+ *
+ * By default, the hashtable never shrinks so a map keeps the memory needed for
+ * the largest number of objects it has held. When \c load is positive, the
+ * table is shrunk after objmap_pop() or objmap_flush() if the fraction of
+ * buckets in use drops below \c load. The shrunk table is sized for a load
+ * factor well below the growth threshold so it is not grown again soon after.
+ * Values around \c 0.1 are recommended.
+ *
+ * Setting \c load to \c 0 disables automatic shrinking (default).
+ *
+ * This only applies to ::OBJMAP_ENGINE_HASH. See objmap_compact().
+ */
+void objmap_set_shrink_threshold(ObjectMap *om, double load);
+
+/*!
+ * \brief Allocate memory for an object from a pool owned by the map
+ * \param[in] om Reference to map
+ * \param[in] size Size of object in bytes
+ * \return Address of uninitialised memory, or \c NULL on error
+ *
+ * Objects allocated this way are carved out of large blocks and released all
+ * at once when the map is flushed, reset or deleted, which is much cheaper
+ * than allocating and freeing objects individually. The memory is suitably
+ * aligned for any type, as for \c malloc().
+ *
+ * Once this has been called, all objects pushed into the map are assumed to
+ * come from the pool, and \c free() is no longer called on them. If no
+ * deallocator is set, flushing does not need to visit objects at all. If one
+ * is set, it is still called on each object before the pool is released so
+ * it can finalise the object, but must not free it.
+ *
+ * Objects returned by objmap_pop() also remain valid only until the next
+ * flush, reset or deletion of the map.
+ *
+ * The pool is not thread-safe, so this is not available for
+ * ::OBJMAP_ENGINE_SHARDED and ::OBJMAP_ENGINE_READ_MOSTLY maps. It is not
+ * needed for ::OBJMAP_ENGINE_INLINE maps. In these cases, \c NULL is
+ * returned.
+ */
+void* objmap_alloc(ObjectMap *om, size_t size);
+
+/*!
+ * \brief Deallocate objects using several threads when flushing
+ * \param[in] om Reference to map
+ * \param[in] nthreads Number of threads to use (including the caller).
+ *            \c 0 or \c 1 deallocates objects on the calling thread only
+ *            (default)
+ *
+ * When many objects are stored and the deallocator is expensive (e.g. it
+ * closes resources or frees nested structures), objmap_flush(),
+ * objmap_reset() and objmap_delete() spend most of their time deallocating.
+ * Since objects are independent, deallocation can be shared out among
+ * threads in the same way as objmap_parallel_foreach(). The deallocator must
+ * then be thread-safe (\c free() is).
+ *
+ * Not supported for ::OBJMAP_ENGINE_READ_MOSTLY, which is always flushed by
+ * the calling thread as other threads may pop objects during the flush. For
+ * ::OBJMAP_ENGINE_SHARDED, each thread flushes whole shards.
+ */
+void objmap_set_flush_threads(ObjectMap *om, unsigned int nthreads);
+
+/*!
+ * \brief Deallocate objects on a background thread
+ * \param[in] om Reference to map
+ * \param[in] enable Non-zero to start a reclamation thread for the map, zero
+ *            to stop it
+ * \return \c 0 on success, non-zero if the thread could not be started
+ *
+ * Normally objmap_flush() and objmap_reset() run the deallocator for every
+ * object on the calling thread. With asynchronous reclamation enabled, the
+ * storage of ::OBJMAP_ENGINE_HASH, ::OBJMAP_ENGINE_SLOT, ::OBJMAP_ENGINE_SWISS
+ * and ::OBJMAP_ENGINE_FLAT maps is instead detached in constant time and
+ * replaced with empty storage, and a background thread deallocates the
+ * detached objects later. Objects released with objmap_release() are also
+ * handed to the background thread, for any engine.
+ *
+ * The deallocator must therefore be safe to call from another thread. Other
+ * engines are still flushed by the calling thread. Maps using objmap_alloc()
+ * release objects on the calling thread as usual, since their memory goes
+ * with the pool.
+ *
+ * Stopping the thread, or deleting the map, waits for all pending objects to
+ * be deallocated. See also objmap_reclaim_wait().
+ */
+int objmap_set_async_reclaim(ObjectMap *om, int enable);
+
+/*!
+ * \brief Wait until the background thread has deallocated pending objects
+ * \param[in] om Reference to map
+ *
+ * Does nothing if asynchronous reclamation is not enabled.
+ */
+void objmap_reclaim_wait(ObjectMap *om);
+
 /*!
  * \brief Adds a new object to the map
  * \param[in] om Reference to map
@@ -99,13 +493,55 @@ void objmap_set_deallocator(ObjectMap *om, void(*deallocator)(void*));
  * Users are encouraged to check that the returned handle is less than
  * ::OBJMAP_MAX_INDEX. Values above :OBJMAP_MAX_INDEX are reserved for error
  * indicators.
+ *
+ * For maps created with objmap_new_inline(), the object is copied into the
+ * map and \c obj can be reused by the caller.
  * 
  * Possible error codes:
- * - ::OBJMAP_ERR_OVERFLOW (We've run out of keys)
+ * - ::OBJMAP_ERR_OVERFLOW (We've run out of keys. For
+ *   ::OBJMAP_ENGINE_GENERATIONAL, too many objects are stored at once)
  * - ::OBJMAP_ERR_INTERNAL (The hashtable implementation return an error)
  */
 objmap_key_t objmap_push(ObjectMap *om, void *obj);
 
+/*!
+ * \brief Adds a new object to an inline map, constructed in place
+ * \param[in] om Reference to map created with objmap_new_inline()
+ * \param[out] out_obj Receives the address of the new object in the map
+ * \return Object handle (if successful) or error code
+ *
+ * The new object is zero-initialised and can be written to directly, which
+ * avoids building the object elsewhere and copying it in with objmap_push().
+ * \c out_obj is only set if successful.
+ *
+ * Possible error codes are as for objmap_push(). ::OBJMAP_ERR_INTERNAL is
+ * returned if the map does not use ::OBJMAP_ENGINE_INLINE.
+ */
+objmap_key_t objmap_emplace(ObjectMap *om, void **out_obj);
+
+/*!
+ * \brief Adds several objects to the map at once
+ * \param[in] om Reference to map
+ * \param[in] objs Array of \c n object addresses to be added
+ * \param[in] n Number of objects to add
+ * \param[out] out_handles Array of \c n elements to receive object handles,
+ *             or \c NULL
+ * \return Handle of the first object (if successful) or error code
+ *
+ * This is equivalent to calling objmap_push() for each object, but room for
+ * all objects is made up front so the map is resized at most once, and
+ * concurrent maps lock each shard only once.
+ *
+ * Except for ::OBJMAP_ENGINE_GENERATIONAL, objects are assigned consecutive
+ * handles starting from the returned value, so \c out_handles may be
+ * \c NULL. It is required for ::OBJMAP_ENGINE_GENERATIONAL.
+ *
+ * Either all objects are added or none are. Possible error codes are as for
+ * objmap_push(). If \c n is \c 0, ::OBJMAP_NULL is returned.
+ */
+objmap_key_t objmap_push_n(ObjectMap *om, void **objs, size_t n,
+                           objmap_key_t *out_handles);
+
 /*!
  * \brief Retrieve an object associated with a handle
  * \param[in] om Reference to map
@@ -119,6 +555,100 @@ objmap_key_t objmap_push(ObjectMap *om, void *obj);
  */
 void* objmap_get(ObjectMap *om, objmap_key_t handle);
 
+/*!
+ * \brief Retrieve the objects associated with several handles
+ * \param[in] om Reference to map
+ * \param[in] handles Array of \c n object handles
+ * \param[in] n Number of handles
+ * \param[out] out_ptrs Array of \c n elements to receive object addresses
+ * \return Number of handles that were found
+ *
+ * This is equivalent to calling objmap_get() for each handle, with \c NULL
+ * stored for invalid handles. Lookups are done in batches with memory
+ * prefetched for all handles in a batch before it is read, so the cache
+ * misses of different lookups overlap. This is considerably faster than
+ * individual lookups when the map is large and handles are random.
+ */
+size_t objmap_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                    void **out_ptrs);
+
+/*!
+ * \brief Calls a function for every object in the map
+ * \param[in] om Reference to map
+ * \param[in] fn Function to call with the handle and address of each object
+ * \param[in] ctx Context pointer passed on to \c fn
+ * \return \c 0 if all objects were visited, else the non-zero value returned
+ *         by \c fn to stop the iteration
+ *
+ * Objects are visited in no particular order. Only live entries are
+ * examined: empty parts of the map are skipped in bulk (16 buckets at a time
+ * for ::OBJMAP_ENGINE_HASH), so this is much faster than calling
+ * objmap_get() for every handle.
+ *
+ * \c fn must not push objects into the map. It may pop the object it is
+ * given, unless automatic shrinking is enabled (see
+ * objmap_set_shrink_threshold()).
+ *
+ * For ::OBJMAP_ENGINE_SHARDED, each shard is locked while its objects are
+ * visited, so \c fn must not call any routine on the same map. Objects
+ * pushed or popped concurrently may or may not be visited.
+ */
+int objmap_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx);
+
+/*!
+ * \brief Calls a function for every object in the map, using several threads
+ * \param[in] om Reference to map
+ * \param[in] fn Function to call with the handle and address of each object
+ * \param[in] ctx Context pointer passed on to \c fn
+ * \param[in] nthreads Number of threads to use (including the caller), or
+ *            \c 0 to use one per online processor
+ * \return \c 0 if all objects were visited, else a non-zero value returned
+ *         by \c fn to stop the iteration
+ *
+ * As objmap_foreach(), but the map is split into chunks which are claimed in
+ * turn by \c nthreads threads, so the sweep scales with the number of cores
+ * even when objects are unevenly spread. Each object is visited exactly once
+ * unless the iteration is stopped, in which case objects in chunks already
+ * being visited by other threads may still be visited before this returns.
+ *
+ * \c fn is called concurrently from several threads and must be thread-safe.
+ * The map must not be modified until this returns, and \c fn must not pop
+ * objects. For ::OBJMAP_ENGINE_SHARDED, each thread visits whole shards
+ * under their lock, and the restrictions of objmap_foreach() apply.
+ */
+int objmap_parallel_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx,
+                            unsigned int nthreads);
+
+/*!
+ * \brief Start iterating over the objects in a map
+ * \param[out] it Iterator to initialise
+ * \param[in] om Reference to map
+ *
+ * Use objmap_iter_next() to retrieve each object in turn:
+ * \code
+ * objmap_iter_t it;
+ * objmap_key_t handle;
+ * void *obj;
+ *
+ * objmap_iter_init(&it, om);
+ * while (objmap_iter_next(&it, &handle, &obj)) { ... }
+ * \endcode
+ *
+ * The same restrictions apply as for objmap_foreach(). In addition, for
+ * ::OBJMAP_ENGINE_SHARDED objects may be missed or visited twice if a shard
+ * is resized between calls to objmap_iter_next().
+ */
+void objmap_iter_init(objmap_iter_t *it, ObjectMap *om);
+
+/*!
+ * \brief Retrieve the next object from an iterator
+ * \param[in,out] it Iterator initialised with objmap_iter_init()
+ * \param[out] handle Receives the object handle
+ * \param[out] obj Receives the object address
+ * \return \c 1 if an object was retrieved, \c 0 if there are no more
+ */
+int objmap_iter_next(objmap_iter_t *it, objmap_key_t *handle, void **obj);
+
 /*!
  * \brief Deletes all objects within the map
  * \param[in] om Reference to map
@@ -127,6 +657,9 @@ void* objmap_get(ObjectMap *om, objmap_key_t handle);
  * map datastructure. This allows users to quickly all objects within
  * the map without having to destroy and recreate the object mapper.
  *
+ * For the default engine, a sparse map is flushed in time proportional to the
+ * number of objects stored rather than the number of buckets in the table.
+ *
  * If \c reset_handles is not \c 0 (default), internal counters will be reset
  * which allow handles to be recycled. Do note that this can potentially lead to
  * confusing errors if stale handles are later used for querying the map.
@@ -144,6 +677,9 @@ void objmap_flush(ObjectMap* om);
  * applications that repeatedly populates and flushes the mapper. However, do
  * not that this can potentially lead to confusing errors if stale handles are
  * later used for querying the map.
+ *
+ * Maps using ::OBJMAP_ENGINE_GENERATIONAL do not run out of keys, so for these
+ * this is equivalent to objmap_flush() and stale handles remain detectable.
  */
 void objmap_reset(ObjectMap* om);
 
@@ -160,6 +696,67 @@ void objmap_reset(ObjectMap* om);
  */
 void* objmap_pop(ObjectMap *om, objmap_key_t handle);
 
+/*!
+ * \brief Remove an object from the map and deallocate it
+ * \param[in] om Reference to map
+ * \param[in] handle Object handle
+ *
+ * Equivalent to objmap_pop() followed by a call to the deallocator (or
+ * \c free()), except that with asynchronous reclamation enabled (see
+ * objmap_set_async_reclaim()) the deallocation happens on the background
+ * thread. For ::OBJMAP_ENGINE_INLINE maps, the deallocator is called
+ * immediately as a finalizer. Invalid handles are ignored.
+ */
+void objmap_release(ObjectMap *om, objmap_key_t handle);
+
+/*!
+ * \brief Releases memory no longer needed by the map
+ * \param[in] om Reference to map
+ *
+ * For ::OBJMAP_ENGINE_HASH, ::OBJMAP_ENGINE_SWISS and ::OBJMAP_ENGINE_FLAT,
+ * the hashtable is rehashed to the smallest size suitable for the objects
+ * currently stored, which also clears entries left behind by deleted
+ * objects. For ::OBJMAP_ENGINE_SLOT, pages that no longer hold any objects
+ * are released.
+ *
+ * Maps using ::OBJMAP_ENGINE_GENERATIONAL are not affected since each slot
+ * holds the generation needed to detect stale handles. Maps using
+ * ::OBJMAP_ENGINE_READ_MOSTLY are not affected since concurrent readers may
+ * still be accessing any page.
+ *
+ * Stored objects and their handles are not affected.
+ */
+void objmap_compact(ObjectMap *om);
+
+/*!
+ * \brief Retrieve statistics about the internal state of a map
+ * \param[in] om Reference to map
+ * \param[out] stats Receives the statistics
+ *
+ * For ::OBJMAP_ENGINE_HASH, popping an object leaves a tombstone in its
+ * bucket which lookups must step over until the table is rehashed. Heavy
+ * churn therefore lengthens probe sequences and slows objmap_get() even if
+ * the number of live objects stays the same. A growing \c tombstones count
+ * or a histogram shifting towards longer probes indicates that
+ * objmap_compact() is due. ::OBJMAP_ENGINE_SWISS and ::OBJMAP_ENGINE_FLAT
+ * also leave tombstones, though fewer. ::OBJMAP_ENGINE_SWISS counts probe
+ * lengths in groups of 16 buckets.
+ *
+ * Probe lengths are measured by replaying the probe sequence of up to 1024
+ * stored handles chosen at random, and of as many handles not yet issued,
+ * so this costs far less than a full scan of the table. The sum of a
+ * histogram is the number of lookups sampled.
+ *
+ * \c memory counts the storage of the map but not the objects it refers to
+ * (including those allocated with objmap_alloc()), except for
+ * ::OBJMAP_ENGINE_INLINE where objects are part of the storage. Engines other
+ * than the hashtables index slots directly, so they have no tombstones and
+ * no probes are sampled.
+ * For ::OBJMAP_ENGINE_SHARDED, the statistics of all shards are added up,
+ * one shard being locked at a time.
+ */
+void objmap_stats(ObjectMap *om, objmap_stats_t *stats);
+
 /*!
  * \brief Deletes the map and all objects stored within it
  * \param[in] om_ptr Variable address storing pointer to the map
@@ -171,4 +768,8 @@ void* objmap_pop(ObjectMap *om, objmap_key_t handle);
 void objmap_delete(ObjectMap **om_ptr);
 
 /*! @} */
+
+#ifdef __cplusplus
+}
+#endif
 #endif  /* OBJMAP_H_ */
@@ -0,0 +1,260 @@
+/*!
+ * \file objmap.hpp
+ * \brief Typed C++ interface to the object mapper
+ *
+ * Header-only wrapper around objmap.h (C++11 or later). The objmap sources
+ * must still be compiled and linked into the project.
+ */
+#ifndef OBJMAP_HPP_
+#define OBJMAP_HPP_
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "objmap.h"
+
+/*! \defgroup OBJMAP_CXX Utility: Typed Object Mapper (C++)
+ *
+ * objmap::map<T, Deleter> owns objects of type \c T and hands out
+ * objmap::handle<T> values in their place, so objects are retrieved without
+ * casting and handles to different types cannot be mixed up.
+ *
+ * Objects are destroyed with \c Deleter, which is called directly by the
+ * wrapper rather than through the deallocator pointer of the underlying
+ * map, so the call can be inlined. The underlying map is given
+ * objmap_no_dealloc() as its deallocator and so never visits objects when
+ * flushed. objmap_get() itself is a call into the C library; building with
+ * link-time optimisation allows it to be inlined too.
+ *
+ * \code
+ * objmap::map<Session> sessions;
+ * objmap::handle<Session> h = sessions.emplace(user, 42);
+ * if (Session *s = sessions.get(h)) s->touch();
+ * sessions.erase(h);
+ * \endcode
+ *
+ * @{*/
+namespace objmap {
+
+/*! \brief Handle of an object of type \c T stored in an objmap::map */
+template <class T>
+class handle {
+ public:
+  /*! \brief Null handle */
+  constexpr handle() noexcept : key_(OBJMAP_NULL) {}
+
+  /*! \brief Handle with a given key, e.g. one stored as an integer */
+  constexpr explicit handle(objmap_key_t key) noexcept : key_(key) {}
+
+  /*! \brief Underlying key, or error code if the handle was returned by a
+   * failed push */
+  constexpr objmap_key_t key() const noexcept { return key_; }
+
+  /*! \brief Whether the handle may refer to an object, i.e. is neither null
+   * nor an error code */
+  constexpr explicit operator bool() const noexcept {
+    return key_ != OBJMAP_NULL && key_ <= OBJMAP_MAX_INDEX;
+  }
+
+  friend constexpr bool operator==(handle a, handle b) noexcept {
+    return a.key_ == b.key_;
+  }
+  friend constexpr bool operator!=(handle a, handle b) noexcept {
+    return a.key_ != b.key_;
+  }
+
+ private:
+  objmap_key_t key_;
+};
+
+/*!
+ * \brief Map owning objects of type \c T, destroyed with \c Deleter
+ *
+ * The map is move-only. All objects it still holds are destroyed with it.
+ * Objects are stored by pointer, so ::OBJMAP_ENGINE_INLINE cannot be used.
+ *
+ * The thread-safety of each member function is that of the C routine it
+ * calls (see objmap_new_concurrent()), except that clear(), reset() and
+ * for_each() must not be called while other threads use the map.
+ */
+template <class T, class Deleter = std::default_delete<T> >
+class map {
+ public:
+  typedef T value_type;
+  typedef Deleter deleter_type;
+  typedef objmap::handle<T> handle_type;
+  typedef std::unique_ptr<T, Deleter> pointer;
+
+  /*!
+   * \brief Create an empty map
+   * \param[in] engine Storage engine to use. See ::objmap_engine_t
+   * \param[in] deleter Deleter used to destroy objects
+   *
+   * Throws \c std::invalid_argument for ::OBJMAP_ENGINE_INLINE and
+   * \c std::bad_alloc if the map cannot be created.
+   */
+  explicit map(objmap_engine_t engine = OBJMAP_ENGINE_HASH,
+               const Deleter &deleter = Deleter())
+      : om_(nullptr), deleter_(deleter) {
+    if (engine == OBJMAP_ENGINE_INLINE) {
+      throw std::invalid_argument("objmap::map cannot use inline storage");
+    }
+    init(objmap_new_engine(engine));
+  }
+
+  /*!
+   * \brief Create an empty thread-safe map. See objmap_new_concurrent()
+   * \param[in] nshards Number of independently locked shards, or \c 0
+   * \param[in] deleter Deleter used to destroy objects
+   */
+  static map concurrent(unsigned int nshards,
+                        const Deleter &deleter = Deleter()) {
+    return map(objmap_new_concurrent(nshards), deleter);
+  }
+
+  map(const map&) = delete;
+  map& operator=(const map&) = delete;
+
+  /*! \brief Take over the objects of another map, which is left unusable */
+  map(map &&other) noexcept
+      : om_(other.om_), deleter_(std::move(other.deleter_)) {
+    other.om_ = nullptr;
+  }
+
+  map& operator=(map &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      om_ = other.om_;
+      deleter_ = std::move(other.deleter_);
+      other.om_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~map() { destroy(); }
+
+  /*!
+   * \brief Add an object to the map, taking ownership of it
+   * \param[in,out] obj Object to add. Released if successful
+   * \return Handle of the object. On error, converts to \c false, holds the
+   *         error code returned by objmap_push() and \c obj keeps ownership
+   */
+  handle_type push(pointer &&obj) {
+    objmap_key_t key = objmap_push(om_, obj.get());
+    if (key <= OBJMAP_MAX_INDEX) obj.release();
+    return handle_type(key);
+  }
+
+  /*!
+   * \brief Construct an object with \c new and add it to the map
+   * \return Handle of the object, as for push()
+   *
+   * Only available with the default deleter, which matches \c new.
+   */
+  template <class... Args>
+  handle_type emplace(Args&&... args) {
+    static_assert(std::is_same<Deleter, std::default_delete<T> >::value,
+                  "emplace() requires std::default_delete");
+    pointer obj(new T(std::forward<Args>(args)...));
+    return push(std::move(obj));
+  }
+
+  /*! \brief Object with a given handle, or \c nullptr if not found */
+  T* get(handle_type h) const noexcept {
+    return static_cast<T*>(objmap_get(om_, h.key()));
+  }
+
+  /*! \brief Remove an object from the map, handing back ownership. Empty if
+   * the handle is invalid */
+  pointer pop(handle_type h) noexcept {
+    return pointer(static_cast<T*>(objmap_pop(om_, h.key())), deleter_);
+  }
+
+  /*! \brief Remove and destroy an object. Invalid handles are ignored */
+  void erase(handle_type h) noexcept {
+    T *obj = static_cast<T*>(objmap_pop(om_, h.key()));
+    if (obj != nullptr) deleter_(obj);
+  }
+
+  /*!
+   * \brief Call \c fn(handle, object) for every object in the map
+   *
+   * \c fn is called directly, so it can be inlined. The restrictions of
+   * objmap_iter_next() apply.
+   */
+  template <class Fn>
+  void for_each(Fn fn) {
+    objmap_iter_t it;
+    objmap_key_t key;
+    void *obj;
+
+    objmap_iter_init(&it, om_);
+    while (objmap_iter_next(&it, &key, &obj)) {
+      fn(handle_type(key), *static_cast<T*>(obj));
+    }
+  }
+
+  /*! \brief Destroy all objects. See objmap_flush() */
+  void clear() noexcept {
+    destroy_objects();
+    objmap_flush(om_);
+  }
+
+  /*! \brief Destroy all objects and reset the handle counter. See
+   * objmap_reset() */
+  void reset() noexcept {
+    destroy_objects();
+    objmap_reset(om_);
+  }
+
+  /*! \brief Make room for \c n more objects. See objmap_reserve() */
+  bool reserve(size_t n) noexcept { return objmap_reserve(om_, n) == 0; }
+
+  /*! \brief Release memory no longer needed. See objmap_compact() */
+  void compact() noexcept { objmap_compact(om_); }
+
+  /*! \brief Statistics of the underlying map. See objmap_stats() */
+  objmap_stats_t stats() const noexcept {
+    objmap_stats_t s;
+    objmap_stats(om_, &s);
+    return s;
+  }
+
+  /*! \brief Underlying map, e.g. to tune it with the C interface. Its
+   * deallocator must not be changed */
+  ObjectMap* native() const noexcept { return om_; }
+
+  Deleter& get_deleter() noexcept { return deleter_; }
+  const Deleter& get_deleter() const noexcept { return deleter_; }
+
+ private:
+  map(ObjectMap *om, const Deleter &deleter)
+      : om_(nullptr), deleter_(deleter) {
+    init(om);
+  }
+
+  void init(ObjectMap *om) {
+    if (om == nullptr) throw std::bad_alloc();
+    objmap_set_deallocator(om, objmap_no_dealloc);
+    om_ = om;
+  }
+
+  void destroy_objects() noexcept {
+    for_each([this](handle_type, T &obj) { deleter_(&obj); });
+  }
+
+  void destroy() noexcept {
+    if (om_ == nullptr) return;
+    destroy_objects();
+    objmap_delete(&om_);
+  }
+
+  ObjectMap *om_;
+  Deleter deleter_;
+};
+
+}  // namespace objmap
+
+/*! @} */
+#endif  /* OBJMAP_HPP_ */
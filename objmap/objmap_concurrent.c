@@ -0,0 +1,1020 @@
+/*!
+ * \file objmap_concurrent.c
+ * \brief Thread-safe storage engines
+ *
+ * The sharded engine partitions handles across independently locked shards.
+ * Handles are still assigned incrementally from om->top; the low bits of a
+ * handle select its shard and the remaining bits are used as the key within
+ * that shard. Consecutive handles therefore land in different shards, so
+ * threads pushing or looking up objects rarely contend for the same lock.
+ *
+ * To keep om->top from becoming a contention point, each thread claims keys in
+ * blocks with a single atomic operation and hands them out locally. The
+ * blocks are cached in thread-local storage, tagged with the map and with a
+ * serial number that is unique to the map and changes whenever the map is
+ * reset, so the entry of a reset map is refilled in place. Deleting a map
+ * frees the entry of the deleting thread. A block with keys left is
+ * otherwise only evicted once it has gone unused for a long while, so a
+ * thread alternating between more maps than it can cache claims single keys
+ * for some of them rather than abandoning blocks over and over.
+ *
+ * Each shard is a regular map using the hashtable engine, so all of its
+ * behaviour (flushing, shrinking, compaction) carries over unchanged.
+ *
+ * The read-mostly engine lets readers look up objects without taking a lock
+ * or writing to shared memory, at the expense of serialising writers.
+ *
+ * objmap_parallel_foreach() is also implemented here since it needs threads,
+ * though it works with maps using any engine.
+ *
+ * \note Atomic operations use the GCC/Clang __atomic builtins, and thread-local
+ *       storage the __thread extension.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "objmap_internal.h"
+
+/* size of a cache line; shards are padded to avoid false sharing */
+#define OM_CACHE_LINE 64
+
+/* number of shards used when none is specified, and the upper limit */
+#define OM_SHARDS_DEFAULT 16
+#define OM_SHARDS_MAX 1024
+
+/* number of keys claimed by a thread at a time */
+#define OM_KEY_BLOCK 128
+
+/* number of maps a thread can hold key blocks for */
+#define OM_KEY_BLOCK_CACHE 4
+
+/* number of pushes by a thread after which a block it has not used may be
+ * evicted, abandoning its remaining keys */
+#define OM_KEY_BLOCK_IDLE 65536
+
+/* block of keys claimed by a thread */
+typedef struct {
+  const om_sharded_t *map; /* map the keys were claimed from, or NULL */
+  unsigned long serial;    /* serial of the map when the keys were claimed */
+  unsigned long used;      /* value of key_block_clock when last used */
+  objmap_key_t next;       /* next key to hand out */
+  objmap_key_t end;        /* one past the last key claimed */
+} om_key_block_t;
+
+static __thread om_key_block_t key_blocks[OM_KEY_BLOCK_CACHE];
+
+/* number of keys handed out to the thread, across all maps */
+static __thread unsigned long key_block_clock;
+
+/* source of map serial numbers. 0 is never issued */
+static unsigned long key_block_serial = 0;
+
+typedef struct {
+  pthread_mutex_t lock; /* protects map */
+  ObjectMap *map;       /* hashtable keyed by (handle >> bits) */
+  char pad[OM_CACHE_LINE -
+           (sizeof(pthread_mutex_t) + sizeof(ObjectMap*)) % OM_CACHE_LINE];
+} om_shard_t;
+
+struct om_sharded_s {
+  om_shard_t *shards;   /* array of (1 << bits) shards */
+  unsigned int bits;    /* number of low handle bits used to select shard */
+  objmap_key_t mask;    /* (1 << bits) - 1 */
+  unsigned long serial; /* identifies key blocks claimed from this map */
+};
+
+/* shard holding a given handle */
+#define SHARD(s, handle) (&(s)->shards[(handle) & (s)->mask])
+
+om_sharded_t* om_sharded_new(unsigned int nshards) {
+  om_sharded_t *s;
+  unsigned int i, n;
+
+  if (nshards == 0) nshards = OM_SHARDS_DEFAULT;
+  if (nshards > OM_SHARDS_MAX) nshards = OM_SHARDS_MAX;
+
+  s = (om_sharded_t*)calloc(1, sizeof(om_sharded_t));
+  if (s == NULL) return NULL;
+  s->serial = __atomic_add_fetch(&key_block_serial, 1, __ATOMIC_RELAXED);
+
+  /* round up to power of 2 */
+  while (((unsigned int)1 << s->bits) < nshards) ++s->bits;
+  n = (unsigned int)1 << s->bits;
+  s->mask = (objmap_key_t)n - 1;
+
+  s->shards = (om_shard_t*)calloc(n, sizeof(om_shard_t));
+  if (s->shards == NULL) {
+    free(s);
+    return NULL;
+  }
+  for (i = 0; i < n; ++i) {
+    s->shards[i].map = objmap_new_engine(OBJMAP_ENGINE_HASH);
+    if (s->shards[i].map == NULL ||
+        pthread_mutex_init(&s->shards[i].lock, NULL) != 0) {
+      objmap_delete(&s->shards[i].map);
+      break;
+    }
+  }
+  if (i < n) { /* clean up shards created so far */
+    while (i-- > 0) {
+      pthread_mutex_destroy(&s->shards[i].lock);
+      objmap_delete(&s->shards[i].map);
+    }
+    free(s->shards);
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void om_sharded_destroy(om_sharded_t *s) {
+  om_key_block_t *b;
+  objmap_key_t i;
+  if (s == NULL) return;
+  /* other threads' entries are refilled in place if a new map takes the
+   * same address, since its serial differs, or evicted once idle */
+  for (b = key_blocks; b < key_blocks + OM_KEY_BLOCK_CACHE; ++b) {
+    if (b->map == s) memset(b, 0, sizeof(*b));
+  }
+  for (i = 0; i <= s->mask; ++i) {
+    pthread_mutex_destroy(&s->shards[i].lock);
+    objmap_delete(&s->shards[i].map);
+  }
+  free(s->shards);
+  free(s);
+}
+
+void om_sharded_configure(ObjectMap *om) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t i;
+
+  for (i = 0; i <= s->mask; ++i) {
+    om_shard_t *shard = &s->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    objmap_set_deallocator(shard->map, om->deallocator);
+    objmap_set_shrink_threshold(shard->map, om->shrink_load);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void om_sharded_reset(ObjectMap *om) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+
+  /* invalidate key blocks held by threads before rewinding */
+  s->serial = __atomic_add_fetch(&key_block_serial, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&om->top, 1, __ATOMIC_RELAXED);
+  om_sharded_flush(om);
+}
+
+/* cache entry for a map with no entry yet: an entry with no keys left
+ * (including free entries), else the least recently used entry if it has
+ * been idle long enough. NULL if every entry holds keys that are still in
+ * use */
+static om_key_block_t* key_block_victim(void) {
+  om_key_block_t *b, *lru = &key_blocks[0];
+
+  for (b = key_blocks; b < key_blocks + OM_KEY_BLOCK_CACHE; ++b) {
+    if (b->next >= b->end) return b;
+    if (b->used < lru->used) lru = b;
+  }
+  return (key_block_clock - lru->used >= OM_KEY_BLOCK_IDLE) ? lru : NULL;
+}
+
+/* hand out the next key from the calling thread's block, claiming a new
+ * block from om->top if needed. If no cache entry can be spared, a single
+ * key is claimed instead. Returns OBJMAP_ERR_OVERFLOW if we've run out of
+ * keys */
+static objmap_key_t sharded_next_key(ObjectMap *om) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  om_key_block_t *b;
+  objmap_key_t start, end, n;
+
+  ++key_block_clock;
+  for (b = key_blocks; b < key_blocks + OM_KEY_BLOCK_CACHE; ++b) {
+    if (b->map != s) continue;
+    b->used = key_block_clock;
+    if (b->serial == s->serial && b->next < b->end) return b->next++;
+    break; /* refill this map's entry: exhausted, or the map was reset */
+  }
+  if (b == key_blocks + OM_KEY_BLOCK_CACHE) b = key_block_victim();
+  n = (b != NULL) ? OM_KEY_BLOCK : 1;
+
+  /* claim keys, never going beyond OBJMAP_MAX_INDEX */
+  start = __atomic_load_n(&om->top, __ATOMIC_RELAXED);
+  do {
+    if (start > OBJMAP_MAX_INDEX) return OBJMAP_ERR_OVERFLOW;
+    end = (OBJMAP_MAX_INDEX - start < n) ? OBJMAP_MAX_INDEX + 1 : start + n;
+  } while (!__atomic_compare_exchange_n(&om->top, &start, end, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (b != NULL) {
+    b->map = s;
+    b->serial = s->serial;
+    b->used = key_block_clock;
+    b->next = start + 1;
+    b->end = end;
+  }
+  return start;
+}
+
+objmap_key_t om_sharded_push(ObjectMap *om, void *obj) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  om_shard_t *shard;
+  objmap_key_t key, rc;
+
+  key = sharded_next_key(om);
+  if (key == OBJMAP_ERR_OVERFLOW) return key;
+
+  shard = SHARD(s, key);
+  pthread_mutex_lock(&shard->lock);
+  rc = om_hash_put(shard->map, key >> s->bits, obj);
+  pthread_mutex_unlock(&shard->lock);
+
+  return (rc > OBJMAP_MAX_INDEX) ? rc : key;
+}
+
+/* remove objects pushed by om_sharded_push_n() into the first nshards shards */
+static void sharded_undo_push_n(ObjectMap *om, objmap_key_t first, size_t n,
+                                objmap_key_t nshards) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t j;
+  size_t i;
+
+  for (j = 0; j < nshards; ++j) {
+    om_shard_t *shard = SHARD(s, first + j);
+    pthread_mutex_lock(&shard->lock);
+    for (i = j; i < n; i += s->mask + 1) {
+      objmap_pop(shard->map, (first + (objmap_key_t)i) >> s->bits);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+objmap_key_t om_sharded_push_n(ObjectMap *om, void **objs, size_t n,
+                               objmap_key_t *out_handles) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t first, j;
+  size_t i;
+
+  /* claim a contiguous range of keys for all objects */
+  first = __atomic_load_n(&om->top, __ATOMIC_RELAXED);
+  do {
+    if (first > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - first < n - 1) {
+      return OBJMAP_ERR_OVERFLOW;
+    }
+  } while (!__atomic_compare_exchange_n(&om->top, &first,
+                                        first + (objmap_key_t)n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  /* insert into each shard in turn, taking each lock only once. Objects i,
+   * i + nshards, i + 2 * nshards, ... belong to the same shard */
+  for (j = 0; j <= s->mask && j < n; ++j) {
+    om_shard_t *shard = SHARD(s, first + j);
+    size_t count = (n - j - 1) / (s->mask + 1) + 1;
+
+    pthread_mutex_lock(&shard->lock);
+    if (om_hash_reserve(shard->map, count)) {
+      pthread_mutex_unlock(&shard->lock);
+      sharded_undo_push_n(om, first, n, j);
+      return OBJMAP_ERR_INTERNAL;
+    }
+    for (i = j; i < n; i += s->mask + 1) {
+      /* cannot fail since room has been reserved */
+      om_hash_put(shard->map, (first + (objmap_key_t)i) >> s->bits, objs[i]);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  if (out_handles) {
+    for (i = 0; i < n; ++i) out_handles[i] = first + (objmap_key_t)i;
+  }
+  return first;
+}
+
+void* om_sharded_get(ObjectMap *om, objmap_key_t handle) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  om_shard_t *shard = SHARD(s, handle);
+  void *obj;
+
+  pthread_mutex_lock(&shard->lock);
+  obj = objmap_get(shard->map, handle >> s->bits);
+  pthread_mutex_unlock(&shard->lock);
+  return obj;
+}
+
+void* om_sharded_pop(ObjectMap *om, objmap_key_t handle) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  om_shard_t *shard = SHARD(s, handle);
+  void *obj;
+
+  pthread_mutex_lock(&shard->lock);
+  obj = objmap_pop(shard->map, handle >> s->bits);
+  pthread_mutex_unlock(&shard->lock);
+  return obj;
+}
+
+void om_sharded_flush(ObjectMap *om) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t i;
+
+  for (i = 0; i <= s->mask; ++i) {
+    pthread_mutex_lock(&s->shards[i].lock);
+    objmap_flush(s->shards[i].map);
+    pthread_mutex_unlock(&s->shards[i].lock);
+  }
+}
+
+/* objects in shard i are keyed by (handle >> bits) */
+int om_sharded_next(ObjectMap *om, size_t *shard, size_t *pos,
+                    objmap_key_t *handle, void **obj) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_iter_t it;
+  objmap_key_t key;
+  int found = 0;
+
+  for (; *shard <= s->mask; ++*shard, *pos = 0) {
+    om_shard_t *sh = &s->shards[*shard];
+    pthread_mutex_lock(&sh->lock);
+    objmap_iter_init(&it, sh->map);
+    it.pos = *pos;
+    found = objmap_iter_next(&it, &key, obj);
+    pthread_mutex_unlock(&sh->lock);
+    if (found) {
+      *handle = (key << s->bits) | (objmap_key_t)*shard;
+      *pos = it.pos;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  objmap_visit_func_t fn;  /* user function */
+  void *ctx;               /* user context */
+  unsigned int bits;       /* shard bits */
+  objmap_key_t shard;      /* shard being visited */
+} om_shard_visit_t;
+
+/* translate shard keys back into handles */
+static int sharded_visit(objmap_key_t key, void *obj, void *ctx) {
+  om_shard_visit_t *v = (om_shard_visit_t*)ctx;
+  return v->fn((key << v->bits) | v->shard, obj, v->ctx);
+}
+
+int om_sharded_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  om_shard_visit_t v;
+  int rc = 0;
+
+  v.fn = fn;
+  v.ctx = ctx;
+  v.bits = s->bits;
+  for (v.shard = 0; v.shard <= s->mask && rc == 0; ++v.shard) {
+    om_shard_t *shard = &s->shards[v.shard];
+    pthread_mutex_lock(&shard->lock);
+    rc = objmap_foreach(shard->map, sharded_visit, &v);
+    pthread_mutex_unlock(&shard->lock);
+  }
+  return rc;
+}
+
+/* consecutive keys are spread evenly over the shards, so each shard needs
+ * room for its share of n (rounded up) */
+int om_sharded_reserve(ObjectMap *om, size_t n) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  size_t share = (n >> s->bits) + 1;
+  objmap_key_t i;
+  int rc = 0;
+
+  if (n == 0) return 0;
+  for (i = 0; i <= s->mask && rc == 0; ++i) {
+    pthread_mutex_lock(&s->shards[i].lock);
+    rc = objmap_reserve(s->shards[i].map, share);
+    pthread_mutex_unlock(&s->shards[i].lock);
+  }
+  return rc;
+}
+
+void om_sharded_compact(ObjectMap *om) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t i;
+
+  for (i = 0; i <= s->mask; ++i) {
+    pthread_mutex_lock(&s->shards[i].lock);
+    objmap_compact(s->shards[i].map);
+    pthread_mutex_unlock(&s->shards[i].lock);
+  }
+}
+
+/* handles from om->top onwards are not in any shard */
+void om_sharded_stats(ObjectMap *om, objmap_stats_t *stats) {
+  om_sharded_t *s = (om_sharded_t*)om->map;
+  objmap_key_t i, absent;
+  objmap_stats_t shard;
+  size_t j;
+
+  absent = (__atomic_load_n(&om->top, __ATOMIC_RELAXED) >> s->bits) + 1;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_sharded_t) +
+                  (s->mask + 1) * sizeof(om_shard_t);
+  for (i = 0; i <= s->mask; ++i) {
+    memset(&shard, 0, sizeof(shard));
+    pthread_mutex_lock(&s->shards[i].lock);
+    om_hash_stats(s->shards[i].map, absent, &shard);
+    pthread_mutex_unlock(&s->shards[i].lock);
+
+    stats->live += shard.live;
+    stats->tombstones += shard.tombstones;
+    stats->buckets += shard.buckets;
+    stats->memory += shard.memory;
+    for (j = 0; j < OBJMAP_PROBE_HIST; ++j) {
+      stats->probe_hit[j] += shard.probe_hit[j];
+      stats->probe_miss[j] += shard.probe_miss[j];
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Read-mostly engine
+ *
+ * Objects are stored in pages indexed by handle, as in the slot engine.
+ * Writers serialise on a mutex while readers take no lock and write nothing:
+ * they load the published directory, then the page, then the entry.
+ *
+ * A directory is never modified in a way that invalidates a concurrent
+ * reader. New pages are added beyond the published page count before the
+ * count is incremented. When the directory is full, a larger copy is
+ * published and the old one is retired rather than freed, since readers may
+ * still be using it. Retired directories are freed with the map; as each
+ * one is half the size of its successor, they use less memory than the
+ * current directory. Pages are only freed with the map.
+ * ------------------------------------------------------------------------ */
+
+typedef struct om_rdir_s {
+  size_t npages;           /* pages visible to readers. Accessed atomically */
+  size_t capacity;         /* number of page pointers available */
+  struct om_rdir_s *prev;  /* older directory retired by this one */
+  void **pages[];          /* page pointers (allocated to capacity) */
+} om_rdir_t;
+
+struct om_readmostly_s {
+  om_rdir_t *dir;          /* published directory. Accessed atomically */
+  size_t size;             /* number of objects stored */
+  pthread_mutex_t lock;    /* serialises writers */
+};
+
+#define OM_RDIR_INIT_CAPACITY 16
+
+static om_rdir_t* rdir_new(size_t capacity) {
+  return (om_rdir_t*)calloc(1, sizeof(om_rdir_t) + capacity * sizeof(void**));
+}
+
+om_readmostly_t* om_rm_new(void) {
+  om_readmostly_t *r = (om_readmostly_t*)calloc(1, sizeof(om_readmostly_t));
+  if (r == NULL) return NULL;
+
+  r->dir = rdir_new(OM_RDIR_INIT_CAPACITY);
+  if (r->dir == NULL || pthread_mutex_init(&r->lock, NULL) != 0) {
+    free(r->dir);
+    free(r);
+    return NULL;
+  }
+  r->dir->capacity = OM_RDIR_INIT_CAPACITY;
+  return r;
+}
+
+void om_rm_destroy(om_readmostly_t *r) {
+  om_rdir_t *d, *prev;
+  size_t p;
+
+  if (r == NULL) return;
+  for (p = 0; p < r->dir->npages; ++p) free(r->dir->pages[p]);
+  for (d = r->dir; d != NULL; d = prev) {
+    prev = d->prev;
+    free(d);
+  }
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
+
+/* publish a copy of the directory with room for capacity pages, retiring
+ * the current one. Caller must hold the writer lock. Returns 0 on success */
+static int rm_grow_dir(om_readmostly_t *r, size_t capacity) {
+  om_rdir_t *d = r->dir, *bigger = rdir_new(capacity);
+
+  if (bigger == NULL) return 1;
+  bigger->capacity = capacity;
+  bigger->npages = d->npages;
+  memcpy(bigger->pages, d->pages, d->npages * sizeof(void**));
+  bigger->prev = d; /* retire old directory */
+  __atomic_store_n(&r->dir, bigger, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* add a page, publishing a larger directory if needed. Caller must hold
+ * the writer lock. Returns 0 on success */
+static int rm_add_page(om_readmostly_t *r) {
+  om_rdir_t *d;
+  void **page;
+
+  if (r->dir->npages == r->dir->capacity &&
+      rm_grow_dir(r, r->dir->capacity * 2)) {
+    return 1;
+  }
+  d = r->dir;
+
+  page = (void**)calloc(OM_PAGE_SIZE, sizeof(void*));
+  if (page == NULL) return 1;
+  d->pages[d->npages] = page;
+  __atomic_store_n(&d->npages, d->npages + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* add pages until page p exists. Caller must hold the writer lock.
+ * Returns 0 on success */
+static int rm_add_pages(om_readmostly_t *r, size_t p) {
+  while (p >= r->dir->npages) {
+    if (rm_add_page(r)) return 1;
+  }
+  return 0;
+}
+
+objmap_key_t om_rm_push(ObjectMap *om, void *obj) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  objmap_key_t key;
+  void **slot;
+
+  pthread_mutex_lock(&r->lock);
+  key = om->top;
+  if (key > OBJMAP_MAX_INDEX) {
+    key = OBJMAP_ERR_OVERFLOW;
+  } else if (rm_add_pages(r, key >> OM_PAGE_BITS)) {
+    key = OBJMAP_ERR_INTERNAL;
+  } else {
+    slot = &r->dir->pages[key >> OM_PAGE_BITS][key & OM_PAGE_MASK];
+    __atomic_store_n(slot, obj, __ATOMIC_RELEASE);
+    ++r->size;
+    ++om->top;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return key;
+}
+
+objmap_key_t om_rm_push_n(ObjectMap *om, void **objs, size_t n,
+                          objmap_key_t *out_handles) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  objmap_key_t key, first, last;
+  size_t i;
+
+  pthread_mutex_lock(&r->lock);
+  first = om->top;
+  last = first + (objmap_key_t)(n - 1);
+  if (first > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - first < n - 1) {
+    first = OBJMAP_ERR_OVERFLOW;
+  } else if (rm_add_pages(r, last >> OM_PAGE_BITS)) {
+    first = OBJMAP_ERR_INTERNAL;
+  } else { /* all pages are ready */
+    for (i = 0, key = first; i < n; ++i, ++key) {
+      void **page = r->dir->pages[key >> OM_PAGE_BITS];
+      __atomic_store_n(&page[key & OM_PAGE_MASK], objs[i], __ATOMIC_RELEASE);
+      if (out_handles) out_handles[i] = key;
+    }
+    r->size += n;
+    om->top = last + 1;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return first;
+}
+
+size_t om_rm_extent(const ObjectMap *om) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  om_rdir_t *d = __atomic_load_n(&r->dir, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&d->npages, __ATOMIC_ACQUIRE) << OM_PAGE_BITS;
+}
+
+/* lock-free, like om_rm_get() */
+int om_rm_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+               void **obj) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  om_rdir_t *d = __atomic_load_n(&r->dir, __ATOMIC_ACQUIRE);
+  size_t i, npages = __atomic_load_n(&d->npages, __ATOMIC_ACQUIRE);
+
+  for (i = *pos; i < end && (i >> OM_PAGE_BITS) < npages; ++i) {
+    void **page = d->pages[i >> OM_PAGE_BITS];
+    void *o = __atomic_load_n(&page[i & OM_PAGE_MASK], __ATOMIC_ACQUIRE);
+    if (o == NULL) continue;
+    *handle = (objmap_key_t)i;
+    *obj = o;
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+int om_rm_reserve(ObjectMap *om, size_t n) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  objmap_key_t last;
+  size_t npages;
+  int rc = 0;
+
+  if (n == 0) return 0;
+  pthread_mutex_lock(&r->lock);
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    rc = 1; /* not enough keys left */
+  } else {
+    last = om->top + (objmap_key_t)(n - 1);
+    npages = (size_t)(last >> OM_PAGE_BITS) + 1;
+    /* size the directory in one step so only one copy is retired */
+    if (npages > r->dir->capacity) rc = rm_grow_dir(r, npages);
+    if (rc == 0) rc = rm_add_pages(r, npages - 1);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return rc;
+}
+
+void* om_rm_get(ObjectMap *om, objmap_key_t handle) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  om_rdir_t *d = __atomic_load_n(&r->dir, __ATOMIC_ACQUIRE);
+  objmap_key_t p = handle >> OM_PAGE_BITS;
+
+  void **page;
+
+  if (p >= __atomic_load_n(&d->npages, __ATOMIC_ACQUIRE)) return NULL;
+  page = d->pages[p];
+  return __atomic_load_n(&page[handle & OM_PAGE_MASK], __ATOMIC_ACQUIRE);
+}
+
+size_t om_rm_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                   void **out_ptrs) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  om_rdir_t *d = __atomic_load_n(&r->dir, __ATOMIC_ACQUIRE);
+  size_t i, j, batch, found = 0;
+  size_t npages = __atomic_load_n(&d->npages, __ATOMIC_ACQUIRE);
+  void **slots[OM_GET_BATCH];
+
+  /* as for om_slot_get_n(), prefetch entries for a batch before reading */
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch; ++j) {
+      objmap_key_t h = handles[i + j];
+      if ((h >> OM_PAGE_BITS) >= npages) {
+        slots[j] = NULL;
+      } else {
+        slots[j] = &d->pages[h >> OM_PAGE_BITS][h & OM_PAGE_MASK];
+        OM_PREFETCH(slots[j]);
+      }
+    }
+    for (j = 0; j < batch; ++j) {
+      out_ptrs[i + j] = (slots[j]) ? __atomic_load_n(slots[j], __ATOMIC_ACQUIRE)
+                                   : NULL;
+      if (out_ptrs[i + j] != NULL) ++found;
+    }
+  }
+  return found;
+}
+
+void* om_rm_pop(ObjectMap *om, objmap_key_t handle) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  void *obj = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  if ((handle >> OM_PAGE_BITS) < r->dir->npages) {
+    void **page = r->dir->pages[handle >> OM_PAGE_BITS];
+    void **slot = &page[handle & OM_PAGE_MASK];
+    obj = *slot;
+    if (obj != NULL) {
+      __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+      --r->size;
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+  return obj;
+}
+
+/* retired directories are counted as they are only freed with the map */
+void om_rm_stats(ObjectMap *om, objmap_stats_t *stats) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  const om_rdir_t *d;
+
+  pthread_mutex_lock(&r->lock);
+  stats->live = r->size;
+  stats->buckets = r->dir->npages * OM_PAGE_SIZE;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_readmostly_t) +
+                  stats->buckets * sizeof(void*);
+  for (d = r->dir; d != NULL; d = d->prev) {
+    stats->memory += sizeof(om_rdir_t) + d->capacity * sizeof(void**);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+void om_rm_flush(ObjectMap *om) {
+  om_readmostly_t *r = (om_readmostly_t*)om->map;
+  size_t p;
+  objmap_key_t i;
+
+  pthread_mutex_lock(&r->lock);
+  for (p = 0; p < r->dir->npages && r->size > 0; ++p) {
+    void **page = r->dir->pages[p];
+    for (i = 0; i < OM_PAGE_SIZE; ++i) {
+      void *obj = page[i];
+      if (obj == NULL) continue;
+      __atomic_store_n(&page[i], NULL, __ATOMIC_RELEASE);
+      OM_DEALLOC(om, obj);
+      --r->size;
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* ------------------------------------------------------------------------
+ * Parallel iteration
+ *
+ * The range of positions iterated over (buckets, slots, or shards for the
+ * sharded engine) is cut into fixed-size chunks which workers claim one at a
+ * time from a shared counter. Workers that finish a sparse chunk quickly
+ * simply claim more, so the load balances itself however unevenly objects
+ * are spread. The calling thread works alongside the threads it starts.
+ * ------------------------------------------------------------------------ */
+
+/* positions per chunk. A multiple of both the page size and the 16 buckets
+ * covered by a hashtable flag word */
+#define OM_PAR_CHUNK ((size_t)4 * OM_PAGE_SIZE)
+
+/* upper limit on threads used */
+#define OM_PAR_THREADS_MAX 256
+
+typedef struct om_par_s {
+  ObjectMap *om;
+  objmap_visit_func_t fn;
+  void *ctx;
+  om_next_func_t next;  /* engine iteration function (NULL if sharded) */
+  int (*task)(struct om_par_s *par, size_t c); /* process chunk c */
+  size_t nchunks;       /* number of chunks */
+  size_t chunk;         /* next chunk to claim. Accessed atomically */
+  int rc;               /* first non-zero task result. Accessed atomically */
+} om_par_t;
+
+/* visit the objects in one shard */
+static int par_shard(om_par_t *par, size_t i) {
+  om_sharded_t *s = (om_sharded_t*)par->om->map;
+  om_shard_visit_t v;
+  int rc;
+
+  v.fn = par->fn;
+  v.ctx = par->ctx;
+  v.bits = s->bits;
+  v.shard = (objmap_key_t)i;
+  pthread_mutex_lock(&s->shards[i].lock);
+  rc = objmap_foreach(s->shards[i].map, sharded_visit, &v);
+  pthread_mutex_unlock(&s->shards[i].lock);
+  return rc;
+}
+
+/* visit the objects in one chunk */
+static int par_chunk(om_par_t *par, size_t c) {
+  size_t pos = c * OM_PAR_CHUNK, end = pos + OM_PAR_CHUNK;
+  objmap_key_t handle;
+  void *obj;
+  int rc;
+
+  while (par->next(par->om, &pos, end, &handle, &obj)) {
+    rc = par->fn(handle, obj, par->ctx);
+    if (rc != 0) return rc;
+  }
+  return 0;
+}
+
+static void* par_worker(void *arg) {
+  om_par_t *par = (om_par_t*)arg;
+  size_t c;
+  int rc, none = 0;
+
+  while (__atomic_load_n(&par->rc, __ATOMIC_RELAXED) == 0) {
+    c = __atomic_fetch_add(&par->chunk, 1, __ATOMIC_RELAXED);
+    if (c >= par->nchunks) break;
+    rc = par->task(par, c);
+    if (rc != 0) { /* first one wins */
+      __atomic_compare_exchange_n(&par->rc, &none, rc, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+/* process all chunks using nthreads threads (0 for one per CPU) */
+static int par_run(om_par_t *par, unsigned int nthreads) {
+  pthread_t threads[OM_PAR_THREADS_MAX];
+  unsigned int i, started = 0;
+
+  par->chunk = 0;
+  par->rc = 0;
+  if (nthreads == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (ncpu > 0) ? (unsigned int)ncpu : 1;
+  }
+  if (nthreads > OM_PAR_THREADS_MAX) nthreads = OM_PAR_THREADS_MAX;
+  if (nthreads > par->nchunks) nthreads = (unsigned int)par->nchunks;
+
+  /* carry on with fewer threads if some cannot be started */
+  for (i = 1; i < nthreads; ++i) {
+    if (pthread_create(&threads[started], NULL, par_worker, par) == 0) {
+      ++started;
+    }
+  }
+  par_worker(par);
+  for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+  return par->rc;
+}
+
+int om_parallel_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx,
+                        unsigned int nthreads) {
+  om_par_t par;
+
+  par.om = om;
+  par.fn = fn;
+  par.ctx = ctx;
+  if (om->engine == OBJMAP_ENGINE_SHARDED) {
+    par.next = NULL;
+    par.task = par_shard;
+    par.nchunks = (size_t)((om_sharded_t*)om->map)->mask + 1;
+  } else {
+    par.next = om_engine_next(om);
+    par.task = par_chunk;
+    par.nchunks = (om_engine_extent(om) + OM_PAR_CHUNK - 1) / OM_PAR_CHUNK;
+  }
+  return par_run(&par, nthreads);
+}
+
+/* flush one shard */
+static int par_flush_shard(om_par_t *par, size_t i) {
+  om_sharded_t *s = (om_sharded_t*)par->om->map;
+
+  pthread_mutex_lock(&s->shards[i].lock);
+  objmap_flush(s->shards[i].map);
+  pthread_mutex_unlock(&s->shards[i].lock);
+  return 0;
+}
+
+/* shards are independent, so each is flushed by one thread as usual */
+void om_sharded_flush_parallel(ObjectMap *om, unsigned int nthreads) {
+  om_par_t par;
+
+  memset(&par, 0, sizeof(par));
+  par.om = om;
+  par.task = par_flush_shard;
+  par.nchunks = (size_t)((om_sharded_t*)om->map)->mask + 1;
+  par_run(&par, nthreads);
+}
+
+/* ------------------------------------------------------------------------
+ * Background reclamation
+ *
+ * Objects to deallocate and detached maps to delete are appended to a queue
+ * which the reclamation thread takes over as a whole, so the lock is held
+ * only briefly by either side.
+ * ------------------------------------------------------------------------ */
+
+typedef struct {
+  void *obj;                  /* object to deallocate, or NULL */
+  void (*dealloc)(void*);     /* deallocator for obj, or NULL for free() */
+  ObjectMap *detached;        /* map to delete, or NULL */
+} om_reclaim_item_t;
+
+struct om_reclaim_s {
+  pthread_t thread;
+  pthread_mutex_t lock;       /* protects all below */
+  pthread_cond_t wake;        /* signalled when work is queued or on stop */
+  pthread_cond_t idle;        /* signalled when the queue has been processed */
+  om_reclaim_item_t *items;   /* queued work */
+  size_t nitems;
+  size_t capacity;
+  int busy;                   /* thread is processing items */
+  int stop;                   /* thread should exit once queue is empty */
+};
+
+#define OM_RECLAIM_INIT_CAPACITY 64
+
+static void* reclaim_main(void *arg) {
+  om_reclaim_t *r = (om_reclaim_t*)arg;
+  om_reclaim_item_t *items;
+  size_t i, n;
+
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    while (r->nitems == 0 && !r->stop) pthread_cond_wait(&r->wake, &r->lock);
+    if (r->nitems == 0) break; /* stopped and drained */
+
+    /* take the whole queue */
+    items = r->items;
+    n = r->nitems;
+    r->items = NULL;
+    r->nitems = r->capacity = 0;
+    r->busy = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    for (i = 0; i < n; ++i) {
+      if (items[i].detached) objmap_delete(&items[i].detached);
+      else if (items[i].dealloc) items[i].dealloc(items[i].obj);
+      else free(items[i].obj);
+    }
+    free(items);
+
+    pthread_mutex_lock(&r->lock);
+    r->busy = 0;
+    pthread_cond_broadcast(&r->idle);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+om_reclaim_t* om_reclaim_start(void) {
+  om_reclaim_t *r = (om_reclaim_t*)calloc(1, sizeof(om_reclaim_t));
+  if (r == NULL) return NULL;
+
+  if (pthread_mutex_init(&r->lock, NULL) != 0) {
+    free(r);
+    return NULL;
+  }
+  if (pthread_cond_init(&r->wake, NULL) != 0) {
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+    return NULL;
+  }
+  if (pthread_cond_init(&r->idle, NULL) != 0) {
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+    return NULL;
+  }
+  if (pthread_create(&r->thread, NULL, reclaim_main, r) != 0) {
+    pthread_cond_destroy(&r->idle);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+void om_reclaim_stop(om_reclaim_t *r) {
+  if (r == NULL) return;
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->thread, NULL);
+
+  pthread_cond_destroy(&r->idle);
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+  free(r->items);
+  free(r);
+}
+
+void om_reclaim_wait(om_reclaim_t *r) {
+  pthread_mutex_lock(&r->lock);
+  while (r->nitems > 0 || r->busy) pthread_cond_wait(&r->idle, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static int reclaim_push(om_reclaim_t *r, const om_reclaim_item_t *item) {
+  int rc = 0;
+
+  pthread_mutex_lock(&r->lock);
+  if (r->nitems == r->capacity) {
+    size_t capacity = (r->capacity) ? r->capacity * 2
+                                    : OM_RECLAIM_INIT_CAPACITY;
+    om_reclaim_item_t *items = (om_reclaim_item_t*)realloc(
+        r->items, capacity * sizeof(om_reclaim_item_t));
+    if (items == NULL) {
+      rc = 1;
+    } else {
+      r->items = items;
+      r->capacity = capacity;
+    }
+  }
+  if (rc == 0) {
+    r->items[r->nitems++] = *item;
+    pthread_cond_signal(&r->wake);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return rc;
+}
+
+int om_reclaim_object(om_reclaim_t *r, void *obj, void (*dealloc)(void*)) {
+  om_reclaim_item_t item;
+  item.obj = obj;
+  item.dealloc = dealloc;
+  item.detached = NULL;
+  return reclaim_push(r, &item);
+}
+
+int om_reclaim_map(om_reclaim_t *r, ObjectMap *detached) {
+  om_reclaim_item_t item;
+  item.obj = NULL;
+  item.dealloc = NULL;
+  item.detached = detached;
+  return reclaim_push(r, &item);
+}
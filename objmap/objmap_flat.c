@@ -0,0 +1,320 @@
+/*!
+ * \file objmap_flat.c
+ * \brief Flat engine: open addressing over a single array of buckets
+ *
+ * khash keeps keys, values and bucket flags in three separate arrays, so a
+ * successful lookup in a large table typically takes three cache misses:
+ * one each for the flags, the key and the value. Here each bucket holds
+ * the key and the object pointer together, so a lookup whose home bucket
+ * holds the key takes a single miss.
+ *
+ * There are no flags at all. Keys that are never issued as handles mark
+ * the state of a bucket instead: ::OBJMAP_NULL an empty bucket and
+ * ::OBJMAP_ERR_INTERNAL a deleted one. Probing is then a plain comparison
+ * of keys until the key or an empty bucket is found, and a bucket is two
+ * words with either key width.
+ *
+ * Collisions are resolved by linear probing, so a probe continues into the
+ * same or the next cache line rather than jumping across the table as with
+ * khash's double hashing. Linear probing needs well-spread home buckets, so
+ * handles are hashed multiplicatively (Fibonacci hashing) instead of being
+ * used as their own hash.
+ *
+ * Deleted entries leave a tombstone, as with khash. A tombstone followed by
+ * an empty bucket ends no probe sequence that could still need it, so it is
+ * turned back into an empty bucket straight away, as are the tombstones
+ * before it.
+ */
+#include <assert.h>
+#include <string.h>
+#include "objmap_internal.h"
+
+/* keys marking empty and deleted buckets. Empty must be 0 so tables can be
+ * cleared with memset() */
+#define FLAT_EMPTY OBJMAP_NULL
+#define FLAT_DELETED OBJMAP_ERR_INTERNAL
+
+#define IS_EMPTY(b) ((b)->key == FLAT_EMPTY)
+#define IS_DELETED(b) ((b)->key == FLAT_DELETED)
+#define IS_LIVE(b) (!IS_EMPTY(b) && !IS_DELETED(b))
+#define SET_EMPTY(b) ((b)->key = FLAT_EMPTY)
+#define SET_DELETED(b) ((b)->key = FLAT_DELETED)
+#define SET_LIVE(b, k, o) ((b)->key = (k), (b)->obj = (o))
+
+/* number of live and deleted entries at which the table is rehashed (3/4
+ * of its buckets). Always leaves at least one empty bucket */
+#define MAX_USED(capacity) ((capacity) - (capacity) / 4)
+#define MIN_CAPACITY 16
+
+typedef struct {
+  objmap_key_t key;  /* handle, FLAT_EMPTY or FLAT_DELETED */
+  void *obj;
+} om_fbucket_t;
+
+struct om_flat_s {
+  om_fbucket_t *buckets;
+  size_t capacity;     /* number of buckets: 0 or a power of 2 */
+  size_t size;         /* live entries */
+  size_t used;         /* live and deleted entries */
+  unsigned int shift;  /* hash >> shift gives the home bucket */
+};
+
+/* Fibonacci hashing. The top bits of the product depend on all bits of the
+ * key, and consecutive keys are spread evenly over the table */
+#define FLAT_HOME(t, key) \
+  ((size_t)(((uint64_t)(key) * 0x9E3779B97F4A7C15ULL) >> (t)->shift))
+
+om_flat_t* om_flat_new(void) {
+  return (om_flat_t*)calloc(1, sizeof(om_flat_t));
+}
+
+void om_flat_destroy(om_flat_t *t) {
+  if (t == NULL) return;
+  free(t->buckets);
+  free(t);
+}
+
+/* bucket holding key, or t->capacity if not found. If probes is not NULL,
+ * it receives the number of buckets examined. Keys above OBJMAP_MAX_INDEX
+ * are rejected up front so that FLAT_DELETED never matches a tombstone */
+static inline size_t flat_find(const om_flat_t *t, objmap_key_t key,
+                               size_t *probes) {
+  size_t i, n = 1, mask = t->capacity - 1;
+
+  if (t->capacity == 0 || key > OBJMAP_MAX_INDEX) {
+    if (probes) *probes = 1;
+    return t->capacity;
+  }
+  for (i = FLAT_HOME(t, key); !IS_EMPTY(&t->buckets[i]);
+       i = (i + 1) & mask, ++n) {
+    if (t->buckets[i].key == key) {
+      if (probes) *probes = n;
+      return i;
+    }
+  }
+  if (probes) *probes = n;
+  return t->capacity;
+}
+
+/* store a key known not to be in the table, which must have room for it */
+static void flat_insert(om_flat_t *t, objmap_key_t key, void *obj) {
+  size_t i, mask = t->capacity - 1;
+  om_fbucket_t *b;
+
+  for (i = FLAT_HOME(t, key); IS_LIVE(&t->buckets[i]); i = (i + 1) & mask) {}
+  b = &t->buckets[i];
+  if (IS_EMPTY(b)) ++t->used;
+  SET_LIVE(b, key, obj);
+  ++t->size;
+}
+
+/* move all live entries into a table of the given capacity, dropping
+ * tombstones. Returns 0 on success */
+static int flat_rehash(om_flat_t *t, size_t capacity) {
+  om_flat_t old = *t;
+  size_t i;
+  unsigned int bits = 0;
+
+  while (((size_t)1 << bits) < capacity) ++bits;
+  if (capacity > ((size_t)-1 / 2) / sizeof(om_fbucket_t)) return 1;
+
+  t->buckets = (om_fbucket_t*)calloc(capacity, sizeof(om_fbucket_t));
+  if (t->buckets == NULL) {
+    *t = old;
+    return 1;
+  }
+  t->capacity = capacity;
+  t->size = t->used = 0;
+  t->shift = 64 - bits;
+
+  for (i = 0; i < old.capacity; ++i) {
+    if (IS_LIVE(&old.buckets[i])) {
+      flat_insert(t, old.buckets[i].key, old.buckets[i].obj);
+    }
+  }
+  free(old.buckets);
+  return 0;
+}
+
+/* smallest capacity holding n entries without rehashing */
+static size_t flat_capacity_for(size_t n) {
+  size_t capacity = MIN_CAPACITY;
+  while (MAX_USED(capacity) < n) capacity *= 2;
+  return capacity;
+}
+
+/* make room for one more entry. Returns 0 on success */
+static int flat_make_room(om_flat_t *t) {
+  if (t->used < MAX_USED(t->capacity)) return 0;
+  /* grow unless at least half the entries are tombstones */
+  if (t->capacity == 0) return flat_rehash(t, MIN_CAPACITY);
+  if (t->size >= MAX_USED(t->capacity) / 2) {
+    return flat_rehash(t, t->capacity * 2);
+  }
+  return flat_rehash(t, t->capacity);
+}
+
+int om_flat_reserve(ObjectMap *om, size_t n) {
+  om_flat_t *t = (om_flat_t*)om->map;
+
+  if (n == 0) return 0;
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    return 1; /* not enough keys left */
+  }
+  if (t->used + n <= MAX_USED(t->capacity)) return 0;
+  if (n > (size_t)-1 / 2 - t->size) return 1;
+  return flat_rehash(t, flat_capacity_for(t->size + n));
+}
+
+objmap_key_t om_flat_push(ObjectMap *om, void *obj) {
+  om_flat_t *t = (om_flat_t*)om->map;
+
+  if (flat_make_room(t)) return OBJMAP_ERR_INTERNAL;
+  flat_insert(t, om->top, obj);
+  return om->top++;
+}
+
+objmap_key_t om_flat_push_n(ObjectMap *om, void **objs, size_t n,
+                            objmap_key_t *out_handles) {
+  om_flat_t *t = (om_flat_t*)om->map;
+  objmap_key_t first = om->top;
+  size_t i;
+
+  if (om_flat_reserve(om, n)) return OBJMAP_ERR_INTERNAL;
+  for (i = 0; i < n; ++i) {
+    flat_insert(t, first + (objmap_key_t)i, objs[i]);
+    if (out_handles) out_handles[i] = first + (objmap_key_t)i;
+  }
+  om->top += (objmap_key_t)n;
+  return first;
+}
+
+void* om_flat_get(ObjectMap *om, objmap_key_t handle) {
+  const om_flat_t *t = (const om_flat_t*)om->map;
+  size_t i = flat_find(t, handle, NULL);
+  return (i < t->capacity) ? t->buckets[i].obj : NULL;
+}
+
+/* the home bucket of every handle in a batch is prefetched before any are
+ * probed. Being a single cache line, that is all a lookup usually needs */
+size_t om_flat_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                     void **out_ptrs) {
+  const om_flat_t *t = (const om_flat_t*)om->map;
+  size_t i, j, batch, found = 0;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch && t->capacity > 0; ++j) {
+      OM_PREFETCH(&t->buckets[FLAT_HOME(t, handles[i + j])]);
+    }
+    for (j = 0; j < batch; ++j) {
+      size_t k = flat_find(t, handles[i + j], NULL);
+      out_ptrs[i + j] = (k < t->capacity) ? t->buckets[k].obj : NULL;
+      if (k < t->capacity) ++found;
+    }
+  }
+  return found;
+}
+
+void* om_flat_pop(ObjectMap *om, objmap_key_t handle) {
+  om_flat_t *t = (om_flat_t*)om->map;
+  size_t i = flat_find(t, handle, NULL), mask = t->capacity - 1;
+  void *obj;
+
+  if (i >= t->capacity) return NULL;
+  obj = t->buckets[i].obj;
+  SET_DELETED(&t->buckets[i]);
+  --t->size;
+  /* clear the run of tombstones ending in this bucket if an empty bucket
+   * follows it */
+  if (IS_EMPTY(&t->buckets[(i + 1) & mask])) {
+    while (IS_DELETED(&t->buckets[i])) {
+      SET_EMPTY(&t->buckets[i]);
+      --t->used;
+      i = (i - 1) & mask;
+    }
+  }
+  return obj;
+}
+
+void om_flat_flush(ObjectMap *om) {
+  om_flat_t *t = (om_flat_t*)om->map;
+  size_t i;
+
+  for (i = 0; OM_NEEDS_DEALLOC(om) && i < t->capacity && t->size > 0; ++i) {
+    if (!IS_LIVE(&t->buckets[i])) continue;
+    OM_DEALLOC(om, t->buckets[i].obj);
+    --t->size;
+  }
+  if (t->capacity > 0) {
+    memset(t->buckets, 0, t->capacity * sizeof(om_fbucket_t));
+  }
+  t->size = t->used = 0;
+}
+
+/* shrink to leave the table half full at most, as for the hashtable
+ * engine, and drop tombstones */
+void om_flat_compact(ObjectMap *om) {
+  om_flat_t *t = (om_flat_t*)om->map;
+  size_t capacity;
+
+  if (t->size == 0) {
+    free(t->buckets);
+    memset(t, 0, sizeof(om_flat_t));
+    return;
+  }
+  capacity = flat_capacity_for(t->size * 2);
+  if (capacity > t->capacity) capacity = t->capacity;
+  if (capacity < t->capacity || t->used > t->size) {
+    flat_rehash(t, capacity); /* keeps old table on failure */
+  }
+}
+
+int om_flat_next(ObjectMap *om, size_t *pos, size_t end,
+                 objmap_key_t *handle, void **obj) {
+  const om_flat_t *t = (const om_flat_t*)om->map;
+  size_t i;
+
+  if (end > t->capacity) end = t->capacity;
+  for (i = *pos; i < end; ++i) {
+    if (!IS_LIVE(&t->buckets[i])) continue;
+    *handle = t->buckets[i].key;
+    *obj = t->buckets[i].obj;
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+size_t om_flat_extent(const ObjectMap *om) {
+  return ((const om_flat_t*)om->map)->capacity;
+}
+
+/* number of buckets examined when looking up key */
+static size_t flat_probe_length(ObjectMap *om, objmap_key_t key) {
+  size_t probes;
+  flat_find((const om_flat_t*)om->map, key, &probes);
+  return probes;
+}
+
+/* samples are taken as for the hashtable engine */
+void om_flat_stats(ObjectMap *om, objmap_stats_t *stats) {
+  const om_flat_t *t = (const om_flat_t*)om->map;
+  size_t i;
+  objmap_key_t key;
+
+  stats->live = t->size;
+  stats->tombstones = t->used - t->size;
+  stats->buckets = t->capacity;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_flat_t) +
+                  t->capacity * sizeof(om_fbucket_t);
+  if (t->capacity == 0) return;
+
+  om_stats_sample_hits(om, om_flat_next, t->capacity, t->size,
+                       flat_probe_length, stats->probe_hit);
+  for (i = 0, key = om->top; i < OM_STATS_SAMPLES; ++i, ++key) {
+    if (key < om->top) break; /* out of keys */
+    om_stats_probe(stats->probe_miss, flat_probe_length(om, key));
+  }
+}
@@ -0,0 +1,606 @@
+/*!
+ * \file objmap_inline.c
+ * \brief Inline storage engine: fixed-size objects stored inside the map
+ *
+ * Objects are copied into pages owned by the map instead of being referenced
+ * by pointer, so objmap_get() returns the address of the object within its
+ * page. This saves the cache miss of following a pointer to a separately
+ * allocated object, and the cost of allocating and freeing every object.
+ *
+ * Pages are indexed by handle as in the slot engine. Each page is a single
+ * allocation holding a header (see om_ipage_t), with a bitmap of occupied
+ * slots, followed by the objects aligned as requested. Since the map owns
+ * the memory, the deallocator is only used as a finalizer and is never
+ * expected to free the object.
+ *
+ * A map can be saved to a file laid out as the pages are in memory (see
+ * om_inline_save()), and the file later mapped back with mmap() so its pages
+ * are used in place.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "objmap_internal.h"
+
+/* largest alignment chosen when none is specified */
+#define OM_INLINE_ALIGN 16
+
+/* occupancy bits */
+#define BIT_WORD(i) ((i) / OM_ULONG_BITS)
+#define BIT_MASK(i) (1ul << ((i) % OM_ULONG_BITS))
+
+/* Pages released by compaction are replaced with a shared page with no
+ * occupied slots so lookups never need to check for a missing page. Only
+ * its header exists; it is never written to. */
+static om_ipage_t inline_empty_page;
+
+#define OBJ_AT(in, page, i) \
+  ((char*)(page) + (in)->data_offset + (size_t)(i) * (in)->stride)
+
+/* round n up to a multiple of align (a power of 2) */
+static size_t round_up(size_t n, size_t align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+om_inline_t* om_inline_new(size_t object_size, size_t alignment) {
+  om_inline_t *in;
+
+  if (object_size == 0) return NULL;
+  if (alignment == 0) { /* natural alignment, as for an array of objects */
+    alignment = object_size & (~object_size + 1);
+    if (alignment > OM_INLINE_ALIGN) alignment = OM_INLINE_ALIGN;
+  }
+  if ((alignment & (alignment - 1)) != 0) return NULL; /* not power of 2 */
+  if (object_size > ((size_t)-1 / 2 - alignment) / OM_PAGE_SIZE) return NULL;
+
+  in = (om_inline_t*)calloc(1, sizeof(om_inline_t));
+  if (in == NULL) return NULL;
+  in->object_size = object_size;
+  in->alignment = alignment;
+  in->stride = round_up(object_size, alignment);
+  in->data_offset = round_up(sizeof(om_ipage_t), alignment);
+  return in;
+}
+
+/* pages inside a mapped file are released with the whole mapping */
+static void inline_page_free(const om_inline_t *in, om_ipage_t *page) {
+  const char *addr = (const char*)page;
+  const char *mapping = (const char*)in->mapping;
+
+  if (page == &inline_empty_page) return;
+  if (mapping != NULL && addr >= mapping &&
+      addr < mapping + in->mapping_size) {
+    return;
+  }
+  free(page->raw);
+}
+
+void om_inline_destroy(om_inline_t *in) {
+  size_t p;
+  if (in == NULL) return;
+  for (p = 0; p < in->dir.npages; ++p) {
+    inline_page_free(in, in->dir.pages[p]);
+  }
+  free(in->dir.pages);
+  if (in->mapping != NULL) munmap(in->mapping, in->mapping_size);
+  free(in);
+}
+
+/* allocate an empty page. Objects are not initialised */
+static om_ipage_t* inline_page_new(const om_inline_t *in) {
+  size_t align = (in->alignment > sizeof(void*)) ? in->alignment
+                                                 : sizeof(void*);
+  size_t bytes = in->data_offset + OM_PAGE_SIZE * in->stride;
+  void *raw = malloc(bytes + align - 1);
+  om_ipage_t *page;
+  uintptr_t addr;
+
+  if (raw == NULL) return NULL;
+  addr = ((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1);
+  page = (om_ipage_t*)addr;
+  memset(page, 0, sizeof(om_ipage_t));
+  page->raw = raw;
+  return page;
+}
+
+/* make sure page p can be written to. Since keys are assigned incrementally,
+ * p is at most one past the last page in the directory. Returns 0 on success */
+static int inline_page_ready(om_inline_t *in, size_t p) {
+  om_ipage_t *page;
+
+  if (p < in->dir.npages && in->dir.pages[p] != &inline_empty_page) return 0;
+  if (p >= in->dir.npages && om_dir_grow(&in->dir, p + 1)) return 1;
+  page = inline_page_new(in);
+  if (page == NULL) return 1;
+  in->dir.pages[p] = page;
+  if (p >= in->dir.npages) in->dir.npages = p + 1;
+  return 0;
+}
+
+/* mark slot of key as occupied and return its (zeroed) object */
+static void* inline_claim(om_inline_t *in, objmap_key_t key) {
+  om_ipage_t *page = (om_ipage_t*)in->dir.pages[key >> OM_PAGE_BITS];
+  objmap_key_t i = key & OM_PAGE_MASK;
+  void *obj = OBJ_AT(in, page, i);
+
+  page->bits[BIT_WORD(i)] |= BIT_MASK(i);
+  ++page->live;
+  ++in->size;
+  memset(obj, 0, in->stride);
+  return obj;
+}
+
+objmap_key_t om_inline_emplace(ObjectMap *om, void **out_obj) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  objmap_key_t key = om->top;
+
+  if (key > OBJMAP_MAX_INDEX) return OBJMAP_ERR_OVERFLOW;
+  if (inline_page_ready(in, key >> OM_PAGE_BITS)) return OBJMAP_ERR_INTERNAL;
+
+  *out_obj = inline_claim(in, key);
+  ++om->top;
+  return key;
+}
+
+objmap_key_t om_inline_push(ObjectMap *om, const void *obj) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  void *slot;
+  objmap_key_t key = om_inline_emplace(om, &slot);
+
+  if (key <= OBJMAP_MAX_INDEX) memcpy(slot, obj, in->object_size);
+  return key;
+}
+
+objmap_key_t om_inline_push_n(ObjectMap *om, void **objs, size_t n,
+                              objmap_key_t *out_handles) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  objmap_key_t key, first = om->top, last = first + (objmap_key_t)(n - 1);
+  size_t i, p;
+
+  /* get all pages ready before storing anything */
+  for (p = first >> OM_PAGE_BITS; p <= (size_t)(last >> OM_PAGE_BITS); ++p) {
+    if (inline_page_ready(in, p)) return OBJMAP_ERR_INTERNAL;
+  }
+
+  for (i = 0, key = first; i < n; ++i, ++key) {
+    memcpy(inline_claim(in, key), objs[i], in->object_size);
+    if (out_handles) out_handles[i] = key;
+  }
+  om->top = last + 1;
+  return first;
+}
+
+int om_inline_reserve(ObjectMap *om, size_t n) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  objmap_key_t last;
+  size_t p;
+
+  if (n == 0) return 0;
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    return 1; /* not enough keys left */
+  }
+  last = om->top + (objmap_key_t)(n - 1);
+  if (om_dir_grow(&in->dir, (size_t)(last >> OM_PAGE_BITS) + 1)) return 1;
+  for (p = om->top >> OM_PAGE_BITS; p <= (size_t)(last >> OM_PAGE_BITS); ++p) {
+    if (inline_page_ready(in, p)) return 1;
+  }
+  return 0;
+}
+
+/* the object stays in its page, which is only released by compaction */
+void* om_inline_pop(ObjectMap *om, objmap_key_t handle) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  om_ipage_t *page;
+  objmap_key_t i = handle & OM_PAGE_MASK;
+
+  if ((handle >> OM_PAGE_BITS) >= in->dir.npages) return NULL;
+  page = (om_ipage_t*)in->dir.pages[handle >> OM_PAGE_BITS];
+  if (!(page->bits[BIT_WORD(i)] & BIT_MASK(i))) return NULL;
+
+  page->bits[BIT_WORD(i)] &= ~BIT_MASK(i);
+  --page->live;
+  --in->size;
+  return OBJ_AT(in, page, i);
+}
+
+/* the bitmap word and object of each handle in a batch are prefetched
+ * before any are read */
+size_t om_inline_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                       void **out_ptrs) {
+  const om_inline_t *in = (const om_inline_t*)om->map;
+  om_ipage_t *pages[OM_GET_BATCH];
+  size_t i, j, batch, found = 0;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch; ++j) {
+      objmap_key_t h = handles[i + j], k = h & OM_PAGE_MASK;
+      if ((h >> OM_PAGE_BITS) >= in->dir.npages) {
+        pages[j] = NULL;
+      } else {
+        pages[j] = (om_ipage_t*)in->dir.pages[h >> OM_PAGE_BITS];
+        OM_PREFETCH(&pages[j]->bits[BIT_WORD(k)]);
+        if (pages[j] != &inline_empty_page) {
+          OM_PREFETCH(OBJ_AT(in, pages[j], k));
+        }
+      }
+    }
+    for (j = 0; j < batch; ++j) {
+      objmap_key_t k = handles[i + j] & OM_PAGE_MASK;
+      if (pages[j] && (pages[j]->bits[BIT_WORD(k)] & BIT_MASK(k))) {
+        out_ptrs[i + j] = OBJ_AT(in, pages[j], k);
+        ++found;
+      } else {
+        out_ptrs[i + j] = NULL;
+      }
+    }
+  }
+  return found;
+}
+
+int om_inline_next(ObjectMap *om, size_t *pos, size_t end,
+                   objmap_key_t *handle, void **obj) {
+  const om_inline_t *in = (const om_inline_t*)om->map;
+  size_t i = *pos;
+
+  /* examine one bitmap word at a time */
+  while (i < end && (i >> OM_PAGE_BITS) < in->dir.npages) {
+    om_ipage_t *page = (om_ipage_t*)in->dir.pages[i >> OM_PAGE_BITS];
+    size_t k = i & OM_PAGE_MASK;
+    unsigned long word = page->bits[BIT_WORD(k)] >> (k % OM_ULONG_BITS);
+
+    if (word == 0) { /* move to next word */
+      i = (i | (OM_ULONG_BITS - 1)) + 1;
+      continue;
+    }
+    i += OM_CTZL(word);
+    if (i >= end) break;
+    *handle = (objmap_key_t)i;
+    *obj = OBJ_AT(in, page, i & OM_PAGE_MASK);
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+/* objects are counted as they are part of the pages */
+void om_inline_stats(ObjectMap *om, objmap_stats_t *stats) {
+  const om_inline_t *in = (const om_inline_t*)om->map;
+  size_t p, align = (in->alignment > sizeof(void*)) ? in->alignment
+                                                    : sizeof(void*);
+
+  stats->live = in->size;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_inline_t) +
+                  in->dir.capacity * sizeof(void*);
+  for (p = 0; p < in->dir.npages; ++p) {
+    if (in->dir.pages[p] == &inline_empty_page) continue;
+    stats->buckets += OM_PAGE_SIZE;
+    stats->memory += in->data_offset + OM_PAGE_SIZE * in->stride + align - 1;
+  }
+}
+
+/* pages are kept for reuse. Objects are finalised if a deallocator is set */
+void om_inline_flush(ObjectMap *om) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  size_t p, w;
+
+  int finalize = OM_NEEDS_DEALLOC(om);
+
+  for (p = 0; p < in->dir.npages && in->size > 0; ++p) {
+    om_ipage_t *page = (om_ipage_t*)in->dir.pages[p];
+    if (page->live == 0) continue;
+    for (w = 0; finalize && w < OM_PAGE_SIZE / OM_ULONG_BITS; ++w) {
+      unsigned long word = page->bits[w];
+      size_t b;
+      for (b = 0; word != 0; ++b, word >>= 1) {
+        if (word & 1) om->deallocator(OBJ_AT(in, page, w * OM_ULONG_BITS + b));
+      }
+    }
+    memset(page->bits, 0, sizeof(page->bits));
+    in->size -= page->live;
+    page->live = 0;
+  }
+  assert(in->size == 0);
+}
+
+void om_inline_compact(ObjectMap *om) {
+  om_inline_t *in = (om_inline_t*)om->map;
+  size_t p, npages, top_page = om->top >> OM_PAGE_BITS;
+
+  /* release pages with no objects */
+  for (p = 0; p < in->dir.npages; ++p) {
+    om_ipage_t *page = (om_ipage_t*)in->dir.pages[p];
+    if (page == &inline_empty_page || page->live > 0) continue;
+    inline_page_free(in, page);
+    in->dir.pages[p] = &inline_empty_page;
+  }
+
+  /* drop released pages from the end of the directory. The directory must
+   * still reach the page of the next key to be assigned */
+  npages = in->dir.npages;
+  while (npages > 0 && in->dir.pages[npages - 1] == &inline_empty_page &&
+         npages > top_page + 1) {
+    --npages;
+  }
+  in->dir.npages = npages;
+
+  if (npages == 0) {
+    free(in->dir.pages);
+    in->dir.pages = NULL;
+    in->dir.capacity = 0;
+  } else if (npages < in->dir.capacity) {
+    void **pages = (void**)realloc(in->dir.pages, npages * sizeof(void*));
+    if (pages != NULL) {
+      in->dir.pages = pages;
+      in->dir.capacity = npages;
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Snapshots
+ *
+ * A snapshot file starts with an om_image_t header and a table of npages
+ * 64-bit file offsets, one per directory entry, with 0 for pages holding no
+ * objects. Each page image is stored exactly as the page is in memory (the
+ * header, then the objects data_offset bytes further on), at an offset that
+ * is a multiple of OM_IMAGE_ALIGN. Mapping the file therefore yields usable
+ * pages without any fix-up, and the only pointer in a page header (raw) is
+ * written as NULL. Slots not occupied are left as zero bytes.
+ * ------------------------------------------------------------------------ */
+#define OM_IMAGE_MAGIC "OBJMAPI"
+#define OM_IMAGE_VERSION 1
+#define OM_IMAGE_BYTE_ORDER 0x01020304u
+#define OM_IMAGE_ALIGN 4096 /* also the largest object alignment supported */
+
+typedef struct {
+  char magic[8];           /* OM_IMAGE_MAGIC */
+  uint32_t version;        /* OM_IMAGE_VERSION */
+  uint32_t byte_order;     /* OM_IMAGE_BYTE_ORDER, as stored by the writer */
+  uint32_t key_bits;       /* bits in objmap_key_t */
+  uint32_t page_bits;      /* OM_PAGE_BITS */
+  uint64_t header_size;    /* sizeof(om_ipage_t) */
+  uint64_t object_size;
+  uint64_t alignment;
+  uint64_t stride;
+  uint64_t data_offset;
+  uint64_t top;            /* next key to be assigned */
+  uint64_t size;           /* number of objects stored */
+  uint64_t npages;         /* entries in the offset table */
+} om_image_t;
+
+/* write all of buf at offset. Returns 0 on success */
+static int image_write(int fd, const void *buf, size_t n, size_t offset) {
+  const char *p = (const char*)buf;
+
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, (off_t)offset);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return 1;
+    p += w;
+    n -= (size_t)w;
+    offset += (size_t)w;
+  }
+  return 0;
+}
+
+/* write the header of a page and its occupied slots, coalescing runs of
+ * neighbouring objects. Returns 0 on success */
+static int image_write_page(int fd, const om_inline_t *in,
+                            const om_ipage_t *page, size_t offset) {
+  om_ipage_t header = *page;
+  size_t i = 0, start, at;
+
+  header.raw = NULL;
+  if (image_write(fd, &header, sizeof(header), offset)) return 1;
+  while (i < OM_PAGE_SIZE) {
+    if (!(page->bits[BIT_WORD(i)] & BIT_MASK(i))) {
+      ++i;
+      continue;
+    }
+    start = i;
+    while (i < OM_PAGE_SIZE && (page->bits[BIT_WORD(i)] & BIT_MASK(i))) ++i;
+    at = in->data_offset + start * in->stride;
+    if (image_write(fd, (const char*)page + at, (i - start) * in->stride,
+                    offset + at)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the file is written next to path and renamed over it once complete, so a
+ * failed save leaves any previous file intact and a map opened from path
+ * keeps the file it mapped */
+int om_inline_save(ObjectMap *om, const char *path) {
+  const om_inline_t *in = (const om_inline_t*)om->map;
+  size_t p, npages = in->dir.npages, end;
+  size_t page_bytes = in->data_offset + OM_PAGE_SIZE * in->stride;
+  uint64_t *offsets;
+  om_image_t image;
+  char *tmp;
+  int fd, rc = 1;
+
+  if (in->alignment > OM_IMAGE_ALIGN) return 1;
+
+  /* place pages */
+  offsets = (uint64_t*)calloc(npages + 1, sizeof(uint64_t));
+  tmp = (char*)malloc(strlen(path) + sizeof(".tmp"));
+  if (offsets == NULL || tmp == NULL) goto done;
+  end = round_up(sizeof(image) + npages * sizeof(uint64_t), OM_IMAGE_ALIGN);
+  for (p = 0; p < npages; ++p) {
+    const om_ipage_t *page = (const om_ipage_t*)in->dir.pages[p];
+    if (page->live == 0) continue;
+    offsets[p] = end;
+    end += round_up(page_bytes, OM_IMAGE_ALIGN);
+  }
+
+  memset(&image, 0, sizeof(image));
+  memcpy(image.magic, OM_IMAGE_MAGIC, sizeof(OM_IMAGE_MAGIC));
+  image.version = OM_IMAGE_VERSION;
+  image.byte_order = OM_IMAGE_BYTE_ORDER;
+  image.key_bits = (uint32_t)(sizeof(objmap_key_t) * 8);
+  image.page_bits = OM_PAGE_BITS;
+  image.header_size = sizeof(om_ipage_t);
+  image.object_size = in->object_size;
+  image.alignment = in->alignment;
+  image.stride = in->stride;
+  image.data_offset = in->data_offset;
+  image.top = om->top;
+  image.size = in->size;
+  image.npages = npages;
+
+  sprintf(tmp, "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) goto done;
+  /* sizing the file first leaves unwritten slots as zeros */
+  if (ftruncate(fd, (off_t)end) == 0 &&
+      image_write(fd, &image, sizeof(image), 0) == 0 &&
+      image_write(fd, offsets, npages * sizeof(uint64_t), sizeof(image)) == 0) {
+    rc = 0;
+    for (p = 0; p < npages && rc == 0; ++p) {
+      if (offsets[p] == 0) continue;
+      rc = image_write_page(fd, in, (const om_ipage_t*)in->dir.pages[p],
+                            (size_t)offsets[p]);
+    }
+  }
+  if (rc == 0 && fsync(fd) != 0) rc = 1;
+  if (close(fd) != 0) rc = 1;
+  if (rc == 0 && rename(tmp, path) != 0) rc = 1;
+  if (rc != 0) unlink(tmp);
+
+done:
+  free(tmp);
+  free(offsets);
+  return rc;
+}
+
+/* check that a header describes a file of a given size written by this build
+ * of the library, and create the storage it describes */
+static om_inline_t* image_check(const om_image_t *image, size_t file_size) {
+  om_inline_t *in;
+  size_t table_end;
+
+  if (memcmp(image->magic, OM_IMAGE_MAGIC, sizeof(OM_IMAGE_MAGIC)) != 0 ||
+      image->version != OM_IMAGE_VERSION ||
+      image->byte_order != OM_IMAGE_BYTE_ORDER ||
+      image->key_bits != sizeof(objmap_key_t) * 8 ||
+      image->page_bits != OM_PAGE_BITS ||
+      image->header_size != sizeof(om_ipage_t) ||
+      image->alignment == 0 || image->alignment > OM_IMAGE_ALIGN ||
+      image->object_size > (size_t)-1) {
+    return NULL;
+  }
+  if (image->top == 0 || image->top > (uint64_t)OBJMAP_MAX_INDEX + 1 ||
+      image->size >= image->top) {
+    return NULL;
+  }
+  /* the page of the last key issued must be in the table, as pushes only
+   * ever add the page after it */
+  if (image->top > 1 && (image->top - 1) >> OM_PAGE_BITS >= image->npages) {
+    return NULL;
+  }
+  if (image->npages > (file_size - sizeof(om_image_t)) / sizeof(uint64_t)) {
+    return NULL;
+  }
+  table_end = sizeof(om_image_t) + (size_t)image->npages * sizeof(uint64_t);
+  if (table_end > file_size) return NULL;
+
+  /* the layout of pages must be the one this build would use */
+  in = om_inline_new((size_t)image->object_size, (size_t)image->alignment);
+  if (in == NULL) return NULL;
+  if (in->stride != image->stride || in->data_offset != image->data_offset) {
+    om_inline_destroy(in);
+    return NULL;
+  }
+  return in;
+}
+
+/* number of objects in page p of a file, or (size_t)-1 if its bitmap does
+ * not match its live count or marks slots of keys never issued */
+static size_t image_page_live(const om_ipage_t *page, size_t p, uint64_t top) {
+  size_t w, live = 0;
+
+  for (w = 0; w < OM_PAGE_SIZE / OM_ULONG_BITS; ++w) {
+    uint64_t first = ((uint64_t)p << OM_PAGE_BITS) + w * OM_ULONG_BITS;
+    unsigned long word;
+    for (word = page->bits[w]; word != 0; word &= word - 1) {
+      uint64_t key = first + OM_CTZL(word);
+      if (key == OBJMAP_NULL || key >= top) return (size_t)-1;
+      ++live;
+    }
+  }
+  return (live == page->live) ? live : (size_t)-1;
+}
+
+om_inline_t* om_inline_open_mapped(const char *path, objmap_key_t *top) {
+  om_inline_t *in = NULL;
+  om_image_t image;
+  const uint64_t *offsets;
+  struct stat st;
+  size_t p, file_size, page_bytes, table_end, live, size = 0;
+  void *base;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(om_image_t) ||
+      (uint64_t)st.st_size > (size_t)-1) {
+    close(fd);
+    return NULL;
+  }
+  file_size = (size_t)st.st_size;
+  /* private and writable: changes to the map are copied on write and never
+   * reach the file */
+  base = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+
+  memcpy(&image, base, sizeof(image));
+  in = image_check(&image, file_size);
+  if (in == NULL || (uintptr_t)base % in->alignment != 0) goto fail;
+  in->mapping = base;
+  in->mapping_size = file_size;
+
+  /* point the directory at the pages in the file. Only the offset table and
+   * page headers are read here; objects are read from the file when first
+   * accessed. The bitmaps must agree with the live counts and with the
+   * header, or flushing and pushing would go wrong later */
+  page_bytes = in->data_offset + OM_PAGE_SIZE * in->stride;
+  table_end = sizeof(om_image_t) + (size_t)image.npages * sizeof(uint64_t);
+  offsets = (const uint64_t*)(const void*)((char*)base + sizeof(image));
+  if (om_dir_grow(&in->dir, (size_t)image.npages)) goto fail;
+  for (p = 0; p < (size_t)image.npages; ++p) {
+    uint64_t offset = offsets[p];
+    if (offset == 0) {
+      in->dir.pages[p] = &inline_empty_page;
+    } else if (offset % OM_IMAGE_ALIGN == 0 && offset >= table_end &&
+               page_bytes <= file_size && offset <= file_size - page_bytes) {
+      in->dir.pages[p] = (char*)base + offset;
+      live = image_page_live((const om_ipage_t*)in->dir.pages[p], p,
+                             image.top);
+      if (live == (size_t)-1) goto fail;
+      size += live;
+    } else {
+      goto fail;
+    }
+    in->dir.npages = p + 1;
+  }
+  if (size != image.size) goto fail;
+  in->size = size;
+  *top = (objmap_key_t)image.top;
+  return in;
+
+fail:
+  if (in == NULL || in->mapping == NULL) munmap(base, file_size);
+  om_inline_destroy(in);
+  return NULL;
+}
@@ -0,0 +1,375 @@
+/*!
+ * \file objmap_internal.h
+ * \brief Declarations shared between the objmap storage engines
+ *
+ * This header is NOT part of the public interface. It should only be included
+ * by the objmap source files.
+ */
+#ifndef OBJMAP_INTERNAL_H_
+#define OBJMAP_INTERNAL_H_
+#include <stdlib.h>
+#include "objmap.h"
+
+/* whether OM_DEALLOC() does anything, i.e. objects need to be visited.
+ * Objects of inline maps belong to the map, so only a finalizer is run */
+#define OM_NEEDS_DEALLOC(om) \
+  ((om)->deallocator ? (om)->deallocator != objmap_no_dealloc \
+   : !(om)->pool && (om)->engine != OBJMAP_ENGINE_INLINE)
+
+/* deallocate an object using the custom deallocator, or free() by default.
+ * Objects from the map's pool are released with the pool instead */
+#define OM_DEALLOC(om, obj) \
+  (!OM_NEEDS_DEALLOC(om) ? (void)0 \
+   : (om)->deallocator ? (om)->deallocator(obj) : free(obj))
+
+/* prefetch memory at the given address into cache */
+#if defined(__GNUC__) || defined(__clang__)
+#define OM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define OM_PREFETCH(addr) ((void)(addr))
+#endif
+
+/* index of the lowest set bit in x (x must not be 0) */
+#if defined(__GNUC__) || defined(__clang__)
+#define OM_CTZL(x) ((unsigned int)__builtin_ctzl(x))
+#else
+static inline unsigned int om_ctzl(unsigned long x) {
+  unsigned int n = 0;
+  while (!(x & 1)) { x >>= 1; ++n; }
+  return n;
+}
+#define OM_CTZL(x) om_ctzl(x)
+#endif
+
+/* number of lookups overlapped by objmap_get_n() */
+#define OM_GET_BATCH 16
+
+/* number of hits and of misses sampled by objmap_stats() */
+#define OM_STATS_SAMPLES 1024
+
+/* add a probe length to a histogram of objmap_stats_t */
+static inline void om_stats_probe(size_t *hist, size_t n) {
+  ++hist[(n < OBJMAP_PROBE_HIST) ? n - 1 : OBJMAP_PROBE_HIST - 1];
+}
+
+/* Iteration. Each engine provides a function that finds the first live
+ * object at a position (an engine-specific index) in [*pos, end), returning
+ * 1 and advancing *pos past it, or 0 if there are no more objects */
+typedef int (*om_next_func_t)(ObjectMap *om, size_t *pos, size_t end,
+                              objmap_key_t *handle, void **obj);
+
+/* next() function of a map's engine. Not for sharded maps */
+om_next_func_t om_engine_next(const ObjectMap *om);
+/* number of positions to iterate over. Not for sharded maps */
+size_t om_engine_extent(const ObjectMap *om);
+
+/* number of buckets examined when looking up a key */
+typedef size_t (*om_probe_func_t)(ObjectMap *om, objmap_key_t key);
+
+/* add the probe lengths of up to OM_STATS_SAMPLES stored keys, chosen at
+ * random among the live objects, to a histogram */
+void om_stats_sample_hits(ObjectMap *om, om_next_func_t next, size_t extent,
+                          size_t live, om_probe_func_t probe, size_t *hist);
+
+/* ------------------------------------------------------------------------
+ * Object pool (objmap_alloc()). See objmap_pool.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_pool_s om_pool_t;
+
+/* allocate from the map's pool, creating it on first use */
+void* om_pool_alloc(ObjectMap *om, size_t size);
+/* release all objects, keeping some memory for reuse */
+void om_pool_release(om_pool_t *pool);
+void om_pool_destroy(om_pool_t *pool);
+
+/* ------------------------------------------------------------------------
+ * Background reclamation (objmap_set_async_reclaim()).
+ * See objmap_concurrent.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_reclaim_s om_reclaim_t;
+
+om_reclaim_t* om_reclaim_start(void);
+/* deallocate all pending objects, then stop the thread */
+void om_reclaim_stop(om_reclaim_t *r);
+void om_reclaim_wait(om_reclaim_t *r);
+/* queue an object to be deallocated, or a detached map to be deleted.
+ * Return 0 on success, non-zero if the caller must do it instead */
+int om_reclaim_object(om_reclaim_t *r, void *obj, void (*dealloc)(void*));
+int om_reclaim_map(om_reclaim_t *r, ObjectMap *detached);
+
+/* ------------------------------------------------------------------------
+ * Paged directory shared by the slot-based engines
+ *
+ * Entries are stored in fixed-size pages. A directory of pages is indexed by
+ * the high bits of the slot index and the page itself by the low bits, so an
+ * entry can be reached with two dependent loads. Pages are never moved once
+ * allocated.
+ * ------------------------------------------------------------------------ */
+#define OM_PAGE_BITS 12
+#define OM_PAGE_SIZE ((objmap_key_t)1 << OM_PAGE_BITS)
+#define OM_PAGE_MASK (OM_PAGE_SIZE - 1)
+
+typedef struct {
+  void **pages;    /* directory of pages */
+  size_t npages;   /* number of pages allocated */
+  size_t capacity; /* number of entries available in the directory */
+} om_dir_t;
+
+int om_dir_grow(om_dir_t *d, size_t npages);
+int om_dir_add_page(om_dir_t *d, size_t entry_size);
+int om_dir_reserve(om_dir_t *d, size_t npages, size_t entry_size);
+void om_dir_free(om_dir_t *d);
+
+/* address of entry \c i in a directory of entries with type \c T */
+#define OM_DIR_ENTRY(d, T, i) \
+  (&((T*)(d)->pages[(i) >> OM_PAGE_BITS])[(i) & OM_PAGE_MASK])
+
+/* ------------------------------------------------------------------------
+ * Slot engine (OBJMAP_ENGINE_SLOT)
+ *
+ * Object pointers are stored in the paged directory at their handle.
+ * ------------------------------------------------------------------------ */
+typedef struct {
+  om_dir_t dir;    /* pages of (void*) */
+  size_t size;     /* number of objects stored */
+} om_slot_t;
+
+om_slot_t* om_slot_new(void);
+om_slot_t* om_slot_new_at(objmap_key_t top);
+void om_slot_destroy(om_slot_t *s);
+objmap_key_t om_slot_push(ObjectMap *om, void *obj);
+objmap_key_t om_slot_push_n(ObjectMap *om, void **objs, size_t n,
+                            objmap_key_t *out_handles);
+void* om_slot_pop(ObjectMap *om, objmap_key_t handle);
+size_t om_slot_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                     void **out_ptrs);
+void om_slot_flush(ObjectMap *om);
+void om_slot_compact(ObjectMap *om);
+int om_slot_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                 void **obj);
+int om_slot_reserve(ObjectMap *om, size_t n);
+void om_slot_stats(ObjectMap *om, objmap_stats_t *stats);
+
+static inline void* om_slot_get(const om_slot_t *s, objmap_key_t handle) {
+  if ((handle >> OM_PAGE_BITS) >= s->dir.npages) return NULL;
+  return *OM_DIR_ENTRY(&s->dir, void*, handle);
+}
+
+/* ------------------------------------------------------------------------
+ * Generational engine (OBJMAP_ENGINE_GENERATIONAL)
+ *
+ * A handle is the slot index in the low bits and the generation of the slot
+ * in the high OBJMAP_GEN_BITS bits. Each slot records the full handle it was
+ * last issued with, so a stale handle is detected by a single comparison.
+ * Freed slots are recycled in FIFO order to maximise the number of handles
+ * issued before a slot's generation wraps around.
+ * ------------------------------------------------------------------------ */
+#define OM_GEN_INDEX_BITS (sizeof(objmap_key_t) * 8 - OBJMAP_GEN_BITS)
+#define OM_GEN_INDEX_MASK (((objmap_key_t)1 << OM_GEN_INDEX_BITS) - 1)
+#define OM_GEN_STEP ((objmap_key_t)1 << OM_GEN_INDEX_BITS)
+/* the all-ones generation is never issued so handles stay below the
+ * reserved error codes */
+#define OM_GEN_LAST (~OM_GEN_INDEX_MASK - OM_GEN_STEP)
+
+typedef struct {
+  void *obj;           /* stored object, or NULL if slot is free */
+  objmap_key_t handle; /* handle issued (or to be issued next) for slot */
+  objmap_key_t next;   /* next slot in free list. 0 terminates the list */
+} om_gslot_t;
+
+typedef struct {
+  om_dir_t dir;        /* pages of om_gslot_t */
+  size_t size;         /* number of objects stored */
+  objmap_key_t head;   /* first free slot to be recycled (0 if none) */
+  objmap_key_t tail;   /* last free slot to be recycled (0 if none) */
+} om_gen_t;
+
+om_gen_t* om_gen_new(void);
+void om_gen_destroy(om_gen_t *g);
+objmap_key_t om_gen_push(ObjectMap *om, void *obj);
+objmap_key_t om_gen_push_n(ObjectMap *om, void **objs, size_t n,
+                           objmap_key_t *out_handles);
+void* om_gen_pop(ObjectMap *om, objmap_key_t handle);
+size_t om_gen_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                    void **out_ptrs);
+void om_gen_flush(ObjectMap *om);
+int om_gen_reserve(ObjectMap *om, size_t n);
+int om_gen_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                void **obj);
+void om_gen_stats(ObjectMap *om, objmap_stats_t *stats);
+
+static inline void* om_gen_get(const om_gen_t *g, objmap_key_t handle) {
+  const om_gslot_t *slot;
+  objmap_key_t i = handle & OM_GEN_INDEX_MASK;
+  if ((i >> OM_PAGE_BITS) >= g->dir.npages) return NULL;
+  slot = OM_DIR_ENTRY(&g->dir, const om_gslot_t, i);
+  return (slot->handle == handle) ? slot->obj : NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Inline engine (OBJMAP_ENGINE_INLINE). See objmap_inline.c
+ *
+ * Objects are stored by value in pages indexed by handle. A page is a header
+ * with a bitmap of occupied slots, followed by OM_PAGE_SIZE objects placed
+ * data_offset bytes from the header and stride bytes apart.
+ * ------------------------------------------------------------------------ */
+#define OM_ULONG_BITS (sizeof(unsigned long) * 8)
+
+typedef struct {
+  void *raw;           /* block allocated for the page (may precede header) */
+  size_t live;         /* number of objects in page */
+  unsigned long bits[OM_PAGE_SIZE / OM_ULONG_BITS]; /* occupied slots */
+} om_ipage_t;
+
+typedef struct {
+  om_dir_t dir;        /* pages of (om_ipage_t + objects) */
+  size_t size;         /* number of objects stored */
+  size_t object_size;  /* size of an object in bytes */
+  size_t alignment;    /* alignment of objects (power of 2) */
+  size_t stride;       /* distance between objects in a page */
+  size_t data_offset;  /* distance from page header to first object */
+  void *mapping;       /* file mapped by om_inline_open_mapped(), or NULL */
+  size_t mapping_size; /* length of mapping in bytes */
+} om_inline_t;
+
+om_inline_t* om_inline_new(size_t object_size, size_t alignment);
+void om_inline_destroy(om_inline_t *in);
+objmap_key_t om_inline_emplace(ObjectMap *om, void **out_obj);
+objmap_key_t om_inline_push(ObjectMap *om, const void *obj);
+objmap_key_t om_inline_push_n(ObjectMap *om, void **objs, size_t n,
+                              objmap_key_t *out_handles);
+void* om_inline_pop(ObjectMap *om, objmap_key_t handle);
+size_t om_inline_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                       void **out_ptrs);
+void om_inline_flush(ObjectMap *om);
+void om_inline_compact(ObjectMap *om);
+int om_inline_reserve(ObjectMap *om, size_t n);
+int om_inline_next(ObjectMap *om, size_t *pos, size_t end,
+                   objmap_key_t *handle, void **obj);
+void om_inline_stats(ObjectMap *om, objmap_stats_t *stats);
+int om_inline_save(ObjectMap *om, const char *path);
+om_inline_t* om_inline_open_mapped(const char *path, objmap_key_t *top);
+
+static inline void* om_inline_get(const om_inline_t *in, objmap_key_t handle) {
+  const om_ipage_t *page;
+  char *base;
+  objmap_key_t i = handle & OM_PAGE_MASK;
+
+  if ((handle >> OM_PAGE_BITS) >= in->dir.npages) return NULL;
+  base = (char*)in->dir.pages[handle >> OM_PAGE_BITS];
+  page = (const om_ipage_t*)(void*)base;
+  if (!((page->bits[i / OM_ULONG_BITS] >> (i % OM_ULONG_BITS)) & 1)) {
+    return NULL;
+  }
+  return base + in->data_offset + i * in->stride;
+}
+
+/* ------------------------------------------------------------------------
+ * Hashtable engine (OBJMAP_ENGINE_HASH)
+ * ------------------------------------------------------------------------ */
+
+/* store object under a specific key. Returns the key or an error code.
+ * om->top is not advanced, so objmap_push() may later issue the same key
+ * and objmap_stats() may sample stored keys as misses. Callers storing
+ * their own keys read statistics with om_hash_stats() instead */
+objmap_key_t om_hash_put(ObjectMap *om, objmap_key_t key, void *obj);
+
+/* make room for n more objects without rehashing. Returns 0 on success */
+int om_hash_reserve(ObjectMap *om, size_t n);
+
+/* fill in statistics, except the load. Misses are sampled from the key
+ * absent onwards, which must not be in the map (objmap_stats() passes
+ * om->top) */
+void om_hash_stats(ObjectMap *om, objmap_key_t absent, objmap_stats_t *stats);
+
+/* ------------------------------------------------------------------------
+ * Sharded engine (OBJMAP_ENGINE_SHARDED). See objmap_concurrent.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_sharded_s om_sharded_t;
+
+om_sharded_t* om_sharded_new(unsigned int nshards);
+void om_sharded_destroy(om_sharded_t *s);
+void om_sharded_configure(ObjectMap *om);
+objmap_key_t om_sharded_push(ObjectMap *om, void *obj);
+objmap_key_t om_sharded_push_n(ObjectMap *om, void **objs, size_t n,
+                               objmap_key_t *out_handles);
+void* om_sharded_get(ObjectMap *om, objmap_key_t handle);
+void* om_sharded_pop(ObjectMap *om, objmap_key_t handle);
+void om_sharded_flush(ObjectMap *om);
+void om_sharded_reset(ObjectMap *om);
+void om_sharded_compact(ObjectMap *om);
+int om_sharded_reserve(ObjectMap *om, size_t n);
+int om_sharded_next(ObjectMap *om, size_t *shard, size_t *pos,
+                    objmap_key_t *handle, void **obj);
+int om_sharded_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx);
+void om_sharded_flush_parallel(ObjectMap *om, unsigned int nthreads);
+void om_sharded_stats(ObjectMap *om, objmap_stats_t *stats);
+int om_parallel_foreach(ObjectMap *om, objmap_visit_func_t fn, void *ctx,
+                        unsigned int nthreads);
+
+/* ------------------------------------------------------------------------
+ * Read-mostly engine (OBJMAP_ENGINE_READ_MOSTLY). See objmap_concurrent.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_readmostly_s om_readmostly_t;
+
+om_readmostly_t* om_rm_new(void);
+void om_rm_destroy(om_readmostly_t *r);
+objmap_key_t om_rm_push(ObjectMap *om, void *obj);
+objmap_key_t om_rm_push_n(ObjectMap *om, void **objs, size_t n,
+                          objmap_key_t *out_handles);
+void* om_rm_get(ObjectMap *om, objmap_key_t handle);
+size_t om_rm_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                   void **out_ptrs);
+void* om_rm_pop(ObjectMap *om, objmap_key_t handle);
+void om_rm_flush(ObjectMap *om);
+int om_rm_reserve(ObjectMap *om, size_t n);
+int om_rm_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+               void **obj);
+size_t om_rm_extent(const ObjectMap *om);
+void om_rm_stats(ObjectMap *om, objmap_stats_t *stats);
+
+/* ------------------------------------------------------------------------
+ * Swiss table engine (OBJMAP_ENGINE_SWISS). See objmap_swiss.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_swiss_s om_swiss_t;
+
+om_swiss_t* om_swiss_new(void);
+void om_swiss_destroy(om_swiss_t *t);
+objmap_key_t om_swiss_push(ObjectMap *om, void *obj);
+objmap_key_t om_swiss_push_n(ObjectMap *om, void **objs, size_t n,
+                             objmap_key_t *out_handles);
+void* om_swiss_get(ObjectMap *om, objmap_key_t handle);
+size_t om_swiss_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                      void **out_ptrs);
+void* om_swiss_pop(ObjectMap *om, objmap_key_t handle);
+void om_swiss_flush(ObjectMap *om);
+void om_swiss_compact(ObjectMap *om);
+int om_swiss_reserve(ObjectMap *om, size_t n);
+int om_swiss_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                  void **obj);
+size_t om_swiss_extent(const ObjectMap *om);
+void om_swiss_stats(ObjectMap *om, objmap_stats_t *stats);
+
+/* ------------------------------------------------------------------------
+ * Flat engine (OBJMAP_ENGINE_FLAT). See objmap_flat.c
+ * ------------------------------------------------------------------------ */
+typedef struct om_flat_s om_flat_t;
+
+om_flat_t* om_flat_new(void);
+void om_flat_destroy(om_flat_t *t);
+objmap_key_t om_flat_push(ObjectMap *om, void *obj);
+objmap_key_t om_flat_push_n(ObjectMap *om, void **objs, size_t n,
+                            objmap_key_t *out_handles);
+void* om_flat_get(ObjectMap *om, objmap_key_t handle);
+size_t om_flat_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                     void **out_ptrs);
+void* om_flat_pop(ObjectMap *om, objmap_key_t handle);
+void om_flat_flush(ObjectMap *om);
+void om_flat_compact(ObjectMap *om);
+int om_flat_reserve(ObjectMap *om, size_t n);
+int om_flat_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                 void **obj);
+size_t om_flat_extent(const ObjectMap *om);
+void om_flat_stats(ObjectMap *om, objmap_stats_t *stats);
+
+#endif  /* OBJMAP_INTERNAL_H_ */
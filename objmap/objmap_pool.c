@@ -0,0 +1,113 @@
+/*!
+ * \file objmap_pool.c
+ * \brief Memory pool backing objmap_alloc()
+ *
+ * Objects are carved out of large chunks by bumping an offset, and are only
+ * released all at once when the map is flushed. This replaces one allocator
+ * call per object with one per chunk, both when objects are created and
+ * when they are destroyed.
+ *
+ * The most recent chunk is the only one allocated from. When it is full a
+ * new chunk twice its size (up to a limit) takes its place. Requests too
+ * large for that get a chunk of their own, placed behind the current chunk
+ * so it can still be filled. On release, the current chunk (the largest
+ * regular one) is kept for reuse so a map that is repeatedly filled and
+ * flushed settles on a single allocation.
+ */
+#include "objmap_internal.h"
+
+/* alignment of objects handed out */
+#define OM_POOL_ALIGN 16
+
+/* size of the first chunk and the largest regular chunk, in bytes */
+#define OM_POOL_CHUNK_MIN ((size_t)64 << 10)
+#define OM_POOL_CHUNK_MAX ((size_t)4 << 20)
+
+typedef struct om_chunk_s {
+  struct om_chunk_s *next; /* older chunk */
+  size_t size;             /* bytes available for objects */
+  size_t used;             /* bytes handed out */
+} om_chunk_t;
+
+struct om_pool_s {
+  om_chunk_t *chunks;      /* current chunk, followed by older ones */
+  size_t chunk_size;       /* size of next regular chunk */
+};
+
+/* offset of the first object from the chunk header */
+#define CHUNK_HEADER \
+  ((sizeof(om_chunk_t) + OM_POOL_ALIGN - 1) & ~(size_t)(OM_POOL_ALIGN - 1))
+
+#define CHUNK_DATA(c) ((char*)(c) + CHUNK_HEADER)
+
+static om_chunk_t* chunk_new(size_t size) {
+  om_chunk_t *c = (om_chunk_t*)malloc(CHUNK_HEADER + size);
+  if (c == NULL) return NULL;
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+void* om_pool_alloc(ObjectMap *om, size_t size) {
+  om_pool_t *pool = (om_pool_t*)om->pool;
+  om_chunk_t *c;
+
+  if (pool == NULL) { /* first use */
+    pool = (om_pool_t*)calloc(1, sizeof(om_pool_t));
+    if (pool == NULL) return NULL;
+    pool->chunk_size = OM_POOL_CHUNK_MIN;
+    om->pool = pool;
+  }
+
+  if (size == 0) size = 1; /* each allocation has a unique address */
+  if (size > (size_t)-1 / 2) return NULL;
+  size = (size + OM_POOL_ALIGN - 1) & ~(size_t)(OM_POOL_ALIGN - 1);
+
+  c = pool->chunks;
+  if (c != NULL && c->size - c->used >= size) { /* fits in current chunk */
+    void *obj = CHUNK_DATA(c) + c->used;
+    c->used += size;
+    return obj;
+  }
+
+  if (size > pool->chunk_size / 4) { /* large: give it a chunk of its own */
+    c = chunk_new(size);
+    if (c == NULL) return NULL;
+    c->used = size;
+    if (pool->chunks) { /* keep filling the current chunk */
+      c->next = pool->chunks->next;
+      pool->chunks->next = c;
+    } else {
+      pool->chunks = c;
+    }
+    return CHUNK_DATA(c);
+  }
+
+  c = chunk_new(pool->chunk_size);
+  if (c == NULL) return NULL;
+  if (pool->chunk_size < OM_POOL_CHUNK_MAX) pool->chunk_size *= 2;
+  c->next = pool->chunks;
+  pool->chunks = c;
+  c->used = size;
+  return CHUNK_DATA(c);
+}
+
+void om_pool_release(om_pool_t *pool) {
+  om_chunk_t *c, *next;
+
+  if (pool == NULL || pool->chunks == NULL) return;
+  for (c = pool->chunks->next; c != NULL; c = next) {
+    next = c->next;
+    free(c);
+  }
+  pool->chunks->next = NULL;
+  pool->chunks->used = 0;
+}
+
+void om_pool_destroy(om_pool_t *pool) {
+  if (pool == NULL) return;
+  om_pool_release(pool);
+  free(pool->chunks);
+  free(pool);
+}
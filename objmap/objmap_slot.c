@@ -0,0 +1,487 @@
+/*!
+ * \file objmap_slot.c
+ * \brief Slot-based storage engines: objects stored in a paged array indexed
+ *        directly by handle
+ *
+ * Since handles are assigned incrementally, the handle space is dense unless
+ * most objects are popped. Storing objects in pages indexed by handle avoids
+ * hashing altogether and makes objmap_get() two dependent loads.
+ *
+ * - The slot engine stores each object at its handle. Memory usage is
+ *   proportional to the largest handle issued.
+ * - The generational engine recycles freed slots and encodes a generation
+ *   counter in the handle to detect stale handles. Memory usage is
+ *   proportional to the largest number of objects stored at any one time.
+ */
+#include <assert.h>
+#include <string.h>
+#include "objmap_internal.h"
+
+/* initial number of entries allocated for the page directory */
+#define OM_DIR_INIT_CAPACITY 16
+
+/* make room in the directory for at least npages pages. The capacity is
+ * doubled unless more is needed. Returns 0 on success */
+int om_dir_grow(om_dir_t *d, size_t npages) {
+  size_t capacity;
+  void **pages;
+
+  if (npages <= d->capacity) return 0;
+  capacity = (d->capacity) ? d->capacity * 2 : OM_DIR_INIT_CAPACITY;
+  if (capacity < npages) capacity = npages;
+  pages = (void**)realloc(d->pages, capacity * sizeof(void*));
+  if (pages == NULL) return 1;
+  d->pages = pages;
+  d->capacity = capacity;
+  return 0;
+}
+
+/* append a new (zeroed) page, growing the directory if necessary.
+ * Returns 0 on success */
+int om_dir_add_page(om_dir_t *d, size_t entry_size) {
+  void *page;
+
+  if (om_dir_grow(d, d->npages + 1)) return 1;
+
+  page = calloc(OM_PAGE_SIZE, entry_size);
+  if (page == NULL) return 1;
+  d->pages[d->npages++] = page;
+  return 0;
+}
+
+/* add pages until there are at least npages, growing the directory at most
+ * once. Returns 0 on success */
+int om_dir_reserve(om_dir_t *d, size_t npages, size_t entry_size) {
+  if (om_dir_grow(d, npages)) return 1;
+  while (d->npages < npages) {
+    if (om_dir_add_page(d, entry_size)) return 1;
+  }
+  return 0;
+}
+
+void om_dir_free(om_dir_t *d) {
+  size_t p;
+  for (p = 0; p < d->npages; ++p) free(d->pages[p]);
+  free(d->pages);
+  d->pages = NULL;
+  d->npages = d->capacity = 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Slot engine
+ *
+ * Pages released by compaction are replaced with a shared page of NULL
+ * entries so lookups never need to check for a missing page. It is never
+ * written to; pushing into it allocates a real page first.
+ * ------------------------------------------------------------------------ */
+
+static void *slot_empty_page[OM_PAGE_SIZE];
+
+om_slot_t* om_slot_new(void) {
+  return (om_slot_t*)calloc(1, sizeof(om_slot_t));
+}
+
+/* empty storage for a map whose next key is top. The directory is filled up
+ * to the page of top with released pages, as pushes expect it to reach that
+ * far */
+om_slot_t* om_slot_new_at(objmap_key_t top) {
+  om_slot_t *s = om_slot_new();
+  size_t p, npages = (size_t)(top >> OM_PAGE_BITS) + 1;
+
+  if (s == NULL) return NULL;
+  if (om_dir_grow(&s->dir, npages)) {
+    free(s);
+    return NULL;
+  }
+  for (p = 0; p < npages; ++p) s->dir.pages[p] = slot_empty_page;
+  s->dir.npages = npages;
+  return s;
+}
+
+void om_slot_destroy(om_slot_t *s) {
+  size_t p;
+  if (s == NULL) return;
+  for (p = 0; p < s->dir.npages; ++p) {
+    if (s->dir.pages[p] == slot_empty_page) s->dir.pages[p] = NULL;
+  }
+  om_dir_free(&s->dir);
+  free(s);
+}
+
+/* make sure page p can be written to. Since keys are assigned incrementally,
+ * p is at most one past the last page in the directory. Returns 0 on success */
+static int slot_page_ready(om_slot_t *s, size_t p) {
+  if (p >= s->dir.npages) {
+    return om_dir_add_page(&s->dir, sizeof(void*));
+  } else if (s->dir.pages[p] == slot_empty_page) { /* released page */
+    void *page = calloc(OM_PAGE_SIZE, sizeof(void*));
+    if (page == NULL) return 1;
+    s->dir.pages[p] = page;
+  }
+  return 0;
+}
+
+objmap_key_t om_slot_push(ObjectMap *om, void *obj) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  objmap_key_t key = om->top;
+
+  if (slot_page_ready(s, key >> OM_PAGE_BITS)) return OBJMAP_ERR_INTERNAL;
+
+  *OM_DIR_ENTRY(&s->dir, void*, key) = obj;
+  ++s->size;
+  ++om->top;
+  return key;
+}
+
+objmap_key_t om_slot_push_n(ObjectMap *om, void **objs, size_t n,
+                            objmap_key_t *out_handles) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  objmap_key_t key, first = om->top, last = first + (objmap_key_t)(n - 1);
+  size_t i, p;
+
+  /* get all pages ready before storing anything */
+  for (p = first >> OM_PAGE_BITS; p <= (size_t)(last >> OM_PAGE_BITS); ++p) {
+    if (slot_page_ready(s, p)) return OBJMAP_ERR_INTERNAL;
+  }
+
+  for (i = 0, key = first; i < n; ++i, ++key) {
+    *OM_DIR_ENTRY(&s->dir, void*, key) = objs[i];
+    if (out_handles) out_handles[i] = key;
+  }
+  s->size += n;
+  om->top = last + 1;
+  return first;
+}
+
+int om_slot_reserve(ObjectMap *om, size_t n) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  objmap_key_t last;
+  size_t p;
+
+  if (n == 0) return 0;
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    return 1; /* not enough keys left */
+  }
+  last = om->top + (objmap_key_t)(n - 1);
+  if (om_dir_reserve(&s->dir, (size_t)(last >> OM_PAGE_BITS) + 1,
+                     sizeof(void*))) {
+    return 1;
+  }
+  /* replace released pages in range */
+  for (p = om->top >> OM_PAGE_BITS; p <= (size_t)(last >> OM_PAGE_BITS); ++p) {
+    if (slot_page_ready(s, p)) return 1;
+  }
+  return 0;
+}
+
+void* om_slot_pop(ObjectMap *om, objmap_key_t handle) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  void **slot, *obj;
+
+  if ((handle >> OM_PAGE_BITS) >= s->dir.npages) return NULL;
+  slot = OM_DIR_ENTRY(&s->dir, void*, handle);
+
+  obj = *slot;
+  if (obj != NULL) {
+    *slot = NULL;
+    --s->size;
+  }
+  return obj;
+}
+
+/* the page directory is small and likely cached, so entries are prefetched
+ * for a batch of handles before any are read */
+size_t om_slot_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                     void **out_ptrs) {
+  const om_slot_t *s = (const om_slot_t*)om->map;
+  void *const *slots[OM_GET_BATCH];
+  size_t i, j, batch, found = 0;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch; ++j) {
+      objmap_key_t h = handles[i + j];
+      if ((h >> OM_PAGE_BITS) >= s->dir.npages) {
+        slots[j] = NULL;
+      } else {
+        slots[j] = OM_DIR_ENTRY(&s->dir, void*, h);
+        OM_PREFETCH(slots[j]);
+      }
+    }
+    for (j = 0; j < batch; ++j) {
+      out_ptrs[i + j] = (slots[j]) ? *slots[j] : NULL;
+      if (out_ptrs[i + j] != NULL) ++found;
+    }
+  }
+  return found;
+}
+
+void om_slot_flush(ObjectMap *om) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  size_t p;
+  objmap_key_t i;
+
+  if (!OM_NEEDS_DEALLOC(om)) { /* objects are released with the pool */
+    for (p = 0; p < s->dir.npages; ++p) {
+      if (s->dir.pages[p] == slot_empty_page) continue;
+      memset(s->dir.pages[p], 0, OM_PAGE_SIZE * sizeof(void*));
+    }
+    s->size = 0;
+    return;
+  }
+
+  /* pages are kept for reuse. Stop scanning once all objects are found */
+  for (p = 0; p < s->dir.npages && s->size > 0; ++p) {
+    void **page = (void**)s->dir.pages[p];
+    if (page == slot_empty_page) continue;
+    for (i = 0; i < OM_PAGE_SIZE; ++i) {
+      if (page[i] == NULL) continue;
+      OM_DEALLOC(om, page[i]);
+      page[i] = NULL;
+      --s->size;
+    }
+  }
+  assert(s->size == 0);
+}
+
+int om_slot_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                 void **obj) {
+  const om_slot_t *s = (const om_slot_t*)om->map;
+  size_t i;
+
+  for (i = *pos; i < end && (i >> OM_PAGE_BITS) < s->dir.npages; ++i) {
+    void **page = (void**)s->dir.pages[i >> OM_PAGE_BITS];
+    if (page == slot_empty_page) { /* skip released page */
+      i |= (size_t)OM_PAGE_MASK;
+    } else if (page[i & OM_PAGE_MASK] != NULL) {
+      *handle = (objmap_key_t)i;
+      *obj = page[i & OM_PAGE_MASK];
+      *pos = i + 1;
+      return 1;
+    }
+  }
+  *pos = i;
+  return 0;
+}
+
+void om_slot_compact(ObjectMap *om) {
+  om_slot_t *s = (om_slot_t*)om->map;
+  size_t p, npages, top_page = om->top >> OM_PAGE_BITS;
+  objmap_key_t i;
+
+  /* release pages with no objects */
+  for (p = 0; p < s->dir.npages; ++p) {
+    void **page = (void**)s->dir.pages[p];
+    if (page == slot_empty_page) continue;
+    i = 0;
+    while (i < OM_PAGE_SIZE && page[i] == NULL) ++i;
+    if (i < OM_PAGE_SIZE) continue;
+    free(page);
+    s->dir.pages[p] = slot_empty_page;
+  }
+
+  /* drop released pages from the end of the directory. The directory must
+   * still reach the page of the next key to be assigned */
+  npages = s->dir.npages;
+  while (npages > 0 && s->dir.pages[npages - 1] == slot_empty_page &&
+         npages > top_page + 1) {
+    --npages;
+  }
+  s->dir.npages = npages;
+
+  if (npages == 0) {
+    om_dir_free(&s->dir);
+  } else if (npages < s->dir.capacity) {
+    void **pages = (void**)realloc(s->dir.pages, npages * sizeof(void*));
+    if (pages != NULL) {
+      s->dir.pages = pages;
+      s->dir.capacity = npages;
+    }
+  }
+}
+
+/* released pages are shared and not counted */
+void om_slot_stats(ObjectMap *om, objmap_stats_t *stats) {
+  const om_slot_t *s = (const om_slot_t*)om->map;
+  size_t p;
+
+  stats->live = s->size;
+  for (p = 0; p < s->dir.npages; ++p) {
+    if (s->dir.pages[p] != slot_empty_page) stats->buckets += OM_PAGE_SIZE;
+  }
+  stats->memory = sizeof(ObjectMap) + sizeof(om_slot_t) +
+                  (s->dir.capacity + stats->buckets) * sizeof(void*);
+}
+
+/* ------------------------------------------------------------------------
+ * Generational engine
+ *
+ * om->top holds the index of the next slot that has never been used.
+ * ------------------------------------------------------------------------ */
+
+om_gen_t* om_gen_new(void) {
+  return (om_gen_t*)calloc(1, sizeof(om_gen_t));
+}
+
+void om_gen_destroy(om_gen_t *g) {
+  if (g == NULL) return;
+  om_dir_free(&g->dir);
+  free(g);
+}
+
+/* empty a slot, advance its generation and append it to the free list */
+static void gen_release(om_gen_t *g, om_gslot_t *slot, objmap_key_t i) {
+  objmap_key_t gen = slot->handle & ~OM_GEN_INDEX_MASK;
+
+  gen = (gen == OM_GEN_LAST) ? 0 : gen + OM_GEN_STEP;
+  slot->handle = gen | i;
+  slot->obj = NULL;
+  slot->next = 0;
+
+  if (g->tail) OM_DIR_ENTRY(&g->dir, om_gslot_t, g->tail)->next = i;
+  else g->head = i;
+  g->tail = i;
+  --g->size;
+}
+
+objmap_key_t om_gen_push(ObjectMap *om, void *obj) {
+  om_gen_t *g = (om_gen_t*)om->map;
+  om_gslot_t *slot;
+  objmap_key_t i;
+
+  if (g->head) { /* recycle the slot that has been free the longest */
+    i = g->head;
+    slot = OM_DIR_ENTRY(&g->dir, om_gslot_t, i);
+    g->head = slot->next;
+    if (!g->head) g->tail = 0;
+  } else { /* use a fresh slot */
+    i = om->top;
+    if (i > OM_GEN_INDEX_MASK) return OBJMAP_ERR_OVERFLOW;
+    if ((i >> OM_PAGE_BITS) >= g->dir.npages &&
+        om_dir_add_page(&g->dir, sizeof(om_gslot_t))) {
+      return OBJMAP_ERR_INTERNAL;
+    }
+    ++om->top;
+    slot = OM_DIR_ENTRY(&g->dir, om_gslot_t, i);
+    slot->handle = i; /* first generation is 0 */
+  }
+
+  slot->obj = obj;
+  slot->next = 0;
+  ++g->size;
+  return slot->handle;
+}
+
+objmap_key_t om_gen_push_n(ObjectMap *om, void **objs, size_t n,
+                           objmap_key_t *out_handles) {
+  om_gen_t *g = (om_gen_t*)om->map;
+  size_t i, nfree = (size_t)(om->top - 1) - g->size; /* slots in free list */
+  objmap_key_t nfresh = OM_GEN_INDEX_MASK + 1 - om->top; /* unused slots */
+
+  if (n > nfree && n - nfree > nfresh) return OBJMAP_ERR_OVERFLOW;
+  if (om_gen_reserve(om, n)) return OBJMAP_ERR_INTERNAL;
+
+  /* cannot fail since there are pages for all fresh slots */
+  for (i = 0; i < n; ++i) out_handles[i] = om_gen_push(om, objs[i]);
+  return out_handles[0];
+}
+
+int om_gen_reserve(ObjectMap *om, size_t n) {
+  om_gen_t *g = (om_gen_t*)om->map;
+  size_t nfree = (size_t)(om->top - 1) - g->size; /* slots in free list */
+  objmap_key_t nfresh = OM_GEN_INDEX_MASK + 1 - om->top; /* unused slots */
+  objmap_key_t last;
+
+  /* recycled slots come first, so only fresh slots need pages */
+  if (n <= nfree) return 0;
+  if (n - nfree > nfresh) return 1;
+  last = om->top + (objmap_key_t)(n - nfree - 1);
+  return om_dir_reserve(&g->dir, (size_t)(last >> OM_PAGE_BITS) + 1,
+                        sizeof(om_gslot_t));
+}
+
+void* om_gen_pop(ObjectMap *om, objmap_key_t handle) {
+  om_gen_t *g = (om_gen_t*)om->map;
+  om_gslot_t *slot;
+  objmap_key_t i = handle & OM_GEN_INDEX_MASK;
+  void *obj;
+
+  if ((i >> OM_PAGE_BITS) >= g->dir.npages) return NULL;
+  slot = OM_DIR_ENTRY(&g->dir, om_gslot_t, i);
+  if (slot->handle != handle || slot->obj == NULL) return NULL; /* stale */
+
+  obj = slot->obj;
+  gen_release(g, slot, i);
+  return obj;
+}
+
+size_t om_gen_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                    void **out_ptrs) {
+  const om_gen_t *g = (const om_gen_t*)om->map;
+  const om_gslot_t *slots[OM_GET_BATCH];
+  size_t i, j, batch, found = 0;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch; ++j) {
+      objmap_key_t idx = handles[i + j] & OM_GEN_INDEX_MASK;
+      if ((idx >> OM_PAGE_BITS) >= g->dir.npages) {
+        slots[j] = NULL;
+      } else {
+        slots[j] = OM_DIR_ENTRY(&g->dir, const om_gslot_t, idx);
+        OM_PREFETCH(slots[j]);
+      }
+    }
+    for (j = 0; j < batch; ++j) {
+      const om_gslot_t *slot = slots[j];
+      out_ptrs[i + j] = (slot && slot->handle == handles[i + j]) ? slot->obj
+                                                                 : NULL;
+      if (out_ptrs[i + j] != NULL) ++found;
+    }
+  }
+  return found;
+}
+
+int om_gen_next(ObjectMap *om, size_t *pos, size_t end, objmap_key_t *handle,
+                void **obj) {
+  const om_gen_t *g = (const om_gen_t*)om->map;
+  size_t i;
+
+  /* the directory is empty until the first push */
+  for (i = *pos;
+       i < end && i < om->top && (i >> OM_PAGE_BITS) < g->dir.npages; ++i) {
+    const om_gslot_t *slot = OM_DIR_ENTRY(&g->dir, const om_gslot_t, i);
+    if (slot->obj == NULL) continue;
+    *handle = slot->handle;
+    *obj = slot->obj;
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+void om_gen_flush(ObjectMap *om) {
+  om_gen_t *g = (om_gen_t*)om->map;
+  objmap_key_t i;
+
+  /* slots are released in index order, so generations are retained and
+   * stale handles remain detectable after a flush */
+  for (i = 1; i < om->top && g->size > 0; ++i) {
+    om_gslot_t *slot = OM_DIR_ENTRY(&g->dir, om_gslot_t, i);
+    if (slot->obj == NULL) continue;
+    OM_DEALLOC(om, slot->obj);
+    gen_release(g, slot, i);
+  }
+  assert(g->size == 0);
+}
+
+void om_gen_stats(ObjectMap *om, objmap_stats_t *stats) {
+  const om_gen_t *g = (const om_gen_t*)om->map;
+
+  stats->live = g->size;
+  stats->buckets = g->dir.npages * OM_PAGE_SIZE;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_gen_t) +
+                  g->dir.capacity * sizeof(void*) +
+                  stats->buckets * sizeof(om_gslot_t);
+}
@@ -0,0 +1,394 @@
+/*!
+ * \file objmap_swiss.c
+ * \brief Swiss table engine: open addressing probed 16 buckets at a time
+ *
+ * Besides its (key, object) slot, each bucket has a control byte which is
+ * either CTRL_EMPTY, CTRL_DELETED or, for a live entry, 7 bits of the hash
+ * of its handle (h2). Control bytes are stored separately, in groups of 16, so
+ * a lookup loads the control bytes of a whole group and compares all of
+ * them with h2 at once (with SSE2 where available). Only the keys of
+ * matching buckets are compared, which rarely means more than the key being
+ * looked up. A group with an empty bucket ends the probe, so most lookups,
+ * including misses, examine a single group. This makes lookups of absent
+ * handles much cheaper than with khash, where a miss steps through
+ * individual buckets until it finds an empty one.
+ *
+ * The remaining hash bits (h1) select the first group to probe. Further
+ * groups are probed 1, 2, 3, ... groups apart, which visits every group of
+ * a power-of-2 table. Unlike khash with integer keys, handles are hashed
+ * with a multiplicative (Fibonacci) hash: placing consecutive handles in
+ * consecutive buckets would fill whole groups, and lookups of absent
+ * handles landing in a run of full groups would have to probe past all of
+ * them. The price is that lookups in the order handles were issued no
+ * longer touch memory sequentially. Deleted entries leave a tombstone
+ * unless their group has an empty bucket, in which case no probe sequence
+ * can have gone past the group and the bucket can be marked empty straight
+ * away.
+ */
+#include <assert.h>
+#include <string.h>
+#include "objmap_internal.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define GROUP 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+/* number of live and deleted entries at which the table is rehashed (7/8
+ * of its buckets). Always leaves at least 2 free buckets */
+#define MAX_USED(capacity) ((capacity) - (capacity) / 8)
+
+typedef struct {
+  objmap_key_t key;
+  void *obj;
+} om_sslot_t;
+
+struct om_swiss_s {
+  uint8_t *ctrl;       /* control byte of each bucket */
+  om_sslot_t *slots;   /* entry of each bucket */
+  size_t capacity;     /* number of buckets: 0 or GROUP * 2^k */
+  size_t size;         /* live entries */
+  size_t used;         /* live and deleted entries */
+  unsigned int shift;  /* hash >> shift gives h1 (k bits) followed by h2 */
+};
+
+/* The top bits of the product depend on all bits of the key, and
+ * consecutive keys are spread evenly over the groups */
+#define SWISS_HASH(t, key) \
+  ((size_t)(((uint64_t)(key) * 0x9E3779B97F4A7C15ULL) >> (t)->shift))
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+
+/* ------------------------------------------------------------------------
+ * Group operations. Each returns a mask with bit i set for each matching
+ * bucket i of the group at ctrl
+ * ------------------------------------------------------------------------ */
+#if defined(__SSE2__)
+
+static inline unsigned int group_load_match(__m128i group, uint8_t byte) {
+  return (unsigned int)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+#define GROUP_LOAD(ctrl) _mm_loadu_si128((const __m128i*)(const void*)(ctrl))
+
+/* buckets whose control byte is h2 */
+static inline unsigned int group_match(const uint8_t *ctrl, uint8_t h2) {
+  return group_load_match(GROUP_LOAD(ctrl), h2);
+}
+
+static inline unsigned int group_empty(const uint8_t *ctrl) {
+  return group_load_match(GROUP_LOAD(ctrl), CTRL_EMPTY);
+}
+
+/* empty or deleted buckets, which are the only ones with the top bit set */
+static inline unsigned int group_free(const uint8_t *ctrl) {
+  return (unsigned int)_mm_movemask_epi8(GROUP_LOAD(ctrl));
+}
+
+#else  /* scalar fallback */
+
+static inline unsigned int group_match(const uint8_t *ctrl, uint8_t h2) {
+  unsigned int i, mask = 0;
+  for (i = 0; i < GROUP; ++i) mask |= (unsigned int)(ctrl[i] == h2) << i;
+  return mask;
+}
+
+static inline unsigned int group_empty(const uint8_t *ctrl) {
+  return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline unsigned int group_free(const uint8_t *ctrl) {
+  unsigned int i, mask = 0;
+  for (i = 0; i < GROUP; ++i) mask |= (unsigned int)(ctrl[i] >> 7) << i;
+  return mask;
+}
+
+#endif
+
+/* ------------------------------------------------------------------------
+ * Table
+ * ------------------------------------------------------------------------ */
+
+om_swiss_t* om_swiss_new(void) {
+  return (om_swiss_t*)calloc(1, sizeof(om_swiss_t));
+}
+
+void om_swiss_destroy(om_swiss_t *t) {
+  if (t == NULL) return;
+  free(t->ctrl);
+  free(t->slots);
+  free(t);
+}
+
+/* bucket holding key, or t->capacity if not found. If probes is not NULL,
+ * it receives the number of groups examined */
+static inline size_t swiss_find(const om_swiss_t *t, objmap_key_t key,
+                                size_t *probes) {
+  size_t hash, g, gmask, step = 0;
+  uint8_t h2;
+
+  if (t->capacity == 0) {
+    if (probes) *probes = 1;
+    return 0;
+  }
+  hash = SWISS_HASH(t, key);
+  gmask = t->capacity / GROUP - 1;
+  g = H1(hash);
+  h2 = H2(hash);
+  for (;;) {
+    const uint8_t *ctrl = t->ctrl + g * GROUP;
+    unsigned int m = group_match(ctrl, h2);
+    while (m != 0) {
+      size_t i = g * GROUP + OM_CTZL(m);
+      if (t->slots[i].key == key) {
+        if (probes) *probes = step + 1;
+        return i;
+      }
+      m &= m - 1;
+    }
+    if (group_empty(ctrl) != 0 || step == gmask) break;
+    g = (g + ++step) & gmask;
+  }
+  if (probes) *probes = step + 1;
+  return t->capacity;
+}
+
+/* store a key known not to be in the table, which must have a free bucket */
+static void swiss_insert(om_swiss_t *t, objmap_key_t key, void *obj) {
+  size_t hash = SWISS_HASH(t, key), gmask = t->capacity / GROUP - 1;
+  size_t i, g = H1(hash), step = 0;
+  unsigned int m;
+
+  while ((m = group_free(t->ctrl + g * GROUP)) == 0) {
+    g = (g + ++step) & gmask;
+  }
+  i = g * GROUP + OM_CTZL(m);
+  if (t->ctrl[i] == CTRL_EMPTY) ++t->used;
+  t->ctrl[i] = H2(hash);
+  t->slots[i].key = key;
+  t->slots[i].obj = obj;
+  ++t->size;
+}
+
+/* move all live entries into a table of the given capacity, dropping
+ * tombstones. Returns 0 on success */
+static int swiss_rehash(om_swiss_t *t, size_t capacity) {
+  om_swiss_t old = *t;
+  size_t i;
+  unsigned int bits = 0;
+
+  while (((size_t)GROUP << bits) < capacity) ++bits;
+  if (capacity > ((size_t)-1 / 2) / (sizeof(om_sslot_t) + 1)) return 1;
+
+  t->ctrl = (uint8_t*)malloc(capacity);
+  t->slots = (om_sslot_t*)malloc(capacity * sizeof(om_sslot_t));
+  if (t->ctrl == NULL || t->slots == NULL) {
+    free(t->ctrl);
+    free(t->slots);
+    *t = old;
+    return 1;
+  }
+  memset(t->ctrl, CTRL_EMPTY, capacity);
+  t->capacity = capacity;
+  t->size = t->used = 0;
+  t->shift = 64 - 7 - bits;
+
+  for (i = 0; i < old.capacity; ++i) {
+    if (!(old.ctrl[i] & 0x80)) {
+      swiss_insert(t, old.slots[i].key, old.slots[i].obj);
+    }
+  }
+  free(old.ctrl);
+  free(old.slots);
+  return 0;
+}
+
+/* smallest capacity holding n entries without rehashing */
+static size_t swiss_capacity_for(size_t n) {
+  size_t capacity = GROUP;
+  while (MAX_USED(capacity) < n) capacity *= 2;
+  return capacity;
+}
+
+/* make room for one more entry. Returns 0 on success */
+static int swiss_make_room(om_swiss_t *t) {
+  if (t->used < MAX_USED(t->capacity)) return 0;
+  /* grow unless at least half the entries are tombstones */
+  if (t->capacity == 0) return swiss_rehash(t, GROUP);
+  if (t->size >= MAX_USED(t->capacity) / 2) {
+    return swiss_rehash(t, t->capacity * 2);
+  }
+  return swiss_rehash(t, t->capacity);
+}
+
+int om_swiss_reserve(ObjectMap *om, size_t n) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+
+  if (n == 0) return 0;
+  if (om->top > OBJMAP_MAX_INDEX || OBJMAP_MAX_INDEX - om->top < n - 1) {
+    return 1; /* not enough keys left */
+  }
+  if (t->used + n <= MAX_USED(t->capacity)) return 0;
+  if (n > (size_t)-1 / 2 - t->size) return 1;
+  return swiss_rehash(t, swiss_capacity_for(t->size + n));
+}
+
+objmap_key_t om_swiss_push(ObjectMap *om, void *obj) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+
+  if (swiss_make_room(t)) return OBJMAP_ERR_INTERNAL;
+  swiss_insert(t, om->top, obj);
+  return om->top++;
+}
+
+objmap_key_t om_swiss_push_n(ObjectMap *om, void **objs, size_t n,
+                             objmap_key_t *out_handles) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+  objmap_key_t first = om->top;
+  size_t i;
+
+  if (om_swiss_reserve(om, n)) return OBJMAP_ERR_INTERNAL;
+  for (i = 0; i < n; ++i) {
+    swiss_insert(t, first + (objmap_key_t)i, objs[i]);
+    if (out_handles) out_handles[i] = first + (objmap_key_t)i;
+  }
+  om->top += (objmap_key_t)n;
+  return first;
+}
+
+void* om_swiss_get(ObjectMap *om, objmap_key_t handle) {
+  const om_swiss_t *t = (const om_swiss_t*)om->map;
+  size_t i = swiss_find(t, handle, NULL);
+  return (i < t->capacity) ? t->slots[i].obj : NULL;
+}
+
+/* the control bytes and slots of the first group of each handle in a batch
+ * are prefetched before any are probed */
+size_t om_swiss_get_n(ObjectMap *om, const objmap_key_t *handles, size_t n,
+                      void **out_ptrs) {
+  const om_swiss_t *t = (const om_swiss_t*)om->map;
+  size_t i, j, batch, found = 0;
+
+  for (i = 0; i < n; i += batch) {
+    batch = (n - i < OM_GET_BATCH) ? n - i : OM_GET_BATCH;
+    for (j = 0; j < batch && t->capacity > 0; ++j) {
+      size_t g = H1(SWISS_HASH(t, handles[i + j]));
+      OM_PREFETCH(t->ctrl + g * GROUP);
+      OM_PREFETCH(t->slots + g * GROUP);
+    }
+    for (j = 0; j < batch; ++j) {
+      size_t k = swiss_find(t, handles[i + j], NULL);
+      out_ptrs[i + j] = (k < t->capacity) ? t->slots[k].obj : NULL;
+      if (k < t->capacity) ++found;
+    }
+  }
+  return found;
+}
+
+void* om_swiss_pop(ObjectMap *om, objmap_key_t handle) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+  size_t i = swiss_find(t, handle, NULL);
+
+  if (i >= t->capacity) return NULL;
+  if (group_empty(t->ctrl + i / GROUP * GROUP) != 0) {
+    t->ctrl[i] = CTRL_EMPTY;
+    --t->used;
+  } else {
+    t->ctrl[i] = CTRL_DELETED;
+  }
+  --t->size;
+  return t->slots[i].obj;
+}
+
+void om_swiss_flush(ObjectMap *om) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+  size_t i;
+
+  for (i = 0; OM_NEEDS_DEALLOC(om) && i < t->capacity && t->size > 0; ++i) {
+    if (t->ctrl[i] & 0x80) continue;
+    OM_DEALLOC(om, t->slots[i].obj);
+    --t->size;
+  }
+  if (t->capacity > 0) memset(t->ctrl, CTRL_EMPTY, t->capacity);
+  t->size = t->used = 0;
+}
+
+/* shrink to leave the table half full at most, as for the hashtable
+ * engine, and drop tombstones */
+void om_swiss_compact(ObjectMap *om) {
+  om_swiss_t *t = (om_swiss_t*)om->map;
+  size_t capacity;
+
+  if (t->size == 0) {
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(om_swiss_t));
+    return;
+  }
+  capacity = swiss_capacity_for(t->size * 2);
+  if (capacity > t->capacity) capacity = t->capacity;
+  if (capacity < t->capacity || t->used > t->size) {
+    swiss_rehash(t, capacity); /* keeps old table on failure */
+  }
+}
+
+/* live buckets of a group are found from its control bytes */
+int om_swiss_next(ObjectMap *om, size_t *pos, size_t end,
+                  objmap_key_t *handle, void **obj) {
+  const om_swiss_t *t = (const om_swiss_t*)om->map;
+  size_t i = *pos;
+
+  if (end > t->capacity) end = t->capacity;
+  while (i < end) {
+    unsigned int live = ~group_free(t->ctrl + i / GROUP * GROUP) & 0xFFFFu;
+    live >>= i % GROUP;
+    if (live == 0) { /* move to next group */
+      i = (i | (GROUP - 1)) + 1;
+      continue;
+    }
+    i += OM_CTZL(live);
+    if (i >= end) break;
+    *handle = t->slots[i].key;
+    *obj = t->slots[i].obj;
+    *pos = i + 1;
+    return 1;
+  }
+  *pos = i;
+  return 0;
+}
+
+size_t om_swiss_extent(const ObjectMap *om) {
+  return ((const om_swiss_t*)om->map)->capacity;
+}
+
+/* number of groups examined when looking up key */
+static size_t swiss_probe_length(ObjectMap *om, objmap_key_t key) {
+  size_t probes;
+  swiss_find((const om_swiss_t*)om->map, key, &probes);
+  return probes;
+}
+
+/* probe lengths are counted in groups. Samples are taken as for the
+ * hashtable engine */
+void om_swiss_stats(ObjectMap *om, objmap_stats_t *stats) {
+  const om_swiss_t *t = (const om_swiss_t*)om->map;
+  size_t i;
+  objmap_key_t key;
+
+  stats->live = t->size;
+  stats->tombstones = t->used - t->size;
+  stats->buckets = t->capacity;
+  stats->memory = sizeof(ObjectMap) + sizeof(om_swiss_t) +
+                  t->capacity * (1 + sizeof(om_sslot_t));
+  if (t->capacity == 0) return;
+
+  om_stats_sample_hits(om, om_swiss_next, t->capacity, t->size,
+                       swiss_probe_length, stats->probe_hit);
+  for (i = 0, key = om->top; i < OM_STATS_SAMPLES; ++i, ++key) {
+    if (key < om->top) break; /* out of keys */
+    om_stats_probe(stats->probe_miss, swiss_probe_length(om, key));
+  }
+}